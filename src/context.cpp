@@ -4,17 +4,10 @@
 
 namespace swan {
 
-void DumpTensor1d(std::string file, const Tensor1d& tensor) {
+template <size_t N>
+void DumpTensor1d(std::string file, const float (&tensor)[N]) {
   std::ofstream fs(file);
-  for (int i = 0; i < kDim; ++i) {
-    fs << tensor[i] << std::endl;
-  }
-  fs.close();
-}
-
-void DumpTensor1dFFNB(std::string file, const Tensor1dFFNB& tensor) {
-  std::ofstream fs(file);
-  for (int i = 0; i < kFFNDim; ++i) {
+  for (size_t i = 0; i < N; ++i) {
     fs << tensor[i] << std::endl;
   }
   fs.close();
@@ -22,15 +15,12 @@ void DumpTensor1dFFNB(std::string file, const Tensor1dFFNB& tensor) {
 
 // Dump the context to files.
 // The files are named as prefix + field_name.
-void DumpContext(std::string prefix, const Context& ctx, int n_layers) {
+template <class S>
+void DumpContext(std::string prefix, const Context<S>& ctx, int n_layers) {
   DumpTensor1d(prefix + "input", ctx.input);
   for (int layer = 0; layer < n_layers; ++layer) {
     DumpTensor1d(prefix + std::to_string(layer) + "_attn_norm",
                  ctx.attn_norm[layer]);
-    DumpTensor1d(prefix + std::to_string(layer) + "_attn_wqx",
-                 ctx.attn_wqx[layer]);
-    DumpTensor1d(prefix + std::to_string(layer) + "_attn_wkx",
-                 ctx.attn_wkx[layer]);
     DumpTensor1d(prefix + std::to_string(layer) + "_attn_wvx",
                  ctx.attn_wvx[layer]);
     DumpTensor1d(prefix + std::to_string(layer) + "_attn_q_rope",
@@ -45,14 +35,16 @@ void DumpContext(std::string prefix, const Context& ctx, int n_layers) {
                  ctx.attn_res[layer]);
     DumpTensor1d(prefix + std::to_string(layer) + "_ffn_norm",
                  ctx.ffn_norm[layer]);
-    DumpTensor1dFFNB(prefix + std::to_string(layer) + "_ffn_w1x",
-                     ctx.ffn_w1x[layer]);
-    DumpTensor1dFFNB(prefix + std::to_string(layer) + "_ffn_w3x",
-                     ctx.ffn_w3x[layer]);
-    DumpTensor1dFFNB(prefix + std::to_string(layer) + "_ffn_act",
-                     ctx.ffn_act[layer]);
-    DumpTensor1dFFNB(prefix + std::to_string(layer) + "_ffn_dot",
-                     ctx.ffn_dot[layer]);
+#ifndef USE_CPU_ONLY
+    DumpTensor1d(prefix + std::to_string(layer) + "_ffn_w1x",
+                 ctx.ffn_w1x[layer]);
+    DumpTensor1d(prefix + std::to_string(layer) + "_ffn_w3x",
+                 ctx.ffn_w3x[layer]);
+    DumpTensor1d(prefix + std::to_string(layer) + "_ffn_act",
+                 ctx.ffn_act[layer]);
+#endif // USE_CPU_ONLY
+    DumpTensor1d(prefix + std::to_string(layer) + "_ffn_dot",
+                 ctx.ffn_dot[layer]);
     DumpTensor1d(prefix + std::to_string(layer) + "_ffn_out",
                  ctx.ffn_out[layer]);
     DumpTensor1d(prefix + std::to_string(layer) + "_ffn_res",
@@ -62,4 +54,33 @@ void DumpContext(std::string prefix, const Context& ctx, int n_layers) {
   // DumpTensor1d(prefix + "logits", ctx.logits);
 }
 
+template <class S>
+void StoreLayerContext(Context<S>& ctx, const LayerContext<S>& lc, int layer) {
+  CopyTensor1d(ctx.attn_norm[layer], lc.attn_norm);
+  CopyTensor1d(ctx.attn_wvx[layer], lc.attn_wvx);
+  CopyTensor1d(ctx.attn_q_r[layer], lc.attn_q_r);
+  CopyTensor1d(ctx.attn_k_r[layer], lc.attn_k_r);
+#ifndef USE_CPU_ONLY
+  CopyTensor1d(ctx.attn_qk[layer], lc.attn_qk);
+  CopyTensor1d(ctx.attn_sm[layer], lc.attn_sm);
+#endif // USE_CPU_ONLY
+  CopyTensor1d(ctx.attn_val[layer], lc.attn_val);
+  CopyTensor1d(ctx.attn_out[layer], lc.attn_out);
+  CopyTensor1d(ctx.ffn_norm[layer], lc.ffn_norm);
+#ifndef USE_CPU_ONLY
+  CopyTensor1d(ctx.ffn_w1x[layer], lc.ffn_w1x);
+  CopyTensor1d(ctx.ffn_w3x[layer], lc.ffn_w3x);
+  CopyTensor1d(ctx.ffn_act[layer], lc.ffn_act);
+#endif // USE_CPU_ONLY
+  CopyTensor1d(ctx.ffn_dot[layer], lc.ffn_dot);
+  CopyTensor1d(ctx.ffn_out[layer], lc.ffn_out);
+  CopyTensor1d(ctx.ffn_res[layer], lc.x);
+}
+
+#define SWAN_INSTANTIATE_DUMP_CONTEXT(S)            \
+  template decltype(DumpContext<S>) DumpContext<S>; \
+  template decltype(StoreLayerContext<S>) StoreLayerContext<S>;
+SWAN_MODEL_SHAPES(SWAN_INSTANTIATE_DUMP_CONTEXT)
+#undef SWAN_INSTANTIATE_DUMP_CONTEXT
+
 } // namespace swan
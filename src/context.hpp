@@ -7,42 +7,99 @@
 
 namespace swan {
 
+template <class S>
 struct Context {
   // Input
-  Tensor1d input; // [dim]
+  typename S::Tensor1d input; // [dim]
 
   // Attention
-  Tensor2dRMS attn_norm; // [layer, dim]
-  Tensor2dRMS attn_wqx;  // [layer, dim]
-  Tensor2dRMS attn_wkx;  // [layer, dim]
-  Tensor2dRMS attn_wvx;  // [layer, dim]
-  Tensor2dRMS attn_q_r;  // [layer, dim]
-  Tensor2dRMS attn_k_r;  // [layer, dim]
-  Tensor2dQKSM attn_qk;  // [layer, seq_len]
-  Tensor2dQKSM attn_sm;  // [layer, seq_len]
-  Tensor2dRMS attn_val;  // [layer, dim]
-  Tensor2dRMS attn_out;  // [layer, dim]
-  Tensor2dRMS attn_res;  // [layer, dim]
+  typename S::Tensor2dRMS attn_norm;  // [layer, dim]
+  typename S::Tensor2dRMSKV attn_wvx; // [layer, kv_dim]
+  typename S::Tensor2dRMS attn_q_r;   // [layer, dim]
+  typename S::Tensor2dRMSKV attn_k_r; // [layer, kv_dim]
+  typename S::Tensor2dQKSM attn_qk;   // [layer, seq_len]
+  typename S::Tensor2dQKSM attn_sm;   // [layer, seq_len]
+  typename S::Tensor2dRMS attn_val;   // [layer, dim]
+  typename S::Tensor2dRMS attn_out;   // [layer, dim]
+  typename S::Tensor2dRMS attn_res;   // [layer, dim]
 
   // FFN
-  Tensor2dRMS ffn_norm; // [layer, dim]
-  Tensor2dFFNC ffn_w1x; // [layer, ffn_dim]
-  Tensor2dFFNC ffn_w3x; // [layer, ffn_dim]
-  Tensor2dFFNC ffn_act; // [layer, ffn_dim]
-  Tensor2dFFNC ffn_dot; // [layer, ffn_dim]
-  Tensor2dRMS ffn_out;  // [layer, dim]
-  Tensor2dRMS ffn_res;  // [layer, dim]
+  typename S::Tensor2dRMS ffn_norm; // [layer, dim]
+#ifndef USE_CPU_ONLY
+  // The fused CPU kernel keeps w1 . x, w3 . x and SiLU in registers.
+  typename S::Tensor2dFFNC ffn_w1x; // [layer, ffn_dim]
+  typename S::Tensor2dFFNC ffn_w3x; // [layer, ffn_dim]
+  typename S::Tensor2dFFNC ffn_act; // [layer, ffn_dim]
+#endif // USE_CPU_ONLY
+  typename S::Tensor2dFFNC ffn_dot; // [layer, ffn_dim]
+  typename S::Tensor2dRMS ffn_out;  // [layer, dim]
+  typename S::Tensor2dRMS ffn_res;  // [layer, dim]
 
   // Output
   // Tensor1d final_norm;    // [dim]
   // Tensor1dLogits logits;  // [vocab_size]
 
   // Cache
-  // Tensor3dCache k_cache;  // [layer, seq_len, dim]
-  // Tensor3dCache v_cache;  // [layer, seq_len, dim]
+  // KVCache kv_cache;  // [layer, kv_head, seq_len, head_dim]
 };
 
-void DumpContext(std::string prefix, const Context& ctx, int n_layers);
+// Activations of one layer of one token.
+// Decode reuses a single LayerContext for every layer, so its working set
+// stays in L1/L2 instead of spreading over a Context. The residual stream
+// lives in x and both residual adds update it in place; layer 0 reads the
+// embedding straight from the table instead.
+template <class S>
+struct LayerContext {
+  typename S::Tensor1d x; // [dim], attn_res and then ffn_res of each layer
+
+  // Attention
+  typename S::Tensor1d attn_norm;   // [dim]
+  typename S::Tensor1dKV attn_wvx;  // [kv_dim]
+  typename S::Tensor1d attn_q_r;    // [dim]
+  typename S::Tensor1dKV attn_k_r;  // [kv_dim]
+#ifndef USE_CPU_ONLY
+  // Scores of the FPGA head loop; the CPU fuses them into Attention.
+  typename S::Tensor1dQKSM attn_qk; // [seq_len]
+  typename S::Tensor1dQKSM attn_sm; // [seq_len]
+#endif // USE_CPU_ONLY
+  typename S::Tensor1d attn_val;    // [dim]
+  typename S::Tensor1d attn_out;    // [dim]
+
+  // FFN
+  typename S::Tensor1d ffn_norm;    // [dim]
+#ifndef USE_CPU_ONLY
+  typename S::Tensor1dFFNB ffn_w1x; // [ffn_dim]
+  typename S::Tensor1dFFNB ffn_w3x; // [ffn_dim]
+  typename S::Tensor1dFFNB ffn_act; // [ffn_dim]
+#endif // USE_CPU_ONLY
+  typename S::Tensor1dFFNB ffn_dot; // [ffn_dim]
+  typename S::Tensor1d ffn_out;     // [dim]
+};
+
+// Copy the activations of the given layer into its slot of ctx, except
+// attn_res, which x holds only until the FFN adds to it. On the CPU,
+// Decode writes attn_qk and attn_sm of ctx itself.
+template <class S>
+void StoreLayerContext(Context<S>& ctx, const LayerContext<S>& lc, int layer);
+
+// Tokens run together through the batched matrix-matrix products.
+constexpr int kMaxBatch = 64;
+
+// Activations of one batch of tokens, [token, ...].
+template <class S>
+struct BatchContext {
+  typename S::Tensor1d x[kMaxBatch];    // residual stream
+  typename S::Tensor1d norm[kMaxBatch]; // attn / ffn RMSNorm
+  typename S::Tensor1d q[kMaxBatch];
+  typename S::Tensor1dKV k[kMaxBatch];
+  typename S::Tensor1dKV v[kMaxBatch];
+  typename S::Tensor1d val[kMaxBatch]; // merged heads
+  typename S::Tensor1d out[kMaxBatch]; // wo / w2 projection
+  typename S::Tensor1dFFNB ffn[kMaxBatch];
+};
+
+template <class S>
+void DumpContext(std::string prefix, const Context<S>& ctx, int n_layers);
 
 } // namespace swan
 
@@ -1,17 +1,36 @@
 #include "decode.hpp"
 
+#include "tensor_cpu.hpp"
+
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 
 namespace swan {
 
+#ifdef USE_CPU_ONLY
+// RMSNorm of a layer input with its gain, unless PackModel folded the gain
+// into the projection that follows.
+template <class S>
+static void NormalizeInput(typename S::Tensor1d& out,
+                           const typename S::Tensor1d& in,
+                           const typename S::Tensor1d& gain,
+                           const Model<S>& model) {
+  if (model.fold_norm) {
+    RMSNorm(out, in);
+  } else {
+    RMSNorm(out, in, gain);
+  }
+}
+#endif // USE_CPU_ONLY
+
 // Generate text from the model.
 // This function is executed on the FPGA.
-void Decode(int tok, // new token
+template <class S>
+bool Decode(int tok, // new token
             int pos, // new token position
-            const Tensor1d& ctx_input, Tensor3dCache& ctx_k_cache,
-            Tensor3dCache& ctx_v_cache, Tensor1d& ctx_final_norm,
-            const Weights& w
+            Session<S>& session, typename S::Tensor1d& ctx_final_norm,
+            const Model<S>& model
 #ifndef USE_CPU_ONLY
             ,
             cl::CommandQueue q, cl::Kernel kernel_matmul, cl::Kernel kernel_mul,
@@ -24,192 +43,386 @@ void Decode(int tok, // new token
 #endif // USE_CPU_ONLY
 ) {
 
-  static Context ctx;
+  LayerContext<S>& lc = session.layer;
+  KVCache<S>& kv_cache = session.kv_cache;
+  const Weights<S>& w = *model.w;
+  if (!ReserveKV(kv_cache, pos)) {
+    return false;
+  }
 
-  const int head_dim = kDim / kNumLayers;
+  const int head_dim = S::kHeadDim;
   float norm = 1 / std::sqrt(head_dim); // 1/√d for sm(QK/√d)V
+#ifdef USE_CPU_ONLY
+  if (model.fold_norm) {
+    norm = 1; // already in wq
+  }
+#endif
 
-  // Embedding
-  Tensor1d attn_input;
-  for (int i_layer = 0; i_layer < kNumLayers; ++i_layer) {
+  // Embedding, read in place from the table.
+  const typename S::Tensor1d& ctx_input = w.tok_emb_table[tok];
+  if (session.trace) {
+    CopyTensor1d(session.trace->input, ctx_input);
+  }
 
-    if (i_layer == 0) {
-      for (int idx = 0; idx < kDim; idx++) {
-        attn_input[idx] = ctx_input[idx];
-      }
-    } else {
-      for (int idx = 0; idx < kDim; idx++) {
-        attn_input[idx] = ctx.ffn_res[i_layer - 1][idx];
-      }
-    }
+  for (int i_layer = 0; i_layer < S::kNumLayers; ++i_layer) {
+
+    // Layer input; the residual adds below update lc.x in place.
+    const typename S::Tensor1d& attn_input =
+        i_layer == 0 ? ctx_input : lc.x;
 
     // -- Attention --
 
     // 1. RMS Normalize
 #ifndef USE_CPU_ONLY
-    RMSNormFPGA(ctx.attn_norm[i_layer], attn_input, w.rms_att_w[i_layer], q,
+    RMSNormFPGA(lc.attn_norm, attn_input, w.rms_att_w[i_layer], q,
                 kernel_rmsnorm, ptr_a, ptr_b, ptr_result, buffer_a, buffer_b,
                 buffer_result);
 #else
-    RMSNorm(ctx.attn_norm[i_layer], attn_input, w.rms_att_w[i_layer]);
+    NormalizeInput(lc.attn_norm, attn_input, w.rms_att_w[i_layer], model);
 #endif
 
-    // 2. Weight Multiple
+    // 2. Weight Multiple and RoPE
+    //    q, k and v come out of one projection over the stacked weights,
+    //    with q and k already rotated for this position.
 #ifndef USE_CPU_ONLY
-    MatmulFPGA(ctx.attn_wqx[i_layer], ctx.attn_norm[i_layer],
-               w.attn_wq[i_layer], q, kernel_matmul, ptr_a, ptr_b, ptr_result,
-               buffer_a, buffer_b, buffer_result);
-    MatmulFPGA(ctx.attn_wkx[i_layer], ctx.attn_norm[i_layer],
-               w.attn_wk[i_layer], q, kernel_matmul, ptr_a, ptr_b, ptr_result,
-               buffer_a, buffer_b, buffer_result);
-    MatmulFPGA(ctx.attn_wvx[i_layer], ctx.attn_norm[i_layer],
-               w.attn_wv[i_layer], q, kernel_matmul, ptr_a, ptr_b, ptr_result,
-               buffer_a, buffer_b, buffer_result);
-#else
-    Matmul(ctx.attn_wqx[i_layer], ctx.attn_norm[i_layer], w.attn_wq[i_layer]);
-    Matmul(ctx.attn_wkx[i_layer], ctx.attn_norm[i_layer], w.attn_wk[i_layer]);
-    Matmul(ctx.attn_wvx[i_layer], ctx.attn_norm[i_layer], w.attn_wv[i_layer]);
-#endif
+    MatmulQKVFPGA(lc.attn_q_r, lc.attn_k_r,
+                  lc.attn_wvx, lc.attn_norm,
+                  model.attn_wqkv[i_layer], w.cos_table[pos], w.sin_table[pos],
+                  q, kernel_matmul, ptr_a, ptr_b, ptr_result, buffer_a,
+                  buffer_b, buffer_result);
 
-    // 3. RoPE for each head
-    for (int head = 0; head < kNumHeads; ++head) {
-#ifndef USE_CPU_ONLY
-      RoPEFPGA(ctx.attn_q_r[i_layer], ctx.attn_k_r[i_layer],
-               ctx.attn_wqx[i_layer], ctx.attn_wkx[i_layer], w.cos_table[pos],
-               w.sin_table[pos], head * head_dim, head_dim, q, kernel_rope,
-               ptr_a, ptr_b, ptr_c, ptr_d, ptr_result, ptr_result2, buffer_a,
-               buffer_b, buffer_c, buffer_d, buffer_result, buffer_result2);
+    // 3. Key / Value Cache
+    StoreKV(kv_cache, i_layer, pos, lc.attn_k_r,
+            lc.attn_wvx);
 #else
-      RoPE(ctx.attn_q_r[i_layer], ctx.attn_k_r[i_layer], ctx.attn_wqx[i_layer],
-           ctx.attn_wkx[i_layer], w.cos_table[pos], w.sin_table[pos],
-           head * head_dim, head_dim);
-#endif
-    }
+    //    fp32 keys, and values unless transposed, are written straight into
+    //    their cache slots; the rest goes through lc for StoreKV. A trace
+    //    wants every projection in lc.
+    float* k_slot = session.trace ? nullptr : KeySlot(kv_cache, i_layer, pos);
+    float* v_slot =
+        session.trace ? nullptr : ValueSlot(kv_cache, i_layer, pos);
+    const size_t slot_stride = KVBlockOffset<S>(0, 1);
+    GemvQKVStrided(lc.attn_q_r, k_slot ? k_slot : lc.attn_k_r,
+                   k_slot ? slot_stride : head_dim,
+                   v_slot ? v_slot : lc.attn_wvx,
+                   v_slot ? slot_stride : head_dim, lc.attn_norm,
+                   model.wqkv[i_layer], S::kKVDim, w.cos_table[pos],
+                   w.sin_table[pos], head_dim);
 
-    // 4. Key / Value Cache
-    CopyTensor1d(ctx_k_cache[i_layer][pos], ctx.attn_k_r[i_layer]);
-    CopyTensor1d(ctx_v_cache[i_layer][pos], ctx.attn_wvx[i_layer]);
+    // 3. Key / Value Cache
+    if (!k_slot || !v_slot) {
+      StoreKV(kv_cache, i_layer, pos, k_slot ? nullptr : lc.attn_k_r,
+              v_slot ? nullptr : lc.attn_wvx);
+    }
+#endif
 
-    // 5. Multi-Head Attention
-    for (int i_head = 0; i_head < kNumHeads; ++i_head) {
+    // 4. Multi-Head Attention
+    //    Each head reads the cache of its KV head over positions 0..pos,
+    //    including the one just stored; on the FPGA that is one page.
+#ifndef USE_CPU_ONLY
+    const int vt_stride =
+        kv_cache.pool->layout == KVLayout::kVTransposed ? KVPageLen<S>() : 0;
+    const int kv_group = S::kNumHeads / S::kNumKVHeads; // heads per KV head
+    for (int i_head = 0; i_head < S::kNumHeads; ++i_head) {
 
-      int head_begin = i_head * head_dim;
-      int head_end = (i_head + 1) * head_dim;
+      const int kv_head = i_head / kv_group;
+      const float* q_head = lc.attn_q_r + i_head * head_dim;
+      const float* k_block = KeyBlock(kv_cache, i_layer, kv_head);
+      const float* v_block = ValueBlock(kv_cache, i_layer, kv_head);
+      float* head_val = lc.attn_val + i_head * head_dim;
 
-      // 5-1. QK
-      MutmulRanged(ctx.attn_qk[i_layer], ctx.attn_q_r[i_layer],
-                   ctx_k_cache[i_layer], 0, pos, head_begin, head_end);
+      // 4-1. QK
+      AttentionScores(lc.attn_qk, q_head, k_block, pos + 1,
+                      head_dim);
 
-      // 5-2. QK * 1/√d
-#ifndef USE_CPU_ONLY
-      MulFPGA(ctx.attn_qk[i_layer], ctx.attn_qk[i_layer], norm, q, kernel_mul,
+      // 4-2. QK * 1/√d
+      MulFPGA(lc.attn_qk, lc.attn_qk, norm, q, kernel_mul,
               ptr_a, ptr_b, ptr_result, buffer_a, buffer_b, buffer_result);
-#else
-      Mul(ctx.attn_qk[i_layer], ctx.attn_qk[i_layer], norm);
-#endif
 
-      // 5-3. Softmax( QK/√d )
-#ifndef USE_CPU_ONLY
-      SoftmaxFPGA(ctx.attn_sm[i_layer], ctx.attn_qk[i_layer], pos + 1, q,
+      // 4-3. Softmax( QK/√d )
+      SoftmaxFPGA(lc.attn_sm, lc.attn_qk, pos + 1, q,
                   kernel_softmax, ptr_a, ptr_result, buffer_a, buffer_result);
-#else
-      Softmax(ctx.attn_sm[i_layer], ctx.attn_qk[i_layer], pos + 1);
-#endif
 
-      // 5-4. Softmax(QK/√d) . V
-      MutmulRangedTranspose(ctx.attn_val[i_layer], ctx.attn_sm[i_layer],
-                            ctx_v_cache[i_layer], head_begin, head_end, 0,
-                            pos + 1);
+      // 4-4. Softmax(QK/√d) . V
+      if (vt_stride > 0) {
+        AttentionValuesT(head_val, lc.attn_sm, v_block, pos + 1,
+                         head_dim, vt_stride);
+      } else {
+        AttentionValues(head_val, lc.attn_sm, v_block, pos + 1,
+                        head_dim);
+      }
     }
+#else
+    // 4-1..4. Softmax(QK/√d) . V
+    //         One online-softmax pass per head, with the heads and long
+    //         sequences split across the thread pool.
+    Attention(lc.attn_val, lc.attn_q_r,
+              KeyView(kv_cache, i_layer), ValueView(kv_cache, i_layer),
+              pos + 1, S::kNumHeads, S::kNumKVHeads, head_dim, norm);
+    if (session.trace) {
+      // The fused pass keeps no scores, so a trace recomputes those of the
+      // last head, which the FPGA loop above leaves behind.
+      const int head = S::kNumHeads - 1;
+      AttentionProbs(session.trace->attn_qk[i_layer],
+                     session.trace->attn_sm[i_layer],
+                     lc.attn_q_r + head * head_dim, KeyView(kv_cache, i_layer),
+                     head / (S::kNumHeads / S::kNumKVHeads), pos + 1, head_dim,
+                     norm);
+    }
+#endif
 
-    // 6. Output (Merge Heads)
+    // 5. Output (Merge Heads)
 #ifndef USE_CPU_ONLY
-    MatmulFPGA(ctx.attn_out[i_layer], ctx.attn_val[i_layer], w.attn_wo[i_layer],
+    MatmulFPGA(lc.attn_out, lc.attn_val, w.attn_wo[i_layer],
                q, kernel_matmul, ptr_a, ptr_b, ptr_result, buffer_a, buffer_b,
                buffer_result);
 #else
-    Matmul(ctx.attn_out[i_layer], ctx.attn_val[i_layer], w.attn_wo[i_layer]);
+    MatmulCPU(lc.attn_out, lc.attn_val, model.wo[i_layer]);
 #endif
 
-    // 7. Res connect
+    // 6. Res connect
 #ifndef USE_CPU_ONLY
-    AddFPGA(ctx.attn_res[i_layer], attn_input, ctx.attn_out[i_layer], q,
+    AddFPGA(lc.x, attn_input, lc.attn_out, q,
             kernel_add, ptr_a, ptr_b, ptr_result, buffer_a, buffer_b,
             buffer_result);
 #else
-    Add(ctx.attn_res[i_layer], attn_input, ctx.attn_out[i_layer]);
+    Add(lc.x, attn_input, lc.attn_out);
 #endif
+    if (session.trace) {
+      CopyTensor1d(session.trace->attn_res[i_layer], lc.x);
+    }
 
     // -- FFN --
 
     // 1. RMS Normalize
 #ifndef USE_CPU_ONLY
-    RMSNormFPGA(ctx.ffn_norm[i_layer], ctx.attn_res[i_layer],
+    RMSNormFPGA(lc.ffn_norm, lc.x,
                 w.rms_ffn_w[i_layer], q, kernel_rmsnorm, ptr_a, ptr_b,
                 ptr_result, buffer_a, buffer_b, buffer_result);
 #else
-    RMSNorm(ctx.ffn_norm[i_layer], ctx.attn_res[i_layer], w.rms_ffn_w[i_layer]);
+    NormalizeInput(lc.ffn_norm, lc.x, w.rms_ffn_w[i_layer], model);
 #endif
 
-    // 2. w1 . x
 #ifndef USE_CPU_ONLY
-    MatmulFPGA(ctx.ffn_w1x[i_layer], ctx.ffn_norm[i_layer], w.ffn_w1[i_layer],
+    // 2. w1 . x
+    MatmulFPGA(lc.ffn_w1x, lc.ffn_norm, w.ffn_w1[i_layer],
                q, kernel_matmul, ptr_a, ptr_b, ptr_result, buffer_a, buffer_b,
                buffer_result);
-#else
-    Matmul(ctx.ffn_w1x[i_layer], ctx.ffn_norm[i_layer], w.ffn_w1[i_layer]);
-#endif
 
     // 3. w3 . x
-#ifndef USE_CPU_ONLY
-    MatmulFPGA(ctx.ffn_w3x[i_layer], ctx.ffn_norm[i_layer], w.ffn_w3[i_layer],
+    MatmulFPGA(lc.ffn_w3x, lc.ffn_norm, w.ffn_w3[i_layer],
                q, kernel_matmul, ptr_a, ptr_b, ptr_result, buffer_a, buffer_b,
                buffer_result);
-#else
-    Matmul(ctx.ffn_w3x[i_layer], ctx.ffn_norm[i_layer], w.ffn_w3[i_layer]);
-#endif
 
     // 4. SiLU( w1x )
-    SiLU(ctx.ffn_act[i_layer], ctx.ffn_w1x[i_layer]);
+    SiLU(lc.ffn_act, lc.ffn_w1x);
 
     // 5. SiLU(w1x) * w3x
-#ifndef USE_CPU_ONLY
-    MulFPGA(ctx.ffn_dot[i_layer], ctx.ffn_act[i_layer], ctx.ffn_w3x[i_layer], q,
+    MulFPGA(lc.ffn_dot, lc.ffn_act, lc.ffn_w3x, q,
             kernel_mul, ptr_a, ptr_b, ptr_result, buffer_a, buffer_b,
             buffer_result);
 #else
-    Mul(ctx.ffn_dot[i_layer], ctx.ffn_act[i_layer], ctx.ffn_w3x[i_layer]);
+    // 2-5. SiLU(w1x) * w3x
+    //      Both projections come from one sweep over the interleaved w1/w3
+    //      rows; only the gated activation is written.
+    MatmulSwiGLUCPU(lc.ffn_dot, lc.ffn_norm,
+                    model.w13[i_layer]);
 #endif
 
     // 6. w2 . SiLU(w1x)*w3x
 #ifndef USE_CPU_ONLY
-    MatmulFPGA(ctx.ffn_out[i_layer], ctx.ffn_dot[i_layer], w.ffn_w2[i_layer], q,
+    MatmulFPGA(lc.ffn_out, lc.ffn_dot, w.ffn_w2[i_layer], q,
                kernel_matmul, ptr_a, ptr_b, ptr_result, buffer_a, buffer_b,
                buffer_result);
 #else
-    Matmul(ctx.ffn_out[i_layer], ctx.ffn_dot[i_layer], w.ffn_w2[i_layer]);
+    MatmulCPU(lc.ffn_out, lc.ffn_dot, model.w2[i_layer]);
 #endif
 
     // 7. Res connect
 #ifndef USE_CPU_ONLY
-    AddFPGA(ctx.ffn_res[i_layer], ctx.attn_res[i_layer], ctx.ffn_out[i_layer],
+    AddFPGA(lc.x, lc.x, lc.ffn_out,
             q, kernel_add, ptr_a, ptr_b, ptr_result, buffer_a, buffer_b,
             buffer_result);
 #else
-    Add(ctx.ffn_res[i_layer], ctx.attn_res[i_layer], ctx.ffn_out[i_layer]);
+    Add(lc.x, lc.x, lc.ffn_out);
 #endif
+
+    // Keep a copy of every layer only when tracing.
+    if (session.trace) {
+      StoreLayerContext(*session.trace, lc, i_layer);
+    }
   }
 
   // -- Final RMS Normalize --
 #ifndef USE_CPU_ONLY
-  RMSNormFPGA(ctx_final_norm, ctx.ffn_res[kNumLayers - 1], w.rms_final, q,
-              kernel_rmsnorm, ptr_a, ptr_b, ptr_result, buffer_a, buffer_b,
+  RMSNormFPGA(ctx_final_norm, lc.x, w.rms_final,
+              q, kernel_rmsnorm, ptr_a, ptr_b, ptr_result, buffer_a, buffer_b,
               buffer_result);
 #else
-  RMSNorm(ctx_final_norm, ctx.ffn_res[kNumLayers - 1], w.rms_final);
+  RMSNorm(ctx_final_norm, lc.x, w.rms_final);
 #endif
 
-  return;
+  return true;
 }
 
+#define SWAN_INSTANTIATE_DECODE(S) template decltype(Decode<S>) Decode<S>;
+SWAN_MODEL_SHAPES(SWAN_INSTANTIATE_DECODE)
+#undef SWAN_INSTANTIATE_DECODE
+
+#ifdef USE_CPU_ONLY
+// Run n <= kMaxBatch tokens through every layer, leaving the output of the
+// last one in ctx.x. Token t is at position pos[t] of caches[t]; every
+// projection is one matrix-matrix product over all n tokens.
+// The keys and values of all tokens are stored before any attends, and
+// token t reads positions 0..pos[t] of its cache only. For tokens of one
+// sequence at increasing positions that is the causal mask.
+// Returns false, before running anything, if the KV pool has no page left
+// for one of the positions.
+template <class S>
+static bool ForwardBatch(BatchContext<S>& ctx, const int* tokens,
+                         const int* pos, KVCache<S>* const* caches, int n,
+                         const Model<S>& model) {
+  const Weights<S>& w = *model.w;
+
+  const int head_dim = S::kHeadDim;
+  // 1/√d for sm(QK/√d)V, unless already in wq
+  const float norm = model.fold_norm ? 1 : 1 / std::sqrt(head_dim);
+
+  for (int t = 0; t < n; ++t) {
+    if (!ReserveKV(*caches[t], pos[t])) {
+      return false;
+    }
+  }
+
+  for (int i_layer = 0; i_layer < S::kNumLayers; ++i_layer) {
+
+    // Input of token t: its embedding, read in place, for layer 0 and
+    // ctx.x[t] after that.
+    auto input = [&](int t) -> const typename S::Tensor1d& {
+      return i_layer == 0 ? w.tok_emb_table[tokens[t]] : ctx.x[t];
+    };
+
+    // -- Attention --
+
+    // 1. RMS Normalize
+    for (int t = 0; t < n; ++t) {
+      NormalizeInput(ctx.norm[t], input(t), w.rms_att_w[i_layer], model);
+    }
+
+    // 2. Weight Multiple and RoPE
+    GemmQKV(ctx.q[0], ctx.k[0], ctx.v[0], ctx.norm[0], n,
+            model.wqkv[i_layer], S::kKVDim, w.cos_table[0], w.sin_table[0],
+            pos, head_dim);
+
+    // 3. Key / Value Cache
+    for (int t = 0; t < n; ++t) {
+      StoreKV(*caches[t], i_layer, pos[t], ctx.k[t], ctx.v[t]);
+    }
+
+    // 4. Multi-Head Attention over positions 0..pos[t]
+    for (int t = 0; t < n; ++t) {
+      Attention(ctx.val[t], ctx.q[t], KeyView(*caches[t], i_layer),
+                ValueView(*caches[t], i_layer), pos[t] + 1, S::kNumHeads,
+                S::kNumKVHeads, head_dim, norm);
+    }
+
+    // 5. Output (Merge Heads)
+    Gemm(ctx.out[0], ctx.val[0], n, model.wo[i_layer]);
+
+    // 6. Res connect
+    for (int t = 0; t < n; ++t) {
+      Add(ctx.x[t], input(t), ctx.out[t]);
+    }
+
+    // -- FFN --
+
+    // 1. RMS Normalize
+    for (int t = 0; t < n; ++t) {
+      NormalizeInput(ctx.norm[t], ctx.x[t], w.rms_ffn_w[i_layer], model);
+    }
+
+    // 2-5. SiLU(w1x) * w3x
+    GemmSwiGLU(ctx.ffn[0], ctx.norm[0], n, model.w13[i_layer]);
+
+    // 6. w2 . SiLU(w1x)*w3x
+    Gemm(ctx.out[0], ctx.ffn[0], n, model.w2[i_layer]);
+
+    // 7. Res connect
+    for (int t = 0; t < n; ++t) {
+      Add(ctx.x[t], ctx.x[t], ctx.out[t]);
+    }
+  }
+  return true;
+}
+
+template <class S>
+bool Prefill(const int* tokens, int n, int pos, Session<S>& session,
+             const Model<S>& model) {
+  KVCache<S>* caches[kMaxBatch];
+  int positions[kMaxBatch];
+  std::fill(caches, caches + kMaxBatch, &session.kv_cache);
+  for (int begin = 0; begin < n; begin += kMaxBatch) {
+    const int len = std::min(kMaxBatch, n - begin);
+    for (int t = 0; t < len; ++t) {
+      positions[t] = pos + begin + t;
+    }
+    if (!ForwardBatch(session.batch, tokens + begin, positions, caches, len,
+                      model)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <class S>
+bool DecodeTokens(const int* tokens, int n, int pos, Session<S>& session,
+                  typename S::Tensor1d* final_norm, const Model<S>& model) {
+  KVCache<S>* caches[kMaxBatch];
+  int positions[kMaxBatch];
+  std::fill(caches, caches + kMaxBatch, &session.kv_cache);
+  for (int begin = 0; begin < n; begin += kMaxBatch) {
+    const int len = std::min(kMaxBatch, n - begin);
+    for (int t = 0; t < len; ++t) {
+      positions[t] = pos + begin + t;
+    }
+    if (!ForwardBatch(session.batch, tokens + begin, positions, caches, len,
+                      model)) {
+      return false;
+    }
+
+    // -- Final RMS Normalize --
+    for (int t = 0; t < len; ++t) {
+      RMSNorm(final_norm[begin + t], session.batch.x[t], model.w->rms_final);
+    }
+  }
+  return true;
+}
+
+template <class S>
+bool DecodeBatch(BatchContext<S>& ctx, const int* tokens, const int* pos,
+                 KVCache<S>* const* caches, int n,
+                 typename S::Tensor1d* final_norm, const Model<S>& model) {
+  for (int begin = 0; begin < n; begin += kMaxBatch) {
+    const int len = std::min(kMaxBatch, n - begin);
+    if (!ForwardBatch(ctx, tokens + begin, pos + begin, caches + begin, len,
+                      model)) {
+      return false;
+    }
+
+    // -- Final RMS Normalize --
+    for (int t = 0; t < len; ++t) {
+      RMSNorm(final_norm[begin + t], ctx.x[t], model.w->rms_final);
+    }
+  }
+  return true;
+}
+
+#define SWAN_INSTANTIATE_BATCH(S)                     \
+  template decltype(Prefill<S>) Prefill<S>;           \
+  template decltype(DecodeTokens<S>) DecodeTokens<S>; \
+  template decltype(DecodeBatch<S>) DecodeBatch<S>;
+SWAN_MODEL_SHAPES(SWAN_INSTANTIATE_BATCH)
+#undef SWAN_INSTANTIATE_BATCH
+#endif // USE_CPU_ONLY
+
 } // namespace swan
@@ -1,7 +1,10 @@
 #ifndef DECODE_HPP_
 #define DECODE_HPP_
 
+#include <memory>
+
 #include "context.hpp"
+#include "kv_cache.hpp"
 #include "weight.hpp"
 
 #ifndef USE_CPU_ONLY
@@ -12,9 +15,28 @@
 
 namespace swan {
 
-void Decode(int tok, int pos, const Tensor1d& ctx_input,
-            Tensor3dCache& ctx_k_cache, Tensor3dCache& ctx_v_cache,
-            Tensor1d& ctx_final_norm, const Weights& w
+// State of one generation: its KV cache and the scratch activations of
+// Decode and Prefill. Sessions share nothing but the read-only Model and
+// the KV pool their caches take pages from, which is locked while pages
+// change hands, so independent sessions can run concurrently, one per
+// thread; a call that finds the thread pool busy runs on its own thread.
+template <class S>
+struct Session {
+  KVCache<S> kv_cache;
+  LayerContext<S> layer; // scratch of Decode, reused by every layer
+  BatchContext<S> batch; // activations of the last Prefill block
+
+  // When set, Decode also keeps the activations of every layer of the last
+  // token here, for DumpContext.
+  std::unique_ptr<Context<S>> trace;
+};
+
+// Feed token tok at position pos into the KV cache of the session and get
+// its final RMSNorm output in ctx_final_norm. Returns false, having done
+// nothing else, if the KV pool has no page left for pos.
+template <class S>
+bool Decode(int tok, int pos, Session<S>& session,
+            typename S::Tensor1d& ctx_final_norm, const Model<S>& model
 #ifndef USE_CPU_ONLY
             ,
             cl::CommandQueue q, cl::Kernel kernel_matmul, cl::Kernel kernel_mul,
@@ -27,6 +49,37 @@ void Decode(int tok, int pos, const Tensor1d& ctx_input,
 #endif // USE_CPU_ONLY
 );
 
+#ifdef USE_CPU_ONLY
+// Feed n prompt tokens at positions pos..pos+n into the KV cache of the
+// session, as n calls of Decode would, in batches of kMaxBatch tokens.
+// No logits are produced; Decode the last prompt token to get them.
+// Returns false if the KV pool runs out of pages.
+template <class S>
+bool Prefill(const int* tokens, int n, int pos, Session<S>& session,
+             const Model<S>& model);
+
+// Feed n tokens of one sequence at positions pos..pos+n into the KV cache
+// of the session in the same batches, and also get the final RMSNorm
+// output of each in final_norm[0..n], as Decode would for each. This
+// checks several proposed tokens in one pass; the cache entries of those
+// that are then dropped are simply overwritten by the next call.
+// Returns false if the KV pool runs out of pages.
+template <class S>
+bool DecodeTokens(const int* tokens, int n, int pos, Session<S>& session,
+                  typename S::Tensor1d* final_norm, const Model<S>& model);
+
+// Advance n independent sequences by one token each, as n calls of Decode
+// would, while reading the weights once per kMaxBatch sequences.
+// Sequence b feeds tokens[b] at position pos[b] into *caches[b] and gets
+// its final RMSNorm output in final_norm[b]. ctx is the scratch of the
+// batch, owned by the caller. Returns false if the KV pool runs out of
+// pages.
+template <class S>
+bool DecodeBatch(BatchContext<S>& ctx, const int* tokens, const int* pos,
+                 KVCache<S>* const* caches, int n,
+                 typename S::Tensor1d* final_norm, const Model<S>& model);
+#endif // USE_CPU_ONLY
+
 } // namespace swan
 
 #endif // DECODE_HPP_
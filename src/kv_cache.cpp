@@ -0,0 +1,252 @@
+#include "kv_cache.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace swan {
+
+bool ParseKVLayout(const std::string& name, KVLayout& layout) {
+  if (name == "head") {
+    layout = KVLayout::kHeadMajor;
+  } else if (name == "vt") {
+    layout = KVLayout::kVTransposed;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* KVLayoutName(KVLayout layout) {
+  switch (layout) {
+  case KVLayout::kHeadMajor:
+    return "head";
+  case KVLayout::kVTransposed:
+    return "vt";
+  }
+  return "unknown";
+}
+
+template <class S>
+void InitKVPool(KVPool<S>& pool, KVLayout layout, KVFormat format,
+                int num_pages) {
+  const size_t size = num_pages * KVPageSize<S>();
+  const size_t scales = num_pages * KVScalePageSize<S>();
+  pool.layout = layout;
+  pool.format = format;
+  pool.num_pages = num_pages;
+  pool.k.reset();
+  pool.v.reset();
+  pool.k_q8.reset();
+  pool.v_q8.reset();
+  pool.k_scales.reset();
+  pool.v_scales.reset();
+  switch (format) {
+  case KVFormat::kF32:
+    pool.k.reset(new float[size]);
+    pool.v.reset(new float[size]);
+    break;
+  case KVFormat::kQ8:
+    pool.k_q8.reset(new int8_t[size]);
+    pool.v_q8.reset(new int8_t[size]);
+    pool.k_scales.reset(new float[scales]);
+    pool.v_scales.reset(new float[scales]);
+    break;
+  }
+  pool.free_pages.resize(num_pages);
+  for (int i = 0; i < num_pages; ++i) {
+    pool.free_pages[i] = num_pages - 1 - i;
+  }
+  pool.refs.assign(num_pages, 0);
+  pool.peak_pages = 0;
+}
+
+template <class S>
+void InitKVCache(KVCache<S>& cache, KVPool<S>& pool) {
+  cache.pool = &pool;
+  cache.pages.clear();
+}
+
+// Take a free page of the pool. Returns -1 if there is none.
+template <class S>
+static int AllocKVPage(KVPool<S>& pool) {
+  std::lock_guard<std::mutex> lock(pool.mutex);
+  if (pool.free_pages.empty()) {
+    return -1;
+  }
+  const int page = pool.free_pages.back();
+  pool.free_pages.pop_back();
+  pool.refs[page] = 1;
+  pool.peak_pages = std::max<int>(pool.peak_pages,
+                                  pool.num_pages - pool.free_pages.size());
+  return page;
+}
+
+template <class S>
+bool ReserveKV(KVCache<S>& cache, int pos) {
+  while (static_cast<int>(cache.pages.size()) <= pos / KVPageLen<S>()) {
+    const int page = AllocKVPage(*cache.pool);
+    if (page < 0) {
+      return false;
+    }
+    cache.pages.push_back(page);
+  }
+  return true;
+}
+
+// Copy the first n positions of page src to page dst, in every block.
+template <class S>
+static void CopyKVPage(KVPool<S>& pool, int dst, int src, int n) {
+  const int len = KVPageLen<S>();
+  const int blocks = S::kNumLayers * S::kNumKVHeads;
+  const bool vt = pool.layout == KVLayout::kVTransposed;
+  for (int b = 0; b < blocks; ++b) {
+    const size_t block = static_cast<size_t>(b) * len * S::kHeadDim;
+    const size_t from = src * KVPageSize<S>() + block;
+    const size_t to = dst * KVPageSize<S>() + block;
+    const size_t rows = static_cast<size_t>(n) * S::kHeadDim;
+    const size_t scale_from = src * KVScalePageSize<S>() + b * len;
+    const size_t scale_to = dst * KVScalePageSize<S>() + b * len;
+    switch (pool.format) {
+    case KVFormat::kF32:
+      std::copy_n(pool.k.get() + from, rows, pool.k.get() + to);
+      if (vt) {
+        for (int i = 0; i < S::kHeadDim; ++i) {
+          std::copy_n(pool.v.get() + from + i * len, n,
+                      pool.v.get() + to + i * len);
+        }
+      } else {
+        std::copy_n(pool.v.get() + from, rows, pool.v.get() + to);
+      }
+      break;
+    case KVFormat::kQ8:
+      std::copy_n(pool.k_q8.get() + from, rows, pool.k_q8.get() + to);
+      if (vt) {
+        for (int i = 0; i < S::kHeadDim; ++i) {
+          std::copy_n(pool.v_q8.get() + from + i * len, n,
+                      pool.v_q8.get() + to + i * len);
+        }
+      } else {
+        std::copy_n(pool.v_q8.get() + from, rows, pool.v_q8.get() + to);
+      }
+      std::copy_n(pool.k_scales.get() + scale_from, n,
+                  pool.k_scales.get() + scale_to);
+      std::copy_n(pool.v_scales.get() + scale_from, n,
+                  pool.v_scales.get() + scale_to);
+      break;
+    }
+  }
+}
+
+template <class S>
+bool ForkKVCache(KVCache<S>& dst, const KVCache<S>& src, int pos) {
+  KVPool<S>& pool = *src.pool;
+  const int full = pos / KVPageLen<S>();
+  dst.pool = &pool;
+  {
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    dst.pages.assign(src.pages.begin(), src.pages.begin() + full);
+    for (int page : dst.pages) {
+      ++pool.refs[page];
+    }
+  }
+  const int rest = pos % KVPageLen<S>();
+  if (rest > 0) {
+    const int page = AllocKVPage(pool);
+    if (page < 0) {
+      FreeKVCache(dst);
+      return false;
+    }
+    dst.pages.push_back(page);
+    CopyKVPage(pool, page, src.pages[full], rest);
+  }
+  return true;
+}
+
+template <class S>
+void FreeKVCache(KVCache<S>& cache) {
+  KVPool<S>& pool = *cache.pool;
+  std::lock_guard<std::mutex> lock(pool.mutex);
+  for (int page : cache.pages) {
+    if (--pool.refs[page] == 0) {
+      pool.free_pages.push_back(page);
+    }
+  }
+  cache.pages.clear();
+}
+
+// Quantize head_dim values to int8 with one symmetric scale.
+// Returns the scale.
+template <class S>
+static float QuantizeHead(int8_t (&q)[S::kHeadDim], const float* x) {
+  float amax = 0;
+  for (int i = 0; i < S::kHeadDim; ++i) {
+    amax = std::max(amax, std::fabs(x[i]));
+  }
+  float scale = amax / 127;
+  float inv_scale = scale != 0 ? 1 / scale : 0;
+  for (int i = 0; i < S::kHeadDim; ++i) {
+    q[i] = static_cast<int8_t>(std::lrint(x[i] * inv_scale));
+  }
+  return scale;
+}
+
+// Write one head of one position into a block of head-major or
+// transposed storage; pos is within the page.
+template <class S, class T>
+static void StoreHead(T* block, int pos, const T* x, bool transposed) {
+  for (int i = 0; i < S::kHeadDim; ++i) {
+    if (transposed) {
+      block[i * KVPageLen<S>() + pos] = x[i];
+    } else {
+      block[pos * S::kHeadDim + i] = x[i];
+    }
+  }
+}
+
+template <class S>
+void StoreKV(KVCache<S>& cache, int layer, int pos, const float* k,
+             const float* v) {
+  KVPool<S>& pool = *cache.pool;
+  const bool vt = pool.layout == KVLayout::kVTransposed;
+  const int page = cache.pages[pos / KVPageLen<S>()];
+  const int slot = pos % KVPageLen<S>();
+  for (int h = 0; h < S::kNumKVHeads; ++h) {
+    const size_t block = page * KVPageSize<S>() + KVBlockOffset<S>(layer, h);
+    switch (pool.format) {
+    case KVFormat::kF32:
+      if (k) {
+        StoreHead<S>(pool.k.get() + block, slot, k + h * S::kHeadDim, false);
+      }
+      if (v) {
+        StoreHead<S>(pool.v.get() + block, slot, v + h * S::kHeadDim, vt);
+      }
+      break;
+    case KVFormat::kQ8: {
+      const size_t scale = page * KVScalePageSize<S>() +
+                           KVScaleOffset<S>(layer, h) + slot;
+      int8_t q[S::kHeadDim];
+      if (k) {
+        pool.k_scales[scale] = QuantizeHead<S>(q, k + h * S::kHeadDim);
+        StoreHead<S>(pool.k_q8.get() + block, slot, q, false);
+      }
+      if (v) {
+        pool.v_scales[scale] = QuantizeHead<S>(q, v + h * S::kHeadDim);
+        StoreHead<S>(pool.v_q8.get() + block, slot, q, vt);
+      }
+      break;
+    }
+    }
+  }
+}
+
+#define SWAN_INSTANTIATE_KV_CACHE(S)                \
+  template decltype(InitKVPool<S>) InitKVPool<S>;   \
+  template decltype(InitKVCache<S>) InitKVCache<S>; \
+  template decltype(ReserveKV<S>) ReserveKV<S>;     \
+  template decltype(ForkKVCache<S>) ForkKVCache<S>; \
+  template decltype(FreeKVCache<S>) FreeKVCache<S>; \
+  template decltype(StoreKV<S>) StoreKV<S>;
+SWAN_MODEL_SHAPES(SWAN_INSTANTIATE_KV_CACHE)
+#undef SWAN_INSTANTIATE_KV_CACHE
+
+} // namespace swan
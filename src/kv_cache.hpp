@@ -0,0 +1,228 @@
+#ifndef KV_CACHE_HPP_
+#define KV_CACHE_HPP_
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "tensor.hpp"
+#include "tensor_cpu.hpp"
+
+namespace swan {
+
+// Memory layout of the key / value cache.
+enum class KVLayout {
+  kHeadMajor,   // k and v [layer, kv_head, page_len, head_dim] per page
+  kVTransposed, // k as above, v [layer, kv_head, head_dim, page_len]
+};
+
+// Parse "head" or "vt". Returns false if the name is unknown.
+bool ParseKVLayout(const std::string& name, KVLayout& layout);
+const char* KVLayoutName(KVLayout layout);
+
+// Positions per page of the KV cache. The FPGA kernels read the positions
+// of a KV head as one block, so there a single page holds all of them.
+template <class S>
+constexpr int KVPageLen() {
+#ifdef USE_CPU_ONLY
+  return 16;
+#else
+  return S::kSeqLen;
+#endif // USE_CPU_ONLY
+}
+
+// Pages holding the first n positions of a sequence.
+template <class S>
+int KVPages(int n) {
+  return (n + KVPageLen<S>() - 1) / KVPageLen<S>();
+}
+
+// Shared storage of the KV caches: fixed-size pages, each with the keys
+// and values of KVPageLen positions for every layer and KV head.
+// Sequences take pages as they grow and give them back when freed, so the
+// pool only needs to hold the positions in use. The storage is never
+// moved, and it is left uninitialized so that pages the sequences do not
+// reach are never backed by memory. Only the storage of the chosen format
+// is allocated. Pages are taken and released under the mutex, so sessions
+// on different threads can share a pool.
+template <class S>
+struct KVPool {
+  KVLayout layout = KVLayout::kHeadMajor;
+  KVFormat format = KVFormat::kF32;
+  int num_pages = 0;
+  std::unique_ptr<float[]> k; // kF32
+  std::unique_ptr<float[]> v;
+  std::unique_ptr<int8_t[]> k_q8; // kQ8
+  std::unique_ptr<int8_t[]> v_q8;
+  std::unique_ptr<float[]> k_scales; // kQ8, [page][layer, kv_head, page_len]
+  std::unique_ptr<float[]> v_scales;
+
+  std::mutex mutex;
+  std::vector<int> free_pages; // lowest last
+  std::vector<int> refs;       // sequences using each page
+  int peak_pages = 0;          // most pages in use at once
+};
+
+// Allocate a pool of num_pages pages.
+template <class S>
+void InitKVPool(KVPool<S>& pool, KVLayout layout, KVFormat format,
+                int num_pages);
+
+// Keys and values of the positions of one sequence, in pages of a pool
+// listed by position. Pages are taken by ReserveKV, shared by ForkKVCache
+// and given back by FreeKVCache; do not copy a cache directly.
+template <class S>
+struct KVCache {
+  KVPool<S>* pool = nullptr;
+  std::vector<int> pages; // page of positions i * KVPageLen..
+};
+
+// Start an empty cache on pool.
+template <class S>
+void InitKVCache(KVCache<S>& cache, KVPool<S>& pool);
+
+// Make room for position pos and every one before it. Returns false if
+// the pool runs out of free pages first; the pages taken so far stay with
+// the cache.
+template <class S>
+bool ReserveKV(KVCache<S>& cache, int pos);
+
+// Start dst with positions 0..pos of src. The pages src has completely
+// filled by then are shared, since neither writes them again; a partly
+// filled one is copied. Returns false, with dst empty, if the pool has no
+// free page for the copy.
+template <class S>
+bool ForkKVCache(KVCache<S>& dst, const KVCache<S>& src, int pos);
+
+// Give the pages of the cache back to its pool.
+template <class S>
+void FreeKVCache(KVCache<S>& cache);
+
+// Store k and v [kv_dim] of position pos, split into heads. pos must have
+// been reserved.
+// With kQ8 each head of each position gets its own scale. Either may be
+// nullptr if it was already written in place through KeySlot or ValueSlot.
+template <class S>
+void StoreKV(KVCache<S>& cache, int layer, int pos, const float* k,
+             const float* v);
+
+// Elements of k and v in one page.
+template <class S>
+constexpr size_t KVPageSize() {
+  return static_cast<size_t>(S::kNumLayers) * S::kNumKVHeads *
+         KVPageLen<S>() * S::kHeadDim;
+}
+
+// Scales of k_scales and v_scales in one page.
+template <class S>
+constexpr size_t KVScalePageSize() {
+  return static_cast<size_t>(S::kNumLayers) * S::kNumKVHeads * KVPageLen<S>();
+}
+
+// Offset of the block of one KV head within a page of k and v.
+template <class S>
+size_t KVBlockOffset(int layer, int kv_head) {
+  return (static_cast<size_t>(layer) * S::kNumKVHeads + kv_head) *
+         KVPageLen<S>() * S::kHeadDim;
+}
+
+// Offset of the scales of one KV head within a page of k_scales and
+// v_scales.
+template <class S>
+size_t KVScaleOffset(int layer, int kv_head) {
+  return (static_cast<size_t>(layer) * S::kNumKVHeads + kv_head) *
+         KVPageLen<S>();
+}
+
+// Offset of the block of one KV head in the page of position pos.
+template <class S>
+size_t KVPageOffset(const KVCache<S>& cache, int layer, int kv_head, int pos) {
+  return cache.pages[pos / KVPageLen<S>()] * KVPageSize<S>() +
+         KVBlockOffset<S>(layer, kv_head);
+}
+
+// fp32 keys of one KV head in the first page, [page_len, head_dim]; all of
+// them where a page holds seq_len positions, as for the FPGA kernels.
+template <class S>
+const float* KeyBlock(const KVCache<S>& cache, int layer, int kv_head) {
+  return cache.pool->k.get() + KVPageOffset(cache, layer, kv_head, 0);
+}
+
+// fp32 values of one KV head in the first page.
+// [page_len, head_dim], or [head_dim, page_len] with kVTransposed.
+template <class S>
+const float* ValueBlock(const KVCache<S>& cache, int layer, int kv_head) {
+  return cache.pool->v.get() + KVPageOffset(cache, layer, kv_head, 0);
+}
+
+// fp32 key slot of position pos for KV head 0, where a projection can
+// write the key directly; KV head h is KVBlockOffset<S>(0, h) further.
+// nullptr if keys are not stored as fp32. pos must have been reserved.
+template <class S>
+float* KeySlot(KVCache<S>& cache, int layer, int pos) {
+  if (cache.pool->format != KVFormat::kF32) {
+    return nullptr;
+  }
+  return cache.pool->k.get() + KVPageOffset(cache, layer, 0, pos) +
+         static_cast<size_t>(pos % KVPageLen<S>()) * S::kHeadDim;
+}
+
+// Same as KeySlot for the values; also nullptr if they are transposed.
+template <class S>
+float* ValueSlot(KVCache<S>& cache, int layer, int pos) {
+  if (cache.pool->format != KVFormat::kF32 ||
+      cache.pool->layout == KVLayout::kVTransposed) {
+    return nullptr;
+  }
+  return cache.pool->v.get() + KVPageOffset(cache, layer, 0, pos) +
+         static_cast<size_t>(pos % KVPageLen<S>()) * S::kHeadDim;
+}
+
+// Page table of a cache for Attention, without the storage.
+template <class S>
+KVView PageView(const KVCache<S>& cache) {
+  KVView view;
+  view.format = cache.pool->format;
+  view.pages = cache.pages.data();
+  view.page_len = KVPageLen<S>();
+  view.page_stride = KVPageSize<S>();
+  view.scale_page_stride = KVScalePageSize<S>();
+  view.head_stride = KVBlockOffset<S>(0, 1);
+  view.scale_stride = KVScaleOffset<S>(0, 1);
+  return view;
+}
+
+// Keys of one layer for Attention.
+template <class S>
+KVView KeyView(const KVCache<S>& cache, int layer) {
+  const KVPool<S>& pool = *cache.pool;
+  KVView view = PageView(cache);
+  if (pool.format == KVFormat::kQ8) {
+    view.data = pool.k_q8.get() + KVBlockOffset<S>(layer, 0);
+    view.scales = pool.k_scales.get() + KVScaleOffset<S>(layer, 0);
+  } else {
+    view.data = pool.k.get() + KVBlockOffset<S>(layer, 0);
+  }
+  return view;
+}
+
+// Values of one layer for Attention.
+template <class S>
+KVView ValueView(const KVCache<S>& cache, int layer) {
+  const KVPool<S>& pool = *cache.pool;
+  KVView view = PageView(cache);
+  view.transposed = pool.layout == KVLayout::kVTransposed;
+  if (pool.format == KVFormat::kQ8) {
+    view.data = pool.v_q8.get() + KVBlockOffset<S>(layer, 0);
+    view.scales = pool.v_scales.get() + KVScaleOffset<S>(layer, 0);
+  } else {
+    view.data = pool.v.get() + KVBlockOffset<S>(layer, 0);
+  }
+  return view;
+}
+
+} // namespace swan
+
+#endif // KV_CACHE_HPP_
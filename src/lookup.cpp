@@ -0,0 +1,55 @@
+#include "lookup.hpp"
+
+#include <algorithm>
+
+namespace swan {
+
+// Hash of the n tokens starting at t (FNV-1a over the token ids).
+static uint64_t HashNgram(const int* t, int n) {
+  uint64_t h = 14695981039346656037ull;
+  for (int i = 0; i < n; ++i) {
+    h = (h ^ static_cast<uint32_t>(t[i])) * 1099511628211ull;
+  }
+  return h;
+}
+
+void InitNgramIndex(NgramIndex& index, int max_n) {
+  index = NgramIndex();
+  index.max_n = max_n;
+  index.next.resize(max_n);
+}
+
+void AddNgramTokens(NgramIndex& index, const int* tokens, int n) {
+  std::vector<int>& h = index.tokens;
+  for (int i = 0; i < n; ++i) {
+    // The n-grams ending at the previous token now have a continuation.
+    const int end = h.size();
+    for (int m = 1; m <= index.max_n && m <= end; ++m) {
+      index.next[m - 1][HashNgram(&h[end - m], m)] = end;
+    }
+    h.push_back(tokens[i]);
+  }
+}
+
+int ProposeNgramTokens(const NgramIndex& index, int* out, int max) {
+  const std::vector<int>& h = index.tokens;
+  const int end = h.size();
+  for (int m = std::min<int>(index.max_n, end); m >= 1; --m) {
+    auto it = index.next[m - 1].find(HashNgram(&h[end - m], m));
+    if (it == index.next[m - 1].end()) {
+      continue;
+    }
+    // Check the tokens too, in case of a hash collision.
+    const int next = it->second;
+    const int* t = h.data();
+    if (!std::equal(t + next - m, t + next, t + end - m)) {
+      continue;
+    }
+    const int n = std::min(max, end - next);
+    std::copy_n(t + next, n, out);
+    return n;
+  }
+  return 0;
+}
+
+} // namespace swan
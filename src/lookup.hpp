@@ -0,0 +1,33 @@
+#ifndef LOOKUP_HPP_
+#define LOOKUP_HPP_
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace swan {
+
+// Index of the n-grams of a token history, for proposing continuations
+// without a draft model (prompt lookup). The last 1..max_n tokens are
+// looked up, longest first, and the tokens that followed their most recent
+// earlier occurrence are proposed.
+struct NgramIndex {
+  int max_n = 0;
+  std::vector<int> tokens; // history
+  // Hash of an n-gram -> position of the token after its last occurrence,
+  // one map per n.
+  std::vector<std::unordered_map<uint64_t, int>> next;
+};
+
+void InitNgramIndex(NgramIndex& index, int max_n);
+
+// Append tokens to the history.
+void AddNgramTokens(NgramIndex& index, const int* tokens, int n);
+
+// Write up to max tokens that may follow the history to out.
+// Returns how many, 0 if even the last token has not occurred before.
+int ProposeNgramTokens(const NgramIndex& index, int* out, int max);
+
+} // namespace swan
+
+#endif // LOOKUP_HPP_
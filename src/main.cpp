@@ -1,11 +1,22 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <random>
 #include <utility>
+#include <vector>
 
 #include "context.hpp"
 #include "decode.hpp"
+#include "kv_cache.hpp"
+#include "lookup.hpp"
+#include "mips.hpp"
+#include "sampler.hpp"
+#include "tensor_cpu.hpp"
+#include "thread_pool.hpp"
 #include "vocab.hpp"
 #include "weight.hpp"
 
@@ -41,8 +52,30 @@ struct aligned_allocator {
 struct Args {
   std::string weight_path = "./model/stories15M.bin";
   std::string vocab_path = "./model/tokenizer.bin";
+  std::string prompt = "";
+  bool mmap = false;
+  bool populate = false;
+  bool mlock = false;
+  std::string isa = "auto";
+  std::string dtype = "f32";
+  bool fold_norm = false;
+  std::string kv_layout = "head";
+  std::string kv_dtype = "f32";
+  int kv_pages = 0; // enough for every sequence if 0
+  int threads = 0;
+  bool pin = false;
+  int batch = 1;
   uint64_t max_seq = 256;
   float temp = 0.5;
+  int top_k = 0;
+  float top_p = 1;
+  int64_t seed = -1; // random if negative
+  int mips_probe = 0; // no index if 0
+  float mips_min_temp = 0.5; // exact classifier below this temperature
+  std::string draft_path = ""; // no speculative decoding if empty
+  std::string draft_dtype = "f32";
+  int draft_len = 4;
+  int lookup_ngram = 0; // no prompt lookup if 0
   bool color = false;
   bool print_softmax = false;
   bool log = false;
@@ -56,10 +89,55 @@ void ParseArgument(int argc, char* argv[], Args& args) {
       args.weight_path = argv[++i];
     } else if (std::strcmp(argv[i], "--vocab_path") == 0 && i + 1 < argc) {
       args.vocab_path = argv[++i];
+    } else if (std::strcmp(argv[i], "--prompt") == 0 && i + 1 < argc) {
+      args.prompt = argv[++i];
+    } else if (std::strcmp(argv[i], "--mmap") == 0) {
+      args.mmap = true;
+    } else if (std::strcmp(argv[i], "--populate") == 0) {
+      args.populate = true;
+    } else if (std::strcmp(argv[i], "--mlock") == 0) {
+      args.mlock = true;
+    } else if (std::strcmp(argv[i], "--isa") == 0 && i + 1 < argc) {
+      args.isa = argv[++i];
+    } else if (std::strcmp(argv[i], "--dtype") == 0 && i + 1 < argc) {
+      args.dtype = argv[++i];
+    } else if (std::strcmp(argv[i], "--fold_norm") == 0) {
+      args.fold_norm = true;
+    } else if (std::strcmp(argv[i], "--kv_layout") == 0 && i + 1 < argc) {
+      args.kv_layout = argv[++i];
+    } else if (std::strcmp(argv[i], "--kv_dtype") == 0 && i + 1 < argc) {
+      args.kv_dtype = argv[++i];
+    } else if (std::strcmp(argv[i], "--kv_pages") == 0 && i + 1 < argc) {
+      args.kv_pages = std::stoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      args.threads = std::stoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--pin") == 0) {
+      args.pin = true;
+    } else if (std::strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      args.batch = std::stoi(argv[++i]);
     } else if (std::strcmp(argv[i], "--max_seq") == 0 && i + 1 < argc) {
       args.max_seq = std::stoull(argv[++i]);
     } else if (std::strcmp(argv[i], "--temp") == 0 && i + 1 < argc) {
       args.temp = std::stof(argv[++i]);
+    } else if (std::strcmp(argv[i], "--top_k") == 0 && i + 1 < argc) {
+      args.top_k = std::stoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--top_p") == 0 && i + 1 < argc) {
+      args.top_p = std::stof(argv[++i]);
+    } else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      args.seed = std::stoll(argv[++i]);
+    } else if (std::strcmp(argv[i], "--mips_probe") == 0 && i + 1 < argc) {
+      args.mips_probe = std::stoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--mips_min_temp") == 0 &&
+               i + 1 < argc) {
+      args.mips_min_temp = std::stof(argv[++i]);
+    } else if (std::strcmp(argv[i], "--draft_path") == 0 && i + 1 < argc) {
+      args.draft_path = argv[++i];
+    } else if (std::strcmp(argv[i], "--draft_dtype") == 0 && i + 1 < argc) {
+      args.draft_dtype = argv[++i];
+    } else if (std::strcmp(argv[i], "--draft_len") == 0 && i + 1 < argc) {
+      args.draft_len = std::stoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--lookup_ngram") == 0 && i + 1 < argc) {
+      args.lookup_ngram = std::stoi(argv[++i]);
     } else if (std::strcmp(argv[i], "--color") == 0) {
       args.color = true;
     } else if (std::strcmp(argv[i], "--print_softmax") == 0) {
@@ -76,65 +154,334 @@ void ParseArgument(int argc, char* argv[], Args& args) {
   }
 }
 
-// Random Sampling
-int SelectFromLogits(const swan::Tensor1dLogits& prob_dist) {
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::uniform_real_distribution<> dis(0, 1);
+#ifdef USE_CPU_ONLY
+// Continue args.batch independent copies of a prefilled prompt, whose last
+// token is token at position pos, with one batched decode step per position.
+// Each sequence gets its own KV cache, which shares the full pages of the
+// prompt, and is printed once it is complete. The tokens decoded are added
+// to generated. Returns false, with the sequences cut short, if the KV pool
+// runs out of pages.
+template <class S>
+bool GenerateBatch(const Args& args, const swan::Model<S>& model,
+                   const swan::Vocab& vocab, swan::Sampler& sampler,
+                   const swan::KVCache<S>& prompt_cache, int token, int pos,
+                   int max_seq, int& generated) {
+  const int batch = args.batch;
+  std::unique_ptr<swan::BatchContext<S>> ctx(new swan::BatchContext<S>);
+  std::vector<swan::KVCache<S>> kv_caches(batch);
+  std::vector<swan::KVCache<S>*> caches;
+  bool kv_ok = true;
+  for (int b = 0; b < batch; ++b) {
+    kv_ok = kv_ok && swan::ForkKVCache(kv_caches[b], prompt_cache, pos);
+    caches.push_back(&kv_caches[b]);
+  }
+  std::vector<int> tokens(batch, token);
+  std::vector<int> positions(batch);
+  std::unique_ptr<typename S::Tensor1d[]> final_norm(
+      new typename S::Tensor1d[batch]);
+  std::unique_ptr<typename S::Tensor1dLogits[]> logits(
+      new typename S::Tensor1dLogits[batch]);
+  std::vector<std::string> texts(batch);
 
-  const int vocab_size = swan::kVocabSize;
-  float rand = dis(gen);
+  for (; kv_ok && pos < max_seq; ++pos) {
+    std::fill(positions.begin(), positions.end(), pos);
+    if (!swan::DecodeBatch<S>(*ctx, tokens.data(), positions.data(),
+                              caches.data(), batch, final_norm.get(), model)) {
+      kv_ok = false;
+      break;
+    }
 
-  float cdf = 0.0;
-  for (size_t i = 0; i < vocab_size; ++i) {
-    cdf += prob_dist[i];
-    if (rand < cdf) {
-      return i;
+    // The classifier is also read once for the whole batch.
+    swan::Gemm(logits[0], final_norm[0], batch, model.classifier);
+    for (int b = 0; b < batch; ++b) {
+      int next = swan::Sample(sampler, logits[b], S::kVocabSize);
+      texts[b] += vocab.dict.at(next).data();
+      tokens[b] = next;
     }
+    generated += batch;
   }
 
-  // in case of rounding errors
-  return vocab_size - 1;
+  for (int b = 0; b < batch; ++b) {
+    args.color ? printf("\n[%d]\e[31m%s\e[0m", b, texts[b].c_str())
+               : printf("\n[%d]%s", b, texts[b].c_str());
+    swan::FreeKVCache(kv_caches[b]);
+  }
+  return kv_ok;
 }
 
-int main(int argc, char* argv[]) {
-  // 1. Parse arguments.
-  Args args;
-  ParseArgument(argc, argv, args);
+// Target side of speculative decoding: the token history, the proposals of
+// the current step and the scratch to check them.
+template <class S>
+struct Speculation {
+  std::vector<int> tokens; // every token so far
+  std::vector<int> block;  // the last token, the proposals and one more
+  std::vector<float> q;    // distribution each proposal was drawn from
+  std::vector<float> p;    // distribution of the target
+  std::unique_ptr<typename S::Tensor1d[]> final_norm;
+  std::unique_ptr<typename S::Tensor1dLogits[]> logits;
+  int proposed = 0;
+  int accepted = 0;
+};
 
-  if (args.help) {
-    std::cout << "Usage: " << argv[0] << " [options]" << std::endl
-              << "Options:" << std::endl
-              << "  --weight_path   : Weight file path" << std::endl
-              << "  --vocab_path    : Tokenizer file path" << std::endl
-              << "  --max_seq       : Maximum sequence length" << std::endl
-              << "  --temp          : Temperature for sampling" << std::endl
-              << "  --color         : Enable color output" << std::endl
-              << "  --log           : Enable log output" << std::endl
-              << "  --help, -h      : Show this help message" << std::endl;
-    return 0;
+template <class S>
+void InitSpeculation(Speculation<S>& spec, const std::vector<int>& prompt,
+                     int max_proposals) {
+  spec.tokens = prompt;
+  spec.block.resize(max_proposals + 2);
+  spec.q.resize(static_cast<size_t>(max_proposals) * S::kVocabSize);
+  spec.p.resize(S::kVocabSize);
+  spec.final_norm.reset(new typename S::Tensor1d[max_proposals + 1]);
+  spec.logits.reset(new typename S::Tensor1dLogits[max_proposals + 1]);
+}
+
+// Decode block[0] = tokens[pos] and the k proposals block[1..k] after it
+// with the target in one DecodeTokens pass, keep the longest prefix of
+// them the sampler accepts and draw one more token: from the residual at
+// the first rejected one, or after the last. The new tokens are printed
+// and appended to the history, and the next position is returned, or -1
+// if the KV pool has run out of pages.
+// Positions past it may hold rejected tokens in the KV cache; nothing
+// reads them before they are overwritten, so there is nothing to undo.
+template <class S>
+int KeepProposals(const Args& args, const swan::Model<S>& model,
+                  const swan::Vocab& vocab, swan::Sampler& sampler,
+                  swan::Session<S>& session, Speculation<S>& spec, int pos,
+                  int k) {
+  const int n = S::kVocabSize;
+  int* block = spec.block.data();
+  float* p = spec.p.data();
+  if (!swan::DecodeTokens<S>(block, k + 1, pos, session,
+                             spec.final_norm.get(), model)) {
+    return -1;
   }
+  swan::Gemm(spec.logits[0], spec.final_norm[0], k + 1, model.classifier);
 
-  // 2. Print hyper parameters.
-  std::cout << "Hyper Parameters" << std::endl
-            << "  dim       : " << swan::kDim << std::endl
-            << "  ffn_dim   : " << swan::kFFNDim << std::endl
-            << "  n_layers  : " << swan::kNumLayers << std::endl
-            << "  n_heads   : " << swan::kNumHeads << std::endl
-            << "  n_kv_heads: " << swan::kNumKVHeads << std::endl
-            << "  vocab_size: " << swan::kVocabSize << std::endl
-            << "  seq_len   : " << swan::kSeqLen << std::endl;
+  int i = 0;
+  for (; i < k; ++i) {
+    swan::SampleDistribution(sampler, spec.logits[i], n, p);
+    const int x = block[i + 1];
+    if (!swan::AcceptDraft(sampler, p[x], spec.q[i * n + x])) {
+      break;
+    }
+  }
+  if (i < k) {
+    block[i + 1] = swan::SampleResidual(sampler, p, &spec.q[i * n], n);
+  } else {
+    swan::SampleDistribution(sampler, spec.logits[k], n, p);
+    block[k + 1] = swan::SampleFrom(sampler, p, n);
+  }
+  spec.proposed += k;
+  spec.accepted += i;
+
+  for (int j = 1; j <= i + 1; ++j) {
+    args.color ? printf("\e[31m%s\e[0m", vocab.dict.at(block[j]).data())
+               : printf("%s", vocab.dict.at(block[j]).data());
+    spec.tokens.push_back(block[j]);
+  }
+  std::cout << std::flush;
+  return pos + i + 1;
+}
+
+// Continue a prefilled prompt with speculative decoding. Each step the
+// draft model D, which shares the vocabulary of the target, proposes up to
+// args.draft_len tokens one at a time for KeepProposals. The tokens follow
+// the distribution of the target alone. The draft is loaded here, and
+// decode_start is restarted once it is. The tokens kept are added to
+// generated. Returns false if a KV pool runs out of pages.
+template <class S, class D>
+bool GenerateSpeculative(const Args& args, swan::WeightFormat draft_format,
+                         const swan::Model<S>& model, const swan::Vocab& vocab,
+                         swan::Sampler& sampler, swan::Session<S>& session,
+                         const std::vector<int>& prompt, int max_seq,
+                         std::chrono::steady_clock::time_point& decode_start,
+                         int& generated) {
+  std::ifstream fs(args.draft_path, std::ios::in | std::ios::binary);
+  std::unique_ptr<swan::Weights<D>> draft_weights(new swan::Weights<D>);
+  swan::LoadWeights(*draft_weights, fs);
+  fs.close();
+  std::unique_ptr<swan::Model<D>> draft(new swan::Model<D>);
+  swan::PackModel(*draft, *draft_weights, draft_format, args.fold_norm);
+  std::unique_ptr<swan::KVPool<D>> draft_pool(new swan::KVPool<D>);
+  swan::InitKVPool(*draft_pool, session.kv_cache.pool->layout,
+                   session.kv_cache.pool->format, swan::KVPages<D>(max_seq));
+  std::unique_ptr<swan::Session<D>> draft_session(new swan::Session<D>);
+  swan::InitKVCache(draft_session->kv_cache, *draft_pool);
+  const double draft_load_time =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                    decode_start)
+          .count();
+  decode_start = std::chrono::steady_clock::now();
+
+  const int n = S::kVocabSize;
+  Speculation<S> spec;
+  InitSpeculation(spec, prompt, args.draft_len);
+  typename D::Tensor1d draft_norm;
+  typename D::Tensor1dLogits draft_logits;
+
+  int draft_pos = 0; // the draft cache holds tokens[0..draft_pos)
+  for (int pos = prompt.size() - 1; pos < max_seq;) {
+    const int k = std::min(args.draft_len, max_seq - pos - 1);
+
+    // Catch the draft up and let it propose k tokens after tokens[pos].
+    if (!swan::Prefill<D>(spec.tokens.data() + draft_pos, pos - draft_pos,
+                          draft_pos, *draft_session, *draft)) {
+      return false;
+    }
+    spec.block[0] = spec.tokens[pos];
+    for (int i = 0; i < k; ++i) {
+      if (!swan::Decode<D>(spec.block[i], pos + i, *draft_session,
+                           draft_norm, *draft)) {
+        return false;
+      }
+      swan::MutmulVocabCPU(draft_logits, draft_norm, draft->classifier);
+      swan::SampleDistribution(sampler, draft_logits, n, &spec.q[i * n]);
+      spec.block[i + 1] = swan::SampleFrom(sampler, &spec.q[i * n], n);
+    }
+
+    const int next =
+        KeepProposals(args, model, vocab, sampler, session, spec, pos, k);
+    if (next < 0) {
+      return false;
+    }
+    generated += next - pos;
+    draft_pos = std::min(pos + k, next);
+    pos = next;
+  }
+
+  printf("\nDraft: %d of %d tokens accepted (%.1f%%), loaded in %g[s]",
+         spec.accepted, spec.proposed,
+         spec.proposed > 0 ? 100.0 * spec.accepted / spec.proposed : 0.0,
+         draft_load_time);
+  return true;
+}
 
+// Continue a prefilled prompt with prompt lookup: each step proposes up to
+// args.draft_len tokens that followed the latest earlier occurrence of the
+// last tokens, matching at most args.lookup_ngram of them, and checks them
+// with KeepProposals. Each proposal is certain, so the target keeps it
+// with its own probability and the tokens follow its distribution alone.
+// Without a match a step decodes just the last token. After a rejection
+// the next step proposes one more token than were kept, and the length
+// doubles back up to args.draft_len while everything is kept, so spans
+// that are not copied cost little. The tokens kept are added to generated.
+// Returns false if the KV pool runs out of pages.
+template <class S>
+bool GenerateLookup(const Args& args, const swan::Model<S>& model,
+                    const swan::Vocab& vocab, swan::Sampler& sampler,
+                    swan::Session<S>& session,
+                    const std::vector<int>& prompt, int max_seq,
+                    int& generated) {
+  const int n = S::kVocabSize;
+  Speculation<S> spec;
+  InitSpeculation(spec, prompt, args.draft_len);
+  swan::NgramIndex index;
+  swan::InitNgramIndex(index, args.lookup_ngram);
+  swan::AddNgramTokens(index, prompt.data(), prompt.size());
+
+  int len = args.draft_len;
+  for (int pos = prompt.size() - 1; pos < max_seq;) {
+    const int max = std::min(len, max_seq - pos - 1);
+    spec.block[0] = spec.tokens[pos];
+    const int k = swan::ProposeNgramTokens(index, &spec.block[1], max);
+    for (int i = 0; i < k; ++i) {
+      float* q = &spec.q[i * n];
+      std::fill(q, q + n, 0);
+      q[spec.block[i + 1]] = 1;
+    }
+
+    const int next =
+        KeepProposals(args, model, vocab, sampler, session, spec, pos, k);
+    if (next < 0) {
+      return false;
+    }
+    generated += next - pos;
+    swan::AddNgramTokens(index, &spec.tokens[pos + 1], next - pos);
+    if (k > 0) {
+      len = next - pos > k ? std::min(2 * len, args.draft_len) : next - pos;
+    }
+    pos = next;
+  }
+
+  printf("\nLookup: %d of %d tokens accepted (%.1f%%)", spec.accepted,
+         spec.proposed,
+         spec.proposed > 0 ? 100.0 * spec.accepted / spec.proposed : 0.0);
+  return true;
+}
+#endif // USE_CPU_ONLY
+
+// Load the model and generate text with the kernels compiled for shape S.
+template <class S>
+int Run(const Args& args, swan::WeightFormat format,
+        swan::KVLayout kv_layout, swan::KVFormat kv_format,
+        const swan::Config& draft_config, swan::WeightFormat draft_format) {
   // 3. Load model parameters.
-  std::ifstream weight_fs(args.weight_path, std::ios::in | std::ios::binary);
-  if (!weight_fs) {
-    std::cout << "Failed to open: " << args.weight_path << std::endl;
-    return EXIT_FAILURE;
+  //    With --mmap the weights are used in place from the page cache,
+  //    otherwise the checkpoint is copied into a private buffer.
+  auto load_start = std::chrono::steady_clock::now();
+  std::unique_ptr<swan::Weights<S>> weight_buffer;
+  swan::WeightMap weight_map;
+  const swan::Weights<S>* weights = nullptr;
+  if (args.mmap) {
+    weights = swan::MapWeights<S>(weight_map, args.weight_path, args.populate,
+                                  args.mlock);
+    if (!weights) {
+      std::cout << "Failed to map: " << args.weight_path << " ("
+                << std::strerror(errno) << ")" << std::endl;
+      return EXIT_FAILURE;
+    }
+    if (args.mlock && !weight_map.locked) {
+      std::cout << "[WARNING] mlock failed, weights may be paged out"
+                << std::endl;
+    }
+  } else {
+    std::ifstream weight_fs(args.weight_path, std::ios::in | std::ios::binary);
+    if (!weight_fs) {
+      std::cout << "Failed to open: " << args.weight_path << std::endl;
+      return EXIT_FAILURE;
+    }
+    weight_buffer.reset(new swan::Weights<S>);
+    swan::LoadWeights(*weight_buffer, weight_fs);
+    weight_fs.close();
+    weights = weight_buffer.get();
   }
-  static swan::Weights weights;
-  static swan::Tensor2dTok tok_emb_table; // [vocab_size, dim]
-  swan::LoadWeights(weights, tok_emb_table, weight_fs);
-  weight_fs.close();
+
+  // Rearrange the weights for the decode kernels, quantizing them if a
+  // quantized format was requested.
+  std::unique_ptr<swan::Model<S>> model(new swan::Model<S>);
+  swan::PackModel(*model, *weights, format, args.fold_norm);
+  if (format != swan::WeightFormat::kF32) {
+    std::cout << "Weight Error: " << 100 * model->weight_error
+              << "% (relative RMS vs f32)" << std::endl;
+  }
+
+  // Sampler of the next token, and room for the logits it needs when those
+  // are only the best few.
+  swan::Sampler sampler;
+  swan::InitSampler(sampler, args.temp, args.top_k, args.top_p, args.seed);
+  const int candidates = swan::SamplerCandidates(sampler);
+  std::vector<swan::Logit> top(candidates);
+
+  // With --mips_probe, those few come from an index over the classifier
+  // rows that only scores the most promising clusters. Low temperatures
+  // keep the exact classifier, whose best token they would almost always
+  // pick.
+  const bool speculate = !args.draft_path.empty() || args.lookup_ngram > 0;
+  const bool use_mips = args.mips_probe > 0 && candidates > 0 &&
+                        args.temp >= args.mips_min_temp && !speculate;
+  swan::MipsIndex mips;
+  if (use_mips) {
+    auto mips_start = std::chrono::steady_clock::now();
+    swan::BuildMipsIndex(mips, model->classifier, args.mips_probe);
+    std::cout << "MIPS : " << mips.probe << " of "
+              << swan::MipsClusters(mips) << " clusters, built in "
+              << std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - mips_start)
+                     .count()
+              << "[s]" << std::endl;
+  }
+  double load_time = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - load_start)
+                         .count();
 
   // 4. Load vocabrary.
   std::ifstream vocab_fs(args.vocab_path, std::ios::in | std::ios::binary);
@@ -143,7 +490,7 @@ int main(int argc, char* argv[]) {
     return EXIT_FAILURE;
   }
   static swan::Vocab vocab;
-  const int vocab_size = swan::kVocabSize;
+  const int vocab_size = S::kVocabSize;
   swan::ResizeVocab(vocab, vocab_size);
   swan::LoadVocab(vocab, vocab_fs);
   vocab_fs.close();
@@ -320,75 +667,173 @@ int main(int argc, char* argv[]) {
 #endif // USE_CPU_ONLY
 
   // 6. Decode
-  static swan::Context ctx;
-  swan::Tensor1d ctx_input;
-  static swan::Tensor3dCache ctx_k_cache;
-  static swan::Tensor3dCache ctx_v_cache;
-  swan::Tensor1dLogits ctx_logits;
-  swan::Tensor1d ctx_final_norm;
+  std::unique_ptr<swan::Session<S>> session(new swan::Session<S>);
+  if (args.print_softmax || args.log) {
+    session->trace.reset(new swan::Context<S>);
+  }
+  const swan::Context<S>* trace = session->trace.get();
+  typename S::Tensor1dLogits ctx_logits;
+  typename S::Tensor1d ctx_final_norm;
 
-  clock_t start_clk = clock();
+  // The KV cache holds at most seq_len positions, and so does the one of
+  // the draft model.
+  int max_seq = std::min<uint64_t>(args.max_seq, S::kSeqLen);
+  if (!args.draft_path.empty()) {
+    max_seq = std::min(max_seq, draft_config.seq_len);
+  }
 
-  int next;
-  int token = 1; // BOS (Begin of Sequence)
+  // The pages of the KV caches come from one pool. By default it holds
+  // max_seq positions of the prompt and of every batch sequence; pages are
+  // only backed by memory once a sequence reaches them.
+  const int kv_pages =
+      args.kv_pages > 0 ? args.kv_pages
+                        : swan::KVPages<S>(max_seq) *
+                              (args.batch > 1 ? args.batch + 1 : 1);
+  std::unique_ptr<swan::KVPool<S>> kv_pool(new swan::KVPool<S>);
+  swan::InitKVPool(*kv_pool, kv_layout, kv_format, kv_pages);
+  swan::InitKVCache(session->kv_cache, *kv_pool);
+
+  // BOS (Begin of Sequence) followed by the prompt.
+  std::vector<int> prompt = swan::Encode(vocab, args.prompt);
+  prompt.insert(prompt.begin(), 1);
+  prompt.resize(std::min<size_t>(prompt.size(), max_seq));
+  for (size_t i = 1; i < prompt.size(); ++i) {
+    printf("%s", vocab.dict.at(prompt[i]).data());
+  }
+  std::cout << std::flush;
+
+  // 6-0. Prefill every prompt token but the last, which the decode loop
+  //      consumes to produce the first new token.
+  //      Wall-clock time; clock() would add up the CPU time of every thread.
+  auto prefill_start = std::chrono::steady_clock::now();
+  //      kv_ok turns false once the KV pool runs out of pages, which cuts
+  //      the generation short; generated counts the tokens produced.
+  const int n_prefill = prompt.size() - 1;
+  bool kv_ok = true;
+  int generated = 0;
+#ifndef USE_CPU_ONLY
+  for (int pos = 0; kv_ok && pos < n_prefill; ++pos) {
+    kv_ok = swan::Decode<S>(prompt[pos], pos, *session, ctx_final_norm,
+                            *model, q, kernel_matmul, kernel_mul,
+                            kernel_rmsnorm, kernel_softmax, kernel_add,
+                            kernel_rope, ptr_a, ptr_b, ptr_c, ptr_d,
+                            ptr_result, ptr_result2, buffer_a, buffer_b,
+                            buffer_c, buffer_d, buffer_result, buffer_result2);
+  }
+#else
+  kv_ok = swan::Prefill<S>(prompt.data(), n_prefill, 0, *session, *model);
+#endif // USE_CPU_ONLY
+  auto decode_start = std::chrono::steady_clock::now();
+  double prefill_time =
+      std::chrono::duration<double>(decode_start - prefill_start).count();
+
+  int token = prompt.back();
+
+#ifdef USE_CPU_ONLY
+  // 6-1. With --batch, decode that many sequences together instead.
+  if (kv_ok && args.batch > 1) {
+    kv_ok = GenerateBatch<S>(args, *model, vocab, sampler, session->kv_cache,
+                             token, n_prefill, max_seq, generated);
+  }
+
+  // 6-1. With --draft_path, speculate with the draft model instead.
+  if (kv_ok && !args.draft_path.empty()) {
+    swan::DispatchModelShape(draft_config, [&](auto shape) {
+      using D = decltype(shape);
+      if constexpr (D::kVocabSize == S::kVocabSize) {
+        kv_ok = GenerateSpeculative<S, D>(args, draft_format, *model, vocab,
+                                          sampler, *session, prompt, max_seq,
+                                          decode_start, generated);
+      }
+    });
+  }
 
-  for (int pos = 0; pos < args.max_seq; ++pos) {
+  // 6-1. With --lookup_ngram, speculate with the token history instead.
+  if (kv_ok && args.lookup_ngram > 0) {
+    kv_ok = GenerateLookup<S>(args, *model, vocab, sampler, *session, prompt,
+                              max_seq, generated);
+  }
+#endif // USE_CPU_ONLY
+
+  int next;
+  for (int pos = n_prefill;
+       kv_ok && pos < max_seq && args.batch == 1 && !speculate; ++pos) {
 
-    // 6-1. Load the context input and decode the next token.
-    swan::CopyTensor1d(ctx_input, tok_emb_table[token]);
-    swan::Decode(token, pos, ctx_input, ctx_k_cache, ctx_v_cache,
-                 ctx_final_norm, weights
+    // 6-2. Decode the next token; its embedding is read in place.
+    kv_ok = swan::Decode<S>(token, pos, *session, ctx_final_norm, *model
 #ifndef USE_CPU_ONLY
-                 ,
-                 q, kernel_matmul, kernel_mul, kernel_rmsnorm, kernel_softmax,
-                 kernel_add, kernel_rope, ptr_a, ptr_b, ptr_c, ptr_d,
-                 ptr_result, ptr_result2, buffer_a, buffer_b, buffer_c,
-                 buffer_d, buffer_result, buffer_result2
+                            ,
+                            q, kernel_matmul, kernel_mul, kernel_rmsnorm,
+                            kernel_softmax, kernel_add, kernel_rope, ptr_a,
+                            ptr_b, ptr_c, ptr_d, ptr_result, ptr_result2,
+                            buffer_a, buffer_b, buffer_c, buffer_d,
+                            buffer_result, buffer_result2
 #endif // USE_CPU_ONLY
     );
-
-    // 6-2. Calculate the logits and softmax.
-    swan::MutmulVocab(ctx_logits, ctx_final_norm, tok_emb_table);
+    if (!kv_ok) {
+      break;
+    }
 
     if (args.print_softmax) {
       printf("\nSoftmax\n <- ");
       for (int i = 0; i <= pos; ++i)
-        printf("%5.4f, ", ctx.attn_qk[0][i]);
+        printf("%5.4f, ", trace->attn_qk[0][i]);
       printf("\n -> ");
       for (int i = 0; i <= pos; ++i)
-        printf("%5.4f, ", ctx.attn_sm[0][i]);
+        printf("%5.4f, ", trace->attn_sm[0][i]);
       printf("\n");
     }
 
-    // 6-3. Sampling the next token.
-    if (args.temp < 1e-5) {
-      next = swan::Argmax(ctx_logits);
+    // 6-3. Calculate the logits and sample the next token.
+    //      Greedy decoding and small top-k only need the best few tokens,
+    //      so the classifier keeps a running top-k instead of writing out
+    //      every logit.
+    if (use_mips) {
+      int k = swan::MipsTopK(mips, top.data(), candidates, ctx_final_norm);
+      next = swan::SampleTopK(sampler, top.data(), k);
+    } else if (candidates > 0) {
+      int k = swan::MutmulVocabTopKCPU(top.data(), candidates, ctx_final_norm,
+                                       model->classifier);
+      next = swan::SampleTopK(sampler, top.data(), k);
     } else {
-      for (int q = 0; q < vocab_size; ++q) {
-        ctx_logits[q] /= args.temp;
-      }
-      swan::Softmax(ctx_logits, ctx_logits);
-      next = SelectFromLogits(ctx_logits);
+      swan::MutmulVocabCPU(ctx_logits, ctx_final_norm, model->classifier);
+      next = swan::Sample(sampler, ctx_logits, vocab_size);
     }
 
     args.color ? printf("\e[31m%s\e[0m", vocab.dict.at(next).data())
                : printf("%s", vocab.dict.at(next).data());
     std::cout << std::flush;
+    ++generated;
 
     // Dump the contexts.
     if (args.log) {
-      DumpContext("log/" + std::to_string(pos) + "_", ctx, swan::kNumLayers);
+      DumpContext("log/" + std::to_string(pos) + "_", *trace, S::kNumLayers);
     }
 
     token = next;
   }
   std::cout << "\n";
 
-  // 7. Print the time and speed.
-  clock_t end_clk = clock();
-  double decode_time = (double)(end_clk - start_clk) / CLOCKS_PER_SEC;
+  // 7. Print the time and speed, and the KV cache pages used.
+  const size_t page_bytes =
+      kv_format == swan::KVFormat::kQ8
+          ? 2 * (swan::KVPageSize<S>() +
+                 swan::KVScalePageSize<S>() * sizeof(float))
+          : 2 * swan::KVPageSize<S>() * sizeof(float);
+  double decode_time = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - decode_start)
+                           .count();
+  std::cout << "Load : " << load_time << "[s]" << std::endl;
+  if (n_prefill > 0) {
+    std::cout << "Fill : " << prefill_time << "[s], " << n_prefill
+              << "[tok], " << n_prefill / prefill_time << "[tok/s]"
+              << std::endl;
+  }
   std::cout << "Time : " << decode_time << "[s]" << std::endl
-            << "Speed: " << args.max_seq / decode_time << "[tok/s]"
+            << "Speed: " << generated / decode_time
+            << "[tok/s]" << std::endl
+            << "KV   : " << kv_pool->peak_pages << " of " << kv_pages
+            << "[page], " << kv_pool->peak_pages * page_bytes / 1e6 << "[MB]"
             << std::endl;
 
 #ifndef USE_CPU_ONLY
@@ -399,5 +844,263 @@ int main(int argc, char* argv[]) {
   OCL_CHECK(err, err = q.finish());
 #endif // USE_CPU_ONLY
 
+  swan::UnmapWeights(weight_map);
+
+  if (!kv_ok) {
+    std::cout << "KV cache pool exhausted: " << kv_pages << " pages"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
   return 0;
 }
+
+int main(int argc, char* argv[]) {
+  // 1. Parse arguments.
+  Args args;
+  ParseArgument(argc, argv, args);
+
+  if (args.help) {
+    std::cout << "Usage: " << argv[0] << " [options]" << std::endl
+              << "Options:" << std::endl
+              << "  --weight_path   : Weight file path" << std::endl
+              << "  --vocab_path    : Tokenizer file path" << std::endl
+              << "  --prompt        : Text to start the generation from"
+              << std::endl
+              << "  --mmap          : Map the weight file in place" << std::endl
+              << "  --populate      : Prefault the mapped weights" << std::endl
+              << "  --mlock         : Lock the mapped weights in RAM" << std::endl
+              << "  --isa           : CPU kernels (default: auto)" << std::endl
+              << "  --dtype         : Weight format (f32, f16, bf16, q8, q4)"
+              << std::endl
+              << "  --fold_norm     : Fold the RMSNorm weights into the matmuls"
+              << std::endl
+              << "  --kv_layout     : KV cache layout (head, vt)" << std::endl
+              << "  --kv_dtype      : KV cache format (f32, q8)" << std::endl
+              << "  --kv_pages      : KV cache pages shared by the sequences "
+                 "(default: 0, enough for all)"
+              << std::endl
+              << "  --threads       : Number of threads (default: all CPUs)"
+              << std::endl
+              << "  --pin           : Pin each thread to its own CPU" << std::endl
+              << "  --batch         : Number of sequences decoded together"
+              << std::endl
+              << "  --max_seq       : Maximum sequence length" << std::endl
+              << "  --temp          : Temperature for sampling" << std::endl
+              << "  --top_k         : Sample from the k most likely tokens"
+              << std::endl
+              << "  --top_p         : Sample from the smallest set with this "
+                 "probability"
+              << std::endl
+              << "  --seed          : Random seed (default: random)"
+              << std::endl
+              << "  --mips_probe    : Classifier clusters scored per token "
+                 "with top-k (default: 0, exact)"
+              << std::endl
+              << "  --mips_min_temp : Exact classifier below this temperature"
+              << std::endl
+              << "  --draft_path    : Draft model for speculative decoding"
+              << std::endl
+              << "  --draft_dtype   : Draft weight format (default: f32)"
+              << std::endl
+              << "  --draft_len     : Tokens proposed per draft step "
+                 "(default: 4)"
+              << std::endl
+              << "  --lookup_ngram  : Propose tokens that followed the last "
+                 "n-gram before (default: 0, off)"
+              << std::endl
+              << "  --color         : Enable color output" << std::endl
+              << "  --log           : Enable log output" << std::endl
+              << "  --help, -h      : Show this help message" << std::endl;
+    return 0;
+  }
+
+  // 2. Read and print hyper parameters.
+  std::ifstream weight_fs(args.weight_path, std::ios::in | std::ios::binary);
+  if (!weight_fs) {
+    std::cout << "Failed to open: " << args.weight_path << std::endl;
+    return EXIT_FAILURE;
+  }
+  swan::Config config;
+  swan::ReadConfig(config, weight_fs);
+  weight_fs.close();
+
+  std::cout << "Hyper Parameters" << std::endl
+            << "  dim       : " << config.dim << std::endl
+            << "  ffn_dim   : " << config.ffn_dim << std::endl
+            << "  n_layers  : " << config.n_layers << std::endl
+            << "  n_heads   : " << config.n_heads << std::endl
+            << "  n_kv_heads: " << config.n_kv_heads << std::endl
+            << "  vocab_size: " << config.vocab_size << std::endl
+            << "  seq_len   : " << config.seq_len << std::endl;
+
+  if (!swan::SelectCPUKernels(args.isa)) {
+    std::cout << "Unsupported CPU kernels: " << args.isa << std::endl;
+    return EXIT_FAILURE;
+  }
+  swan::WeightFormat format;
+  if (!swan::ParseWeightFormat(args.dtype, format)) {
+    std::cout << "Unsupported weight format: " << args.dtype << std::endl;
+    return EXIT_FAILURE;
+  }
+#ifndef USE_CPU_ONLY
+  if (format != swan::WeightFormat::kF32) {
+    std::cout << "The FPGA kernels only support f32 weights" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (args.fold_norm) {
+    std::cout << "The FPGA kernels apply the RMSNorm weights" << std::endl;
+    return EXIT_FAILURE;
+  }
+#endif // USE_CPU_ONLY
+  swan::KVLayout kv_layout;
+  if (!swan::ParseKVLayout(args.kv_layout, kv_layout)) {
+    std::cout << "Unsupported KV cache layout: " << args.kv_layout
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  swan::KVFormat kv_format;
+  if (!swan::ParseKVFormat(args.kv_dtype, kv_format)) {
+    std::cout << "Unsupported KV cache format: " << args.kv_dtype << std::endl;
+    return EXIT_FAILURE;
+  }
+#ifndef USE_CPU_ONLY
+  if (kv_format != swan::KVFormat::kF32) {
+    std::cout << "The FPGA kernels only support an f32 KV cache" << std::endl;
+    return EXIT_FAILURE;
+  }
+#endif // USE_CPU_ONLY
+  if (args.kv_pages < 0) {
+    std::cout << "Unsupported KV cache pages: " << args.kv_pages << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (args.top_k < 0 || !(args.top_p > 0 && args.top_p <= 1)) {
+    std::cout << "Unsupported top_k / top_p: " << args.top_k << " / "
+              << args.top_p << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (args.mips_probe < 0) {
+    std::cout << "Unsupported MIPS probe: " << args.mips_probe << std::endl;
+    return EXIT_FAILURE;
+  }
+  swan::Config draft_config{};
+  swan::WeightFormat draft_format = swan::WeightFormat::kF32;
+  if (!args.draft_path.empty()) {
+    std::ifstream draft_fs(args.draft_path, std::ios::in | std::ios::binary);
+    if (!draft_fs) {
+      std::cout << "Failed to open: " << args.draft_path << std::endl;
+      return EXIT_FAILURE;
+    }
+    swan::ReadConfig(draft_config, draft_fs);
+    draft_fs.close();
+    if (draft_config.vocab_size != config.vocab_size ||
+        !swan::DispatchModelShape(draft_config, [](auto) {})) {
+      std::cout << "Unsupported draft model: " << args.draft_path
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+    if (!swan::ParseWeightFormat(args.draft_dtype, draft_format)) {
+      std::cout << "Unsupported draft weight format: " << args.draft_dtype
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (args.lookup_ngram < 0 ||
+      (args.lookup_ngram > 0 && !args.draft_path.empty())) {
+    std::cout << "Unsupported lookup n-gram: " << args.lookup_ngram
+              << (args.lookup_ngram > 0 ? " with a draft model" : "")
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  const bool speculate = !args.draft_path.empty() || args.lookup_ngram > 0;
+  if (speculate && (args.draft_len < 1 || args.draft_len >= swan::kMaxBatch)) {
+    std::cout << "Unsupported draft length: " << args.draft_len << std::endl;
+    return EXIT_FAILURE;
+  }
+#ifndef USE_CPU_ONLY
+  if (speculate) {
+    std::cout << "The FPGA kernels do not decode speculatively" << std::endl;
+    return EXIT_FAILURE;
+  }
+#endif // USE_CPU_ONLY
+  if (args.batch < 1) {
+    std::cout << "Unsupported batch size: " << args.batch << std::endl;
+    return EXIT_FAILURE;
+  }
+#ifndef USE_CPU_ONLY
+  if (args.batch > 1) {
+    std::cout << "The FPGA kernels only decode one sequence" << std::endl;
+    return EXIT_FAILURE;
+  }
+#endif // USE_CPU_ONLY
+  if (args.batch > 1 && speculate) {
+    std::cout << "Speculative decoding only decodes one sequence" << std::endl;
+    return EXIT_FAILURE;
+  }
+  const bool tracing = args.log || args.print_softmax;
+  if (tracing && args.batch > 1) {
+    std::cout << "--log and --print_softmax only trace one sequence"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (tracing && !args.draft_path.empty()) {
+    std::cout << "--log and --print_softmax do not trace a draft model run"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (tracing && args.lookup_ngram > 0) {
+    std::cout << "--log and --print_softmax do not trace a prompt lookup run"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (args.kv_pages > 0) {
+    // One sequence must fit, with max_seq clamped as Run does.
+    int min_pages = 0;
+    swan::DispatchModelShape(config, [&](auto shape) {
+      using S = decltype(shape);
+      int max_seq = std::min<uint64_t>(args.max_seq, S::kSeqLen);
+      if (!args.draft_path.empty()) {
+        max_seq = std::min(max_seq, draft_config.seq_len);
+      }
+      min_pages = swan::KVPages<S>(max_seq);
+    });
+    if (args.kv_pages < min_pages) {
+      std::cout << "Too few KV cache pages: " << args.kv_pages << ", "
+                << min_pages << " hold max_seq" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (args.seed < 0) {
+    args.seed = std::random_device()() & 0x7fffffff;
+  }
+  int threads = swan::InitThreadPool(args.threads, args.pin);
+  std::cout << "CPU Kernels : " << swan::CPUKernelName() << std::endl
+            << "Weights     : " << swan::WeightFormatName(format)
+            << (args.fold_norm ? ", RMSNorm folded" : "") << std::endl
+            << "KV Cache    : " << swan::KVLayoutName(kv_layout) << ", "
+            << swan::KVFormatName(kv_format) << std::endl
+            << "Threads     : " << threads << std::endl
+            << "Seed        : " << args.seed << std::endl;
+  if (!args.draft_path.empty()) {
+    std::cout << "Draft Model : " << args.draft_path << ", "
+              << swan::WeightFormatName(draft_format) << ", "
+              << args.draft_len << " tokens" << std::endl;
+  }
+  if (args.lookup_ngram > 0) {
+    std::cout << "Lookup      : " << args.lookup_ngram << "-grams, "
+              << args.draft_len << " tokens" << std::endl;
+  }
+
+  // 3. Run the kernels compiled for this model shape.
+  int status = EXIT_FAILURE;
+  bool supported = swan::DispatchModelShape(config, [&](auto shape) {
+    status = Run<decltype(shape)>(args, format, kv_layout, kv_format,
+                                  draft_config, draft_format);
+  });
+  swan::ShutdownThreadPool();
+  if (!supported) {
+    std::cout << "Unsupported model shape: " << args.weight_path << std::endl;
+    return EXIT_FAILURE;
+  }
+  return status;
+}
+
@@ -0,0 +1,145 @@
+#include "mips.hpp"
+
+#include <algorithm>
+
+namespace swan {
+
+// Rows assigned per matrix-matrix product while clustering.
+static constexpr int kAssignRows = 1024;
+
+// Assign each of the n rows of x [n, cols] to the centroid nearest in L2,
+// i.e. the largest x . c - |c|^2 / 2.
+static void AssignRows(std::vector<int>& assign, const std::vector<float>& x,
+                       const std::vector<float>& c, int n, int clusters,
+                       int cols) {
+  std::vector<float> half_norm(clusters);
+  for (int j = 0; j < clusters; ++j) {
+    float sum = 0;
+    for (int i = 0; i < cols; ++i) {
+      sum += c[j * cols + i] * c[j * cols + i];
+    }
+    half_norm[j] = sum / 2;
+  }
+
+  const Matrix centroids = F32Matrix(c.data(), clusters, cols);
+  std::vector<float> scores(static_cast<size_t>(kAssignRows) * clusters);
+  for (int b = 0; b < n; b += kAssignRows) {
+    const int m = std::min(kAssignRows, n - b);
+    Gemm(scores.data(), &x[static_cast<size_t>(b) * cols], m, centroids);
+    for (int t = 0; t < m; ++t) {
+      const float* s = &scores[static_cast<size_t>(t) * clusters];
+      int best = 0;
+      for (int j = 1; j < clusters; ++j) {
+        if (s[j] - half_norm[j] > s[best] - half_norm[best]) {
+          best = j;
+        }
+      }
+      assign[b + t] = best;
+    }
+  }
+}
+
+void BuildMipsIndex(MipsIndex& index, const Matrix& w, int probe) {
+  const int n = w.rows;
+  const int cols = w.cols;
+  const int clusters =
+      std::max(1, (n + kMipsClusterRows - 1) / kMipsClusterRows);
+  index = MipsIndex();
+  index.probe = std::clamp(probe, 1, clusters);
+
+  std::vector<float> x(static_cast<size_t>(n) * cols);
+  for (int i = 0; i < n; ++i) {
+    GetMatrixRow(w, i, &x[static_cast<size_t>(i) * cols]);
+  }
+
+  // Lloyd's k-means from evenly spaced rows. An empty cluster keeps its
+  // centroid.
+  std::vector<float> c(static_cast<size_t>(clusters) * cols);
+  for (int j = 0; j < clusters; ++j) {
+    const size_t row = static_cast<size_t>(j) * n / clusters;
+    std::copy_n(&x[row * cols], cols, &c[static_cast<size_t>(j) * cols]);
+  }
+  std::vector<int> assign(n);
+  for (int it = 0;; ++it) {
+    AssignRows(assign, x, c, n, clusters, cols);
+    if (it == kMipsIterations) {
+      break;
+    }
+    std::vector<double> sums(c.size(), 0);
+    std::vector<int> counts(clusters, 0);
+    for (int i = 0; i < n; ++i) {
+      ++counts[assign[i]];
+      for (int k = 0; k < cols; ++k) {
+        sums[static_cast<size_t>(assign[i]) * cols + k] +=
+            x[static_cast<size_t>(i) * cols + k];
+      }
+    }
+    for (int j = 0; j < clusters; ++j) {
+      for (int k = 0; counts[j] > 0 && k < cols; ++k) {
+        c[static_cast<size_t>(j) * cols + k] =
+            sums[static_cast<size_t>(j) * cols + k] / counts[j];
+      }
+    }
+  }
+
+  // Group the rows by cluster, in row order within each.
+  index.offsets.assign(clusters + 1, 0);
+  for (int i = 0; i < n; ++i) {
+    ++index.offsets[assign[i] + 1];
+  }
+  for (int j = 0; j < clusters; ++j) {
+    index.offsets[j + 1] += index.offsets[j];
+  }
+  index.ids.resize(n);
+  std::vector<int> next(index.offsets.begin(), index.offsets.end() - 1);
+  for (int i = 0; i < n; ++i) {
+    index.ids[next[assign[i]]++] = i;
+  }
+  index.rows = GatherRows(index.row_buffer, w, index.ids.data(), n);
+
+  index.centroids = AllocMatrix(index.centroid_buffer, WeightFormat::kF32,
+                                clusters, cols);
+  for (int j = 0; j < clusters; ++j) {
+    SetMatrixRow(index.centroid_buffer, index.centroids, j,
+                 &c[static_cast<size_t>(j) * cols]);
+  }
+}
+
+int MipsClusters(const MipsIndex& index) {
+  return index.centroids.rows;
+}
+
+int MipsTopK(const MipsIndex& index, Logit* top, int k, const float* in) {
+  static thread_local std::vector<float> scores;
+  static thread_local std::vector<Logit> best;
+  static thread_local std::vector<int> begins;
+  static thread_local std::vector<int> ends;
+
+  // 1. The probe clusters whose centroids score highest.
+  scores.resize(MipsClusters(index));
+  best.resize(index.probe);
+  Gemv(scores.data(), in, index.centroids);
+  const int probe = TopK(best.data(), index.probe, scores.data(),
+                         scores.size());
+
+  // 2. Every row of those clusters.
+  begins.resize(probe);
+  ends.resize(probe);
+  for (int i = 0; i < probe; ++i) {
+    begins[i] = index.offsets[best[i].id];
+    ends[i] = index.offsets[best[i].id + 1];
+  }
+  k = GemvTopKRanges(top, k, in, index.rows, begins.data(), ends.data(),
+                     probe);
+
+  // Back to source rows, with ties going to the lower one again.
+  for (int i = 0; i < k; ++i) {
+    top[i].id = index.ids[top[i].id];
+  }
+  std::sort(top, top + k, [](const Logit& lhs, const Logit& rhs) {
+    return lhs.value > rhs.value || (lhs.value == rhs.value && lhs.id < rhs.id);
+  });
+  return k;
+}
+
+} // namespace swan
@@ -0,0 +1,47 @@
+#ifndef MIPS_HPP_
+#define MIPS_HPP_
+
+#include <vector>
+
+#include "tensor_cpu.hpp"
+
+namespace swan {
+
+// Average rows per cluster of a MipsIndex.
+constexpr int kMipsClusterRows = 128;
+
+// Lloyd iterations of the k-means that builds a MipsIndex.
+constexpr int kMipsIterations = 10;
+
+// Inverted-file index for the largest inner products of a query with the
+// rows of a matrix, such as the logits of the classifier.
+// The rows are clustered with k-means and stored grouped by cluster. A
+// query scores the centroids first and then only the rows of the probe
+// clusters whose centroids score highest, so more probes trade speed for
+// recall; probing every cluster is exact.
+struct MipsIndex {
+  int probe = 0;            // clusters scored per query
+  Matrix centroids;         // [clusters, cols], fp32
+  Matrix rows;              // rows grouped by cluster, in the source format
+  std::vector<int> offsets; // [clusters + 1], cluster c at offsets[c]
+  std::vector<int> ids;     // source row of each row of rows
+
+  MatrixBuffer centroid_buffer;
+  MatrixBuffer row_buffer;
+};
+
+// Cluster the rows of w into about rows / kMipsClusterRows clusters.
+void BuildMipsIndex(MipsIndex& index, const Matrix& w, int probe);
+
+// Number of clusters of the index.
+int MipsClusters(const MipsIndex& index);
+
+// Approximate GemvTopK of in against the matrix of the index: the k
+// largest products among the rows of the probed clusters, sorted by
+// descending value, with the row ids of the source matrix.
+// Returns min(k, kMaxTopK, rows probed).
+int MipsTopK(const MipsIndex& index, Logit* top, int k, const float* in);
+
+} // namespace swan
+
+#endif // MIPS_HPP_
@@ -0,0 +1,253 @@
+#include "sampler.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace swan {
+
+void InitSampler(Sampler& sampler, float temperature, int top_k, float top_p,
+                 uint64_t seed) {
+  sampler = Sampler();
+  sampler.temperature = temperature;
+  sampler.top_k = std::max(top_k, 0);
+  sampler.top_p = top_p;
+  sampler.rng.seed(seed);
+}
+
+int SamplerCandidates(const Sampler& sampler) {
+  if (sampler.temperature < kGreedyTemperature) {
+    return 1;
+  }
+  return sampler.top_k <= kMaxTopK ? sampler.top_k : 0;
+}
+
+// Uniform in [0, 1) from the top 24 bits, the same on every platform.
+static float Uniform(std::mt19937_64& rng) {
+  return (rng() >> 40) * (1.0f / (1 << 24));
+}
+
+// Draw one of k candidates with probability proportional to
+// exp((value - max) / temperature); mass is the sum of those weights.
+static int Draw(Sampler& sampler, const Logit* c, int k, float max,
+                float mass) {
+  const float inv_t = 1 / sampler.temperature;
+  const float r = Uniform(sampler.rng) * mass;
+  float cdf = 0;
+  for (int i = 0; i < k; ++i) {
+    cdf += std::exp((c[i].value - max) * inv_t);
+    if (r < cdf) {
+      return c[i].id;
+    }
+  }
+
+  // in case of rounding errors
+  return c[k - 1].id;
+}
+
+// Higher value first, lower id on ties, as GemvTopK sorts.
+static bool Better(const Logit& lhs, const Logit& rhs) {
+  return lhs.value > rhs.value || (lhs.value == rhs.value && lhs.id < rhs.id);
+}
+
+// Move the fewest best of m candidates whose weights w[id] add up to need
+// to the front, in no particular order, and return how many they are.
+// A quickselect on the accumulated weight, so the candidates are never
+// sorted.
+static int SelectNucleus(Logit* c, int m, const float* w, float need) {
+  int lo = 0; // c[0, lo) is in the nucleus, c[hi, m) is not
+  int hi = m;
+  while (lo < hi) {
+    const Logit pivot = c[lo + (hi - lo) / 2];
+    Logit* mid = std::partition(c + lo, c + hi, [&](const Logit& x) {
+      return Better(x, pivot);
+    });
+    float mass = 0;
+    for (Logit* x = c + lo; x < mid; ++x) {
+      mass += w[x->id];
+    }
+    if (mass >= need) {
+      hi = mid - c;
+      continue;
+    }
+    // Everything better than the pivot is in, then the pivot itself.
+    std::iter_swap(mid, std::find_if(mid, c + hi, [&](const Logit& x) {
+                     return x.id == pivot.id;
+                   }));
+    need -= mass + w[pivot.id];
+    lo = mid - c + 1;
+    if (need <= 0) {
+      break;
+    }
+  }
+  return lo;
+}
+
+int SampleTopK(Sampler& sampler, const Logit* top, int k) {
+  if (sampler.temperature < kGreedyTemperature) {
+    return top[0].id;
+  }
+  if (sampler.top_k > 0) {
+    k = std::min(k, sampler.top_k);
+  }
+  const float inv_t = 1 / sampler.temperature;
+  const float max = top[0].value;
+  float total = 0;
+  for (int i = 0; i < k; ++i) {
+    total += std::exp((top[i].value - max) * inv_t);
+  }
+
+  // Top-p: the shortest prefix holding top_p of the mass.
+  float mass = 0;
+  for (int i = 0; i < k; ++i) {
+    mass += std::exp((top[i].value - max) * inv_t);
+    if (mass >= sampler.top_p * total) {
+      k = i + 1;
+      break;
+    }
+  }
+  return Draw(sampler, top, k, max, mass);
+}
+
+int Sample(Sampler& sampler, const float* logits, int n) {
+  if (sampler.temperature < kGreedyTemperature) {
+    return std::max_element(logits, logits + n) - logits;
+  }
+
+  std::vector<Logit>& c = sampler.candidates;
+  if (sampler.top_k > 0 && sampler.top_k < n) {
+    c.resize(sampler.top_k);
+    return SampleTopK(sampler, c.data(), TopK(c.data(), c.size(), logits, n));
+  }
+
+  // Every token: weights relative to the best one.
+  const float max = *std::max_element(logits, logits + n);
+  const float inv_t = 1 / sampler.temperature;
+  std::vector<float>& w = sampler.weights;
+  w.resize(n);
+  float total = 0;
+  for (int i = 0; i < n; ++i) {
+    w[i] = std::exp((logits[i] - max) * inv_t);
+    total += w[i];
+  }
+
+  if (sampler.top_p >= 1 || n == 1) {
+    const float r = Uniform(sampler.rng) * total;
+    float cdf = 0;
+    for (int i = 0; i < n; ++i) {
+      cdf += w[i];
+      if (r < cdf) {
+        return i;
+      }
+    }
+    return n - 1;
+  }
+
+  // Top-p: the n - 1 tokens other than the best one, whose weight is 1,
+  // hold less than 1 - top_p of the mass together if each is below the
+  // cutoff, so only those above it can be in the nucleus.
+  const float cutoff = std::min(1.0f, (1 - sampler.top_p) / (n - 1) * total);
+  c.clear();
+  for (int i = 0; i < n; ++i) {
+    if (w[i] >= cutoff) {
+      c.push_back({i, logits[i]});
+    }
+  }
+  const int k = SelectNucleus(c.data(), c.size(), w.data(),
+                              sampler.top_p * total);
+  float mass = 0;
+  for (int i = 0; i < k; ++i) {
+    mass += w[c[i].id];
+  }
+  return Draw(sampler, c.data(), k, max, mass);
+}
+
+void SampleDistribution(Sampler& sampler, const float* logits, int n,
+                        float* probs) {
+  std::fill(probs, probs + n, 0);
+  if (sampler.temperature < kGreedyTemperature) {
+    probs[std::max_element(logits, logits + n) - logits] = 1;
+    return;
+  }
+
+  // The tokens top-k keeps, weighted relative to the best one in place.
+  std::vector<Logit>& c = sampler.candidates;
+  if (sampler.top_k > 0 && sampler.top_k < n) {
+    c.resize(sampler.top_k);
+    c.resize(TopK(c.data(), c.size(), logits, n));
+  } else {
+    c.resize(n);
+    for (int i = 0; i < n; ++i) {
+      c[i] = {i, logits[i]};
+    }
+  }
+  const float max = std::min_element(c.begin(), c.end(), Better)->value;
+  const float inv_t = 1 / sampler.temperature;
+  float total = 0;
+  for (const Logit& x : c) {
+    probs[x.id] = std::exp((x.value - max) * inv_t);
+    total += probs[x.id];
+  }
+
+  // Then those top-p keeps.
+  int k = c.size();
+  if (sampler.top_p < 1) {
+    k = SelectNucleus(c.data(), k, probs, sampler.top_p * total);
+    for (size_t i = k; i < c.size(); ++i) {
+      probs[c[i].id] = 0;
+    }
+    total = 0;
+    for (int i = 0; i < k; ++i) {
+      total += probs[c[i].id];
+    }
+  }
+  for (int i = 0; i < k; ++i) {
+    probs[c[i].id] /= total;
+  }
+}
+
+int SampleFrom(Sampler& sampler, const float* probs, int n) {
+  const float r = Uniform(sampler.rng);
+  float cdf = 0;
+  int last = 0;
+  for (int i = 0; i < n; ++i) {
+    if (probs[i] > 0) {
+      cdf += probs[i];
+      last = i;
+      if (r < cdf) {
+        return i;
+      }
+    }
+  }
+
+  // in case of rounding errors
+  return last;
+}
+
+bool AcceptDraft(Sampler& sampler, float p, float q) {
+  return Uniform(sampler.rng) * q < p;
+}
+
+int SampleResidual(Sampler& sampler, const float* p, const float* q, int n) {
+  float mass = 0;
+  for (int i = 0; i < n; ++i) {
+    mass += std::max(p[i] - q[i], 0.0f);
+  }
+  if (!(mass > 0)) {
+    return SampleFrom(sampler, p, n);
+  }
+  const float r = Uniform(sampler.rng) * mass;
+  float cdf = 0;
+  int last = 0;
+  for (int i = 0; i < n; ++i) {
+    if (p[i] > q[i]) {
+      cdf += p[i] - q[i];
+      last = i;
+      if (r < cdf) {
+        return i;
+      }
+    }
+  }
+  return last;
+}
+
+} // namespace swan
@@ -0,0 +1,68 @@
+#ifndef SAMPLER_HPP_
+#define SAMPLER_HPP_
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "tensor_cpu.hpp"
+
+namespace swan {
+
+// Temperatures below this decode greedily.
+constexpr float kGreedyTemperature = 1e-5;
+
+// Picks the next token from the logits of the classifier.
+// The generator lives as long as the sampler, so a run is reproducible from
+// its seed. Probabilities are only computed for the tokens that survive
+// top-k, as exp((logit - max) / temperature), and never normalized over the
+// whole vocabulary.
+struct Sampler {
+  float temperature = 0; // below kGreedyTemperature: argmax
+  int top_k = 0;         // keep the k most likely tokens, 0 for all
+  float top_p = 1;       // then the smallest set with this much mass
+  std::mt19937_64 rng;
+
+  std::vector<Logit> candidates; // scratch
+  std::vector<float> weights;    // scratch
+};
+
+void InitSampler(Sampler& sampler, float temperature, int top_k, float top_p,
+                 uint64_t seed);
+
+// Number of best logits Sample needs: 1 for greedy decoding, top_k if it
+// is at most kMaxTopK, otherwise 0 for all of them. A classifier can then
+// produce just those with GemvTopK and hand them to SampleTopK.
+int SamplerCandidates(const Sampler& sampler);
+
+// Draw a token from n logits.
+int Sample(Sampler& sampler, const float* logits, int n);
+
+// Draw a token from the k best logits, sorted by descending value.
+// k must be at least SamplerCandidates when that is not 0.
+int SampleTopK(Sampler& sampler, const Logit* top, int k);
+
+// -- Speculative decoding --
+// A draft proposes tokens from its distribution q and the target keeps
+// each with probability min(1, p / q), drawing the first rejected one from
+// max(0, p - q) instead. The tokens kept then follow the distribution of
+// the target, with the same temperature, top-k and top-p for both.
+
+// Write the distribution Sample draws from, over all n tokens, to probs.
+// Greedy decoding puts all of it on the best token.
+void SampleDistribution(Sampler& sampler, const float* logits, int n,
+                        float* probs);
+
+// Draw a token from a distribution written by SampleDistribution.
+int SampleFrom(Sampler& sampler, const float* probs, int n);
+
+// Keep a drafted token of probability q under the draft and p under the
+// target?
+bool AcceptDraft(Sampler& sampler, float p, float q);
+
+// Draw the replacement of a rejected draft token from max(0, p - q).
+int SampleResidual(Sampler& sampler, const float* p, const float* q, int n);
+
+} // namespace swan
+
+#endif // SAMPLER_HPP_
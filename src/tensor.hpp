@@ -1,80 +1,493 @@
 #ifndef TENSOR_HPP_
 #define TENSOR_HPP_
 
+#include <cmath>
+#include <cstddef>
 #include <string>
+#include <utility>
 
 namespace swan {
 
-constexpr int kDim = 288;
-constexpr int kVocabSize = 32000;
-constexpr int kNumLayers = 6;
-constexpr int kNumHeads = 6;
-constexpr int kNumKVHeads = 6;
-constexpr int kSinCosTable = 24;
-constexpr int kSeqLen = 256;
-constexpr int kFFNDim = 768;
-constexpr int kHalvedHeadDim = (kDim / kNumLayers);
-
-using Tensor1d = float[kDim];
-using Tensor2dTok = float[kVocabSize][kDim];
-using Tensor2dAttn = float[kDim][kDim];
-using Tensor3dAttn = float[kNumLayers][kDim][kDim];
-using Tensor2dRMS = float[kNumLayers][kDim];
-using Tensor1dSinCos = float[kSinCosTable];
-using Tensor2dSinCos = float[kSeqLen][kSinCosTable];
-using Tensor2dFFNA = float[kFFNDim][kDim];
-using Tensor3dFFNA = float[kNumLayers][kFFNDim][kDim];
-using Tensor1dFFNB = float[kFFNDim];
-using Tensor2dFFNB = float[kDim][kFFNDim];
-using Tensor3dFFNB = float[kNumLayers][kDim][kFFNDim];
-using Tensor1dQKSM = float[kSeqLen];
-using Tensor2dQKSM = float[kNumLayers][kSeqLen];
-using Tensor2dFFNC = float[kNumLayers][kFFNDim];
-using Tensor2dCache = float[kSeqLen][kDim];
-using Tensor3dCache = float[kNumLayers][kSeqLen][kDim];
-using Tensor1dLogits = float[kVocabSize];
-using Tensor2d = float[kDim][kDim];
-using Tensor3d = float[kDim][kDim][kDim];
-
-void CopyTensor1d(Tensor1d& dst, const Tensor1d& src);
-void CopyTensor2d(Tensor2d& dst, const Tensor2d& src);
-void CopyTensor3d(Tensor3d& dst, const Tensor3d& src);
-
-void Add(Tensor1d& out, const Tensor1d& in, float a);
-void Mul(Tensor1dQKSM& out, const Tensor1dQKSM& in, float a);
-void Sub(Tensor1d& out, const Tensor1d& in, float a);
-void Div(Tensor1d& out, const Tensor1d& in, float a);
-
-void Add(Tensor1d& out, const Tensor1d& lhs, const Tensor1d& rhs);
-void Mul(Tensor1dFFNB& out, const Tensor1dFFNB& lhs, const Tensor1dFFNB& rhs);
-void Sub(Tensor1d& out, const Tensor1d& lhs, const Tensor1d& rhs);
-void Div(Tensor1d& out, const Tensor1d& lhs, const Tensor1d& rhs);
-
-float InnerProduct(const Tensor1d& lhs, const Tensor1d& rhs);
-void Matmul(Tensor1d& out, const Tensor1d& in, const Tensor2dAttn& w);
-void MutmulRanged(Tensor1dQKSM& out, const Tensor1d& in, const Tensor2dCache& w,
-                  int i_begin, int i_end, int j_begin, int j_end);
-void MutmulRangedTranspose(Tensor1d& out, const Tensor1dQKSM& in,
-                           const Tensor2dCache& w, int i_begin, int i_end,
-                           int j_begin, int j_end);
-void Matmul(Tensor1dFFNB& out, const Tensor1d& in, const Tensor2dFFNA& w);
-void Matmul(Tensor1d& out, const Tensor1dFFNB& in, const Tensor2dFFNB& w);
-void MutmulVocab(Tensor1dLogits& out, const Tensor1d& in, const Tensor2dTok& w);
-
-void ReLU(Tensor1d& out, const Tensor1d& in);
-void SiLU(Tensor1dFFNB& out, const Tensor1dFFNB& in);
-
-void RMSNorm(Tensor1d& out, const Tensor1d& in, const Tensor1d& w);
-void Softmax(Tensor1dQKSM& out, const Tensor1dQKSM& in, int max_pos = -1);
-void Softmax(Tensor1dLogits& out, const Tensor1dLogits& in, int max_pos = -1);
-
-std::pair<int, float> FindMaxIndexAndValue(const Tensor1d& in);
-float Max(const Tensor1d& in);
-int Argmax(const Tensor1dLogits& values);
-
-void RoPE(Tensor1d& q_out, Tensor1d& k_out, const Tensor1d& q_in,
-          const Tensor1d& k_in, const Tensor1dSinCos& cos_vec,
-          const Tensor1dSinCos& sin_vec, int head_begin, int head_size);
+// Hyper parameters stored in the header of a llama2.c checkpoint.
+struct Config {
+  int dim;
+  int ffn_dim;
+  int n_layers;
+  int n_heads;
+  int n_kv_heads;
+  int vocab_size; // negative if the classifier is not shared
+  int seq_len;
+};
+
+// Model shape fixed at compile time.
+// All tensor types are sized from it, so every kernel below is instantiated
+// with constant trip counts for each supported model.
+template <int Dim, int FFNDim, int NumLayers, int NumHeads, int NumKVHeads,
+          int VocabSize, int SeqLen>
+struct ModelShape {
+  static constexpr int kDim = Dim;
+  static constexpr int kVocabSize = VocabSize;
+  static constexpr int kNumLayers = NumLayers;
+  static constexpr int kNumHeads = NumHeads;
+  static constexpr int kNumKVHeads = NumKVHeads;
+  static constexpr int kSeqLen = SeqLen;
+  static constexpr int kFFNDim = FFNDim;
+  static constexpr int kHeadDim = kDim / kNumHeads;
+  static constexpr int kKVDim = kHeadDim * kNumKVHeads;
+  static constexpr int kSinCosTable = kHeadDim / 2;
+  static constexpr int kQKVDim = kDim + 2 * kKVDim;
+
+  static_assert(kDim % kNumHeads == 0, "dim must be divisible by n_heads");
+  static_assert(kNumHeads % kNumKVHeads == 0,
+                "n_heads must be divisible by n_kv_heads");
+
+  using Tensor1d = float[kDim];
+  using Tensor1dKV = float[kKVDim];
+  using Tensor2dTok = float[kVocabSize][kDim];
+  using Tensor2dAttn = float[kDim][kDim];
+  using Tensor3dAttn = float[kNumLayers][kDim][kDim];
+  using Tensor2dAttnKV = float[kKVDim][kDim];
+  using Tensor3dAttnKV = float[kNumLayers][kKVDim][kDim];
+  using Tensor2dQKV = float[kQKVDim][kDim];
+  using Tensor3dQKV = float[kNumLayers][kQKVDim][kDim];
+  using Tensor2dRMS = float[kNumLayers][kDim];
+  using Tensor2dRMSKV = float[kNumLayers][kKVDim];
+  using Tensor1dSinCos = float[kSinCosTable];
+  using Tensor2dSinCos = float[kSeqLen][kSinCosTable];
+  using Tensor2dFFNA = float[kFFNDim][kDim];
+  using Tensor3dFFNA = float[kNumLayers][kFFNDim][kDim];
+  using Tensor1dFFNB = float[kFFNDim];
+  using Tensor2dFFNB = float[kDim][kFFNDim];
+  using Tensor3dFFNB = float[kNumLayers][kDim][kFFNDim];
+  using Tensor1dQKSM = float[kSeqLen];
+  using Tensor2dQKSM = float[kNumLayers][kSeqLen];
+  using Tensor2dFFNC = float[kNumLayers][kFFNDim];
+  using Tensor2dCache = float[kSeqLen][kKVDim];
+  using Tensor3dCache = float[kNumLayers][kSeqLen][kKVDim];
+  using Tensor1dLogits = float[kVocabSize];
+
+  // Return true if the checkpoint header describes this shape.
+  static bool Matches(const Config& c) {
+    return c.dim == kDim && c.ffn_dim == kFFNDim &&
+           c.n_layers == kNumLayers && c.n_heads == kNumHeads &&
+           c.n_kv_heads == kNumKVHeads && c.vocab_size == kVocabSize &&
+           c.seq_len == kSeqLen;
+  }
+};
+
+// https://huggingface.co/karpathy/tinyllamas
+using Stories260K = ModelShape<64, 172, 5, 8, 4, 512, 512>;
+using Stories15M = ModelShape<288, 768, 6, 6, 6, 32000, 256>;
+using Stories42M = ModelShape<512, 1376, 8, 8, 8, 32000, 1024>;
+using Stories110M = ModelShape<768, 2048, 12, 12, 12, 32000, 1024>;
+
+// Model shapes compiled into the binary.
+// The FPGA kernels are synthesized for stories15M only.
+#ifdef USE_CPU_ONLY
+#define SWAN_MODEL_SHAPES(X) \
+  X(Stories260K)             \
+  X(Stories15M)              \
+  X(Stories42M)              \
+  X(Stories110M)
+#else
+#define SWAN_MODEL_SHAPES(X) X(Stories15M)
+#endif // USE_CPU_ONLY
+
+// Call f(S()) with the compiled shape S matching the checkpoint header.
+// Return false if no shape matches.
+template <typename F>
+bool DispatchModelShape(const Config& config, F&& f) {
+#define SWAN_DISPATCH_MODEL_SHAPE(S) \
+  if (S::Matches(config)) {          \
+    f(S());                          \
+    return true;                     \
+  }
+  SWAN_MODEL_SHAPES(SWAN_DISPATCH_MODEL_SHAPE)
+#undef SWAN_DISPATCH_MODEL_SHAPE
+  return false;
+}
+
+// The kernels are templates over the tensor extents, so the types of the
+// arguments select the specialization at compile time.
+
+/* ---------------------------------  /
+              Copy Tensor
+/  --------------------------------- */
+
+// Copies the contents from the source 1D tensor to the destination 1D tensor.
+template <size_t N>
+void CopyTensor1d(float (&dst)[N], const float (&src)[N]) {
+  for (size_t i = 0; i < N; i++) {
+    dst[i] = src[i];
+  }
+}
+
+// Copies the contents from the source 2D tensor to the destination 2D tensor.
+template <size_t Outer, size_t Inner>
+void CopyTensor2d(float (&dst)[Outer][Inner],
+                  const float (&src)[Outer][Inner]) {
+  for (size_t i = 0; i < Outer; i++) {
+    CopyTensor1d(dst[i], src[i]);
+  }
+}
+
+// Copies the contents from the source 3D tensor to the destination 3D tensor.
+template <size_t Outer, size_t Middle, size_t Inner>
+void CopyTensor3d(float (&dst)[Outer][Middle][Inner],
+                  const float (&src)[Outer][Middle][Inner]) {
+  for (size_t i = 0; i < Outer; i++) {
+    CopyTensor2d(dst[i], src[i]);
+  }
+}
+
+/* ---------------------------------  /
+      Basic Arithmetic Operations
+/  --------------------------------- */
+
+// Add a scalar to each element of the input tensor.
+template <size_t N>
+void Add(float (&out)[N], const float (&in)[N], float a) {
+  for (size_t i = 0; i < N; i++) {
+    out[i] = in[i] + a;
+  }
+}
+
+// Subtract a scalar from each element of the input tensor.
+template <size_t N>
+void Sub(float (&out)[N], const float (&in)[N], float a) {
+  for (size_t i = 0; i < N; i++) {
+    out[i] = in[i] - a;
+  }
+}
+
+// Multiply each element of the input tensor by a scalar.
+template <size_t N>
+void Mul(float (&out)[N], const float (&in)[N], float a) {
+  for (size_t i = 0; i < N; i++) {
+    out[i] = in[i] * a;
+  }
+}
+
+// Divide each element of the input tensor by a scalar.
+template <size_t N>
+void Div(float (&out)[N], const float (&in)[N], float a) {
+  for (size_t i = 0; i < N; i++) {
+    out[i] = in[i] / a;
+  }
+}
+
+// Add each element of the first input tensor to the corresponding element of
+// the second input tensor.
+template <size_t N>
+void Add(float (&out)[N], const float (&lhs)[N], const float (&rhs)[N]) {
+  for (size_t i = 0; i < N; ++i) {
+    out[i] = lhs[i] + rhs[i];
+  }
+}
+
+// Subtract each element of the second input tensor from the corresponding
+// element of the first input tensor.
+template <size_t N>
+void Sub(float (&out)[N], const float (&lhs)[N], const float (&rhs)[N]) {
+  for (size_t i = 0; i < N; ++i) {
+    out[i] = lhs[i] - rhs[i];
+  }
+}
+
+// Multiply each element of the first input tensor by the corresponding element
+// of the second input tensor.
+template <size_t N>
+void Mul(float (&out)[N], const float (&lhs)[N], const float (&rhs)[N]) {
+  for (size_t i = 0; i < N; ++i) {
+    out[i] = lhs[i] * rhs[i];
+  }
+}
+
+// Divide each element of the first input tensor by the corresponding element of
+// the second input tensor.
+template <size_t N>
+void Div(float (&out)[N], const float (&lhs)[N], const float (&rhs)[N]) {
+  for (size_t i = 0; i < N; ++i) {
+    out[i] = lhs[i] / rhs[i];
+  }
+}
+
+/* ---------------------------------  /
+           Matrix Operations
+/  --------------------------------- */
+
+// Compute the inner product of two input tensors.
+// out = Sum_i (lhs[i] . rhs[i])
+template <size_t N>
+float InnerProduct(const float (&lhs)[N], const float (&rhs)[N]) {
+  float sum = 0;
+  for (size_t i = 0; i < N; ++i) {
+    sum += lhs[i] * rhs[i];
+  }
+  return sum;
+}
+
+// Compute the matrix multiplication of two input tensors.
+// Tensor1d [cols] . Tensor2d [rows, cols] = Tensor1d [rows]
+// out[i] = w[i,j] . in[j]
+// Covers the attention [dim, dim], FFN [ffn_dim, dim] and [dim, ffn_dim]
+// projections.
+template <size_t Rows, size_t Cols>
+void Matmul(float (&out)[Rows], const float (&in)[Cols],
+            const float (&w)[Rows][Cols]) {
+  for (size_t i = 0; i < Rows; ++i) {
+    float sum = 0;
+    for (size_t j = 0; j < Cols; j++) {
+      sum += w[i][j] * in[j];
+    }
+    out[i] = sum;
+  }
+}
+
+// Compute the matrix multiplication of two input tensors.
+// Tensor1d [dim] . Tensor2dTok [vocab_size, dim] = Tensor1dLogits [vocab_size]
+// out[i] = w[i,j] . in[j]
+template <size_t VocabSize, size_t Dim>
+void MutmulVocab(float (&out)[VocabSize], const float (&in)[Dim],
+                 const float (&w)[VocabSize][Dim]) {
+  for (size_t i = 0; i < VocabSize; ++i) {
+    float sum = 0;
+    for (size_t j = 0; j < Dim; j++) {
+      sum += w[i][j] * in[j];
+    }
+    out[i] = sum;
+  }
+}
+
+// Compute the matrix multiplication of two input tensors.
+// Tensor1d [dim] . Tensor2dCache [seq_len, kv_dim] = Tensor1dQKSM [seq_len]
+// out[i] = w[i,j+w_offset] . in[j]
+// i = out_begin..out_end
+// j = in_begin..in_end
+// w_offset maps a query head onto its key/value head.
+template <size_t SeqLen, size_t Dim, size_t KVDim>
+void MutmulRanged(float (&out)[SeqLen], const float (&in)[Dim],
+                  const float (&w)[SeqLen][KVDim], int out_begin, int out_end,
+                  int in_begin, int in_end, int w_offset = 0) {
+  for (int i = out_begin; i < out_end; ++i) {
+    float sum = 0;
+    for (int j = in_begin; j < in_end; ++j) {
+      sum += w[i][j + w_offset] * in[j];
+    }
+    out[i] = sum;
+  }
+}
+
+// Compute the matrix multiplication of two input tensors.
+// Tensor1dQKSM [seq_len] . Tensor2dCache [seq_len, kv_dim] = Tensor1d [dim]
+// out[i] = w[j,i+w_offset] . in[j] <- transpose w
+// i = i_begin..i_end
+// j = j_begin..j_end
+template <size_t Dim, size_t SeqLen, size_t KVDim>
+void MutmulRangedTranspose(float (&out)[Dim], const float (&in)[SeqLen],
+                           const float (&w)[SeqLen][KVDim], int i_begin,
+                           int i_end, int j_begin, int j_end,
+                           int w_offset = 0) {
+  for (int i = i_begin; i < i_end; ++i) {
+    float sum = 0;
+    for (int j = j_begin; j < j_end; ++j) {
+      // reverse the order of w's index (w[j][i] -> w[i][j])
+      sum += w[j][i + w_offset] * in[j];
+    }
+    out[i] = sum;
+  }
+}
+
+/* ---------------------------------  /
+         Activation Functions
+/  --------------------------------- */
+
+inline float ReLU(float x) {
+  return x > 0 ? x : 0;
+}
+
+// Apply the ReLU activation function to each element of the input tensor.
+// out[i] = max(0, in[i])
+template <size_t N>
+void ReLU(float (&out)[N], const float (&in)[N]) {
+  for (size_t i = 0; i < N; ++i) {
+    out[i] = ReLU(in[i]);
+  }
+}
+
+inline float SiLU(float x) {
+  return x * (1.0 / (1.0 + std::exp(-x)));
+}
+
+// Apply the SiLU activation function to each element of the input tensor.
+// out[i] = in[i] * (1 / (1 + exp(-in[i])))
+template <size_t N>
+void SiLU(float (&out)[N], const float (&in)[N]) {
+  for (size_t i = 0; i < N; ++i) {
+    out[i] = SiLU(in[i]);
+  }
+}
+
+/* ---------------------------------  /
+      Normalization Operations
+/  --------------------------------- */
+
+// Compute the RMS normalization factor of the input tensor.
+// norm = 1 / sqrt(sum_i..N (in[i]^2) / N + eps)
+template <size_t N>
+float RMSNormFactor(const float (&in)[N]) {
+  // 1. Summation of Square
+  float sum = 0.0;
+  for (size_t i = 0; i < N; i++) {
+#ifndef USE_CPU_ONLY
+#pragma HLS UNROLL
+#endif // USE_CPU_ONLY
+    sum += in[i] * in[i];
+  }
+
+  // 2. Normalize Factor
+  //    Add small number to avoid "zero dividing error"
+  constexpr float eps = 1e-5;
+  return 1 / std::sqrt(sum / N + eps);
+}
+
+// Apply the RMS normalization to the input tensor.
+// out[i] = x[i] * norm * w[i]
+template <size_t N>
+void RMSNorm(float (&out)[N], const float (&in)[N], const float (&w)[N]) {
+  const float norm = RMSNormFactor(in);
+
+  // 3. Normalize and Scale with Weight
+  for (size_t i = 0; i < N; i++) {
+    out[i] = in[i] * norm * w[i];
+  }
+}
+
+// Apply the RMS normalization without a weight, for one already folded
+// into the projection that consumes out.
+// out[i] = x[i] * norm
+template <size_t N>
+void RMSNorm(float (&out)[N], const float (&in)[N]) {
+  const float norm = RMSNormFactor(in);
+  for (size_t i = 0; i < N; i++) {
+    out[i] = in[i] * norm;
+  }
+}
+
+// Apply the softmax function to the input tensor.
+// out[i] = exp(in[i]) / sum(exp(in[i]))
+// Only the first in_max_idx elements are used (all if -1).
+template <size_t N>
+void Softmax(float (&out)[N], const float (&in)[N], int in_max_idx = -1) {
+  if (in_max_idx == -1) {
+    in_max_idx = N;
+  }
+
+  // 1. Get Max
+  float max_val = in[0];
+  for (int i = 1; i < in_max_idx; i++) {
+    if (in[i] > max_val) {
+      max_val = in[i];
+    }
+  }
+
+  // 2. Exp and Sum
+  float sum = 0;
+  for (int i = 0; i < in_max_idx; i++) {
+    out[i] = std::exp(in[i] - max_val);
+    sum += out[i];
+  }
+
+  // 3. Normalize
+  for (int i = 0; i < in_max_idx; i++) {
+    out[i] /= sum;
+  }
+}
+
+/* ---------------------------------  /
+      Argmax and Max Operations
+/  --------------------------------- */
+
+// Return the index and value of the maximum value in the input tensor.
+// max_i = argmax_i (in[i])
+// max_val = max_i (in[i])
+template <size_t N>
+std::pair<int, float> FindMaxIndexAndValue(const float (&in)[N]) {
+  std::pair<int, float> max(0, in[0]);
+  for (size_t i = 1; i < N; i++) {
+    if (in[i] > max.second) {
+      max.first = i;
+      max.second = in[i];
+    }
+  }
+  return max;
+}
+
+// Return the sum of the input tensor.
+// max_val = max_i (in[i])
+template <size_t N>
+float Max(const float (&in)[N]) {
+  float max_val = in[0];
+  for (size_t i = 1; i < N; i++) {
+    if (in[i] > max_val) {
+      max_val = in[i];
+    }
+  }
+  return max_val;
+}
+
+// Return the index of the maximum value in the input tensor.
+// max_i = argmax_i (in[i])
+template <size_t N>
+int Argmax(const float (&in)[N]) {
+  int max_i = 0;
+  float max_value = in[0];
+  for (size_t i = 1; i < N; ++i)
+    if (in[i] > max_value) {
+      max_i = i;
+      max_value = in[i];
+    }
+  return max_i;
+}
+
+/* ---------------------------------  /
+      RoPE: Position Encoding
+/  --------------------------------- */
+
+// Apply the rotary position encoding to one head of the input tensors.
+// q_out[i] = q_in[i] * cos_vec[i] - q_in[i+1] * sin_vec[i]
+// q_out[i+1] = q_in[i] * sin_vec[i] + q_in[i+1] * cos_vec[i]
+// k_out[i] = k_in[i] * cos_vec[i] - k_in[i+1] * sin_vec[i]
+// k_out[i+1] = k_in[i] * sin_vec[i] + k_in[i+1] * cos_vec[i]
+// Heads beyond the key width (grouped-query attention) only rotate q.
+template <size_t Dim, size_t KVDim, size_t HalvedHeadDim>
+void RoPE(float (&q_out)[Dim], float (&k_out)[KVDim], const float (&q_in)[Dim],
+          const float (&k_in)[KVDim], const float (&cos_vec)[HalvedHeadDim],
+          const float (&sin_vec)[HalvedHeadDim], int head_begin,
+          int head_dim) {
+  const bool rotate_k = head_begin < static_cast<int>(KVDim);
+  for (size_t i = 0; i < HalvedHeadDim; ++i) {
+    int i0 = head_begin + i * 2 + 0;
+    int i1 = head_begin + i * 2 + 1;
+
+    float q0 = q_in[i0];
+    float q1 = q_in[i1];
+
+    float cos = cos_vec[i];
+    float sin = sin_vec[i];
+
+    q_out[i0] = q0 * cos - q1 * sin;
+    q_out[i1] = q0 * sin + q1 * cos;
+
+    if (rotate_k) {
+      float k0 = k_in[i0];
+      float k1 = k_in[i1];
+
+      k_out[i0] = k0 * cos - k1 * sin;
+      k_out[i1] = k0 * sin + k1 * cos;
+    }
+  }
+}
 
 } // namespace swan
 
@@ -0,0 +1,2348 @@
+#include "tensor_cpu.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+
+#include "thread_pool.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SWAN_CPU_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SWAN_CPU_NEON
+#endif
+
+namespace swan {
+
+// Kernel set chosen by SelectCPUKernels.
+struct CPUKernels {
+  const char* name;
+  bool (*supported)();
+  void (*gemv)(float* out, const float* in, const float* w, int rows,
+               int cols);
+  // Transposed product, out[j] = in[i] . w[i,j].
+  void (*gemv_t)(float* out, const float* in, const float* w, int rows,
+                 int cols);
+  // Same two products over int8 weights without scales, for the KV cache.
+  void (*gemv_s8)(float* out, const float* in, const int8_t* w, int rows,
+                  int cols);
+  void (*gemv_t_s8)(float* out, const float* in, const int8_t* w, int rows,
+                    int cols);
+  // Int8 weights and input, groups of kQuantGroup columns per row.
+  void (*gemv_q8)(float* out, const int8_t* x, const float* x_scales,
+                  const int8_t* w, const float* w_scales, int rows,
+                  int groups);
+  // Packed 4-bit weights with fp16 scales and int8 input.
+  void (*gemv_q4)(float* out, const int8_t* x, const float* x_scales,
+                  const uint8_t* w, const uint16_t* w_scales, int rows,
+                  int groups);
+  // fp16 and bf16 weights, widened to fp32 in registers.
+  void (*gemv_f16)(float* out, const float* in, const uint16_t* w, int rows,
+                   int cols);
+  void (*gemv_bf16)(float* out, const float* in, const uint16_t* w, int rows,
+                    int cols);
+  // Products of n inputs [n, cols] with fp32 weights,
+  // out[t * out_stride + i] = w[i,j] . in[t,j].
+  void (*gemm)(float* out, int out_stride, const float* in, int n,
+               const float* w, int rows, int cols);
+};
+
+// Bytes of one packed 4-bit group. Byte j holds column j in its low nibble
+// and column j + 16 in its high nibble.
+constexpr int kQ4GroupBytes = kQuantGroup / 2;
+
+// Weight value of each 4-bit code.
+static const int8_t kQ4Values[16] = {-8, -7, -6, -5, -4, -3, -2, -1,
+                                     0,  1,  2,  3,  4,  5,  6,  7};
+
+// Convert an IEEE half to float.
+static float HalfToFloat(uint16_t h) {
+  uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t bits;
+  if (exp == 0x1f) {
+    bits = sign | 0x7f800000 | (mant << 13); // inf or nan
+  } else if (exp != 0) {
+    bits = sign | ((exp + 112) << 23) | (mant << 13);
+  } else if (mant == 0) {
+    bits = sign;
+  } else {
+    // Subnormal: renormalize.
+    exp = 113;
+    while ((mant & 0x400) == 0) {
+      mant <<= 1;
+      --exp;
+    }
+    bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+  }
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+// Convert a float to the nearest IEEE half (round to nearest even).
+static uint16_t FloatToHalf(float f) {
+  uint32_t bits;
+  std::memcpy(&bits, &f, sizeof(bits));
+  uint16_t sign = (bits >> 16) & 0x8000;
+  uint32_t abs = bits & 0x7fffffff;
+  if (abs >= 0x7f800000) {
+    return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0); // inf or nan
+  }
+  if (abs >= 0x477ff000) {
+    return sign | 0x7c00; // overflow
+  }
+  if (abs < 0x38800000) {
+    // Subnormal or zero: let the FPU round the shifted value.
+    float magic;
+    uint32_t magic_bits = 0x3f000000; // 0.5
+    std::memcpy(&magic, &magic_bits, sizeof(magic));
+    float a;
+    std::memcpy(&a, &abs, sizeof(a));
+    a += magic;
+    uint32_t a_bits;
+    std::memcpy(&a_bits, &a, sizeof(a_bits));
+    return sign | static_cast<uint16_t>(a_bits - magic_bits);
+  }
+  uint32_t mant_odd = (abs >> 13) & 1;
+  abs += 0xc8000fff + mant_odd; // rebias exponent and round
+  return sign | static_cast<uint16_t>(abs >> 13);
+}
+
+// bf16 is the upper half of an fp32.
+static float BF16ToFloat(uint16_t h) {
+  uint32_t bits = static_cast<uint32_t>(h) << 16;
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+// Convert a float to the nearest bf16 (round to nearest even).
+static uint16_t FloatToBF16(float f) {
+  uint32_t bits;
+  std::memcpy(&bits, &f, sizeof(bits));
+  if ((bits & 0x7fffffff) > 0x7f800000) {
+    return (bits >> 16) | 0x40; // keep nan quiet
+  }
+  bits += 0x7fff + ((bits >> 16) & 1);
+  return bits >> 16;
+}
+
+/* ---------------------------------  /
+            Scalar Kernels
+/  --------------------------------- */
+
+static bool SupportsScalar() {
+  return true;
+}
+
+// Four independent partial sums per row keep the FP adder busy without
+// relying on the compiler to reassociate the reduction.
+static void GemvScalar(float* out, const float* in, const float* w, int rows,
+                       int cols) {
+  for (int i = 0; i < rows; ++i) {
+    const float* w_row = w + static_cast<size_t>(i) * cols;
+    float sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+    int j = 0;
+    for (; j + 4 <= cols; j += 4) {
+      sum0 += w_row[j + 0] * in[j + 0];
+      sum1 += w_row[j + 1] * in[j + 1];
+      sum2 += w_row[j + 2] * in[j + 2];
+      sum3 += w_row[j + 3] * in[j + 3];
+    }
+    for (; j < cols; ++j) {
+      sum0 += w_row[j] * in[j];
+    }
+    out[i] = (sum0 + sum1) + (sum2 + sum3);
+  }
+}
+
+// One input at a time; the blocking in Gemm keeps the rows in cache.
+static void GemmScalar(float* out, int out_stride, const float* in, int n,
+                       const float* w, int rows, int cols) {
+  for (int t = 0; t < n; ++t) {
+    GemvScalar(out + static_cast<size_t>(t) * out_stride,
+               in + static_cast<size_t>(t) * cols, w, rows, cols);
+  }
+}
+
+static void GemvTScalar(float* out, const float* in, const float* w, int rows,
+                        int cols) {
+  std::fill(out, out + cols, 0.0f);
+  for (int i = 0; i < rows; ++i) {
+    const float* w_row = w + static_cast<size_t>(i) * cols;
+    for (int j = 0; j < cols; ++j) {
+      out[j] += in[i] * w_row[j];
+    }
+  }
+}
+
+static void GemvS8Scalar(float* out, const float* in, const int8_t* w,
+                         int rows, int cols) {
+  for (int i = 0; i < rows; ++i) {
+    const int8_t* w_row = w + static_cast<size_t>(i) * cols;
+    float sum = 0;
+    for (int j = 0; j < cols; ++j) {
+      sum += w_row[j] * in[j];
+    }
+    out[i] = sum;
+  }
+}
+
+static void GemvTS8Scalar(float* out, const float* in, const int8_t* w,
+                          int rows, int cols) {
+  std::fill(out, out + cols, 0.0f);
+  for (int i = 0; i < rows; ++i) {
+    const int8_t* w_row = w + static_cast<size_t>(i) * cols;
+    for (int j = 0; j < cols; ++j) {
+      out[j] += in[i] * w_row[j];
+    }
+  }
+}
+
+static void GemvQ8Scalar(float* out, const int8_t* x, const float* x_scales,
+                         const int8_t* w, const float* w_scales, int rows,
+                         int groups) {
+  for (int i = 0; i < rows; ++i) {
+    const int8_t* w_row = w + static_cast<size_t>(i) * groups * kQuantGroup;
+    const float* s_row = w_scales + static_cast<size_t>(i) * groups;
+    float sum = 0;
+    for (int g = 0; g < groups; ++g) {
+      int32_t dot = 0;
+      for (int j = g * kQuantGroup; j < (g + 1) * kQuantGroup; ++j) {
+        dot += w_row[j] * x[j];
+      }
+      sum += dot * (s_row[g] * x_scales[g]);
+    }
+    out[i] = sum;
+  }
+}
+
+// Same as GemvScalar with each weight converted by ToFloat.
+template <float (*ToFloat)(uint16_t)>
+static void GemvHalfScalar(float* out, const float* in, const uint16_t* w,
+                           int rows, int cols) {
+  for (int i = 0; i < rows; ++i) {
+    const uint16_t* w_row = w + static_cast<size_t>(i) * cols;
+    float sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+    int j = 0;
+    for (; j + 4 <= cols; j += 4) {
+      sum0 += ToFloat(w_row[j + 0]) * in[j + 0];
+      sum1 += ToFloat(w_row[j + 1]) * in[j + 1];
+      sum2 += ToFloat(w_row[j + 2]) * in[j + 2];
+      sum3 += ToFloat(w_row[j + 3]) * in[j + 3];
+    }
+    for (; j < cols; ++j) {
+      sum0 += ToFloat(w_row[j]) * in[j];
+    }
+    out[i] = (sum0 + sum1) + (sum2 + sum3);
+  }
+}
+
+static void GemvQ4Scalar(float* out, const int8_t* x, const float* x_scales,
+                         const uint8_t* w, const uint16_t* w_scales, int rows,
+                         int groups) {
+  for (int i = 0; i < rows; ++i) {
+    const uint8_t* w_row = w + static_cast<size_t>(i) * groups * kQ4GroupBytes;
+    const uint16_t* s_row = w_scales + static_cast<size_t>(i) * groups;
+    float sum = 0;
+    for (int g = 0; g < groups; ++g) {
+      const uint8_t* packed = w_row + g * kQ4GroupBytes;
+      const int8_t* x_group = x + g * kQuantGroup;
+      int32_t dot = 0;
+      for (int j = 0; j < kQ4GroupBytes; ++j) {
+        dot += kQ4Values[packed[j] & 0xf] * x_group[j];
+        dot += kQ4Values[packed[j] >> 4] * x_group[j + kQ4GroupBytes];
+      }
+      sum += dot * (HalfToFloat(s_row[g]) * x_scales[g]);
+    }
+    out[i] = sum;
+  }
+}
+
+#ifdef SWAN_CPU_X86
+
+/* ---------------------------------  /
+              AVX2 Kernels
+/  --------------------------------- */
+
+static bool SupportsAVX2() {
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+         __builtin_cpu_supports("f16c");
+}
+
+__attribute__((target("avx2,fma"))) static inline float
+HorizontalSumAVX2(__m256 v) {
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v),
+                          _mm256_extractf128_ps(v, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+  return _mm_cvtss_f32(sum);
+}
+
+// Dot product of one row, two accumulators deep.
+__attribute__((target("avx2,fma"))) static inline float
+DotAVX2(const float* w_row, const float* in, int cols) {
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  int j = 0;
+  for (; j + 16 <= cols; j += 16) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(w_row + j),
+                           _mm256_loadu_ps(in + j), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(w_row + j + 8),
+                           _mm256_loadu_ps(in + j + 8), acc1);
+  }
+  for (; j + 8 <= cols; j += 8) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(w_row + j),
+                           _mm256_loadu_ps(in + j), acc0);
+  }
+  float sum = HorizontalSumAVX2(_mm256_add_ps(acc0, acc1));
+  for (; j < cols; ++j) {
+    sum += w_row[j] * in[j];
+  }
+  return sum;
+}
+
+// Four rows are processed together so each load of the input vector feeds
+// four FMAs; with two column lanes that gives eight independent
+// accumulators, enough to cover the FMA latency.
+__attribute__((target("avx2,fma"))) static void
+GemvAVX2(float* out, const float* in, const float* w, int rows, int cols) {
+  int i = 0;
+  for (; i + 4 <= rows; i += 4) {
+    const float* w0 = w + static_cast<size_t>(i) * cols;
+    const float* w1 = w0 + cols;
+    const float* w2 = w1 + cols;
+    const float* w3 = w2 + cols;
+    __m256 acc00 = _mm256_setzero_ps(), acc01 = _mm256_setzero_ps();
+    __m256 acc10 = _mm256_setzero_ps(), acc11 = _mm256_setzero_ps();
+    __m256 acc20 = _mm256_setzero_ps(), acc21 = _mm256_setzero_ps();
+    __m256 acc30 = _mm256_setzero_ps(), acc31 = _mm256_setzero_ps();
+    int j = 0;
+    for (; j + 16 <= cols; j += 16) {
+      __m256 x0 = _mm256_loadu_ps(in + j);
+      __m256 x1 = _mm256_loadu_ps(in + j + 8);
+      acc00 = _mm256_fmadd_ps(_mm256_loadu_ps(w0 + j), x0, acc00);
+      acc01 = _mm256_fmadd_ps(_mm256_loadu_ps(w0 + j + 8), x1, acc01);
+      acc10 = _mm256_fmadd_ps(_mm256_loadu_ps(w1 + j), x0, acc10);
+      acc11 = _mm256_fmadd_ps(_mm256_loadu_ps(w1 + j + 8), x1, acc11);
+      acc20 = _mm256_fmadd_ps(_mm256_loadu_ps(w2 + j), x0, acc20);
+      acc21 = _mm256_fmadd_ps(_mm256_loadu_ps(w2 + j + 8), x1, acc21);
+      acc30 = _mm256_fmadd_ps(_mm256_loadu_ps(w3 + j), x0, acc30);
+      acc31 = _mm256_fmadd_ps(_mm256_loadu_ps(w3 + j + 8), x1, acc31);
+    }
+    for (; j + 8 <= cols; j += 8) {
+      __m256 x0 = _mm256_loadu_ps(in + j);
+      acc00 = _mm256_fmadd_ps(_mm256_loadu_ps(w0 + j), x0, acc00);
+      acc10 = _mm256_fmadd_ps(_mm256_loadu_ps(w1 + j), x0, acc10);
+      acc20 = _mm256_fmadd_ps(_mm256_loadu_ps(w2 + j), x0, acc20);
+      acc30 = _mm256_fmadd_ps(_mm256_loadu_ps(w3 + j), x0, acc30);
+    }
+    float sum0 = HorizontalSumAVX2(_mm256_add_ps(acc00, acc01));
+    float sum1 = HorizontalSumAVX2(_mm256_add_ps(acc10, acc11));
+    float sum2 = HorizontalSumAVX2(_mm256_add_ps(acc20, acc21));
+    float sum3 = HorizontalSumAVX2(_mm256_add_ps(acc30, acc31));
+    for (; j < cols; ++j) {
+      sum0 += w0[j] * in[j];
+      sum1 += w1[j] * in[j];
+      sum2 += w2[j] * in[j];
+      sum3 += w3[j] * in[j];
+    }
+    out[i + 0] = sum0;
+    out[i + 1] = sum1;
+    out[i + 2] = sum2;
+    out[i + 3] = sum3;
+  }
+  for (; i < rows; ++i) {
+    out[i] = DotAVX2(w + static_cast<size_t>(i) * cols, in, cols);
+  }
+}
+
+// Four rows against two inputs: each weight load feeds two FMAs and each
+// input load four, in eight accumulators. Leftover rows and inputs go
+// through GemvAVX2.
+__attribute__((target("avx2,fma"))) static void
+GemmAVX2(float* out, int out_stride, const float* in, int n, const float* w,
+         int rows, int cols) {
+  const int rows4 = rows & ~3;
+  int t = 0;
+  for (; t + 2 <= n; t += 2) {
+    const float* x0 = in + static_cast<size_t>(t) * cols;
+    const float* x1 = x0 + cols;
+    float* out0 = out + static_cast<size_t>(t) * out_stride;
+    float* out1 = out0 + out_stride;
+    for (int i = 0; i < rows4; i += 4) {
+      const float* w0 = w + static_cast<size_t>(i) * cols;
+      const float* w1 = w0 + cols;
+      const float* w2 = w1 + cols;
+      const float* w3 = w2 + cols;
+      __m256 acc00 = _mm256_setzero_ps(), acc01 = _mm256_setzero_ps();
+      __m256 acc10 = _mm256_setzero_ps(), acc11 = _mm256_setzero_ps();
+      __m256 acc20 = _mm256_setzero_ps(), acc21 = _mm256_setzero_ps();
+      __m256 acc30 = _mm256_setzero_ps(), acc31 = _mm256_setzero_ps();
+      int j = 0;
+      for (; j + 8 <= cols; j += 8) {
+        __m256 a0 = _mm256_loadu_ps(x0 + j);
+        __m256 a1 = _mm256_loadu_ps(x1 + j);
+        __m256 b = _mm256_loadu_ps(w0 + j);
+        acc00 = _mm256_fmadd_ps(b, a0, acc00);
+        acc01 = _mm256_fmadd_ps(b, a1, acc01);
+        b = _mm256_loadu_ps(w1 + j);
+        acc10 = _mm256_fmadd_ps(b, a0, acc10);
+        acc11 = _mm256_fmadd_ps(b, a1, acc11);
+        b = _mm256_loadu_ps(w2 + j);
+        acc20 = _mm256_fmadd_ps(b, a0, acc20);
+        acc21 = _mm256_fmadd_ps(b, a1, acc21);
+        b = _mm256_loadu_ps(w3 + j);
+        acc30 = _mm256_fmadd_ps(b, a0, acc30);
+        acc31 = _mm256_fmadd_ps(b, a1, acc31);
+      }
+      float sum00 = HorizontalSumAVX2(acc00), sum01 = HorizontalSumAVX2(acc01);
+      float sum10 = HorizontalSumAVX2(acc10), sum11 = HorizontalSumAVX2(acc11);
+      float sum20 = HorizontalSumAVX2(acc20), sum21 = HorizontalSumAVX2(acc21);
+      float sum30 = HorizontalSumAVX2(acc30), sum31 = HorizontalSumAVX2(acc31);
+      for (; j < cols; ++j) {
+        sum00 += w0[j] * x0[j];
+        sum01 += w0[j] * x1[j];
+        sum10 += w1[j] * x0[j];
+        sum11 += w1[j] * x1[j];
+        sum20 += w2[j] * x0[j];
+        sum21 += w2[j] * x1[j];
+        sum30 += w3[j] * x0[j];
+        sum31 += w3[j] * x1[j];
+      }
+      out0[i + 0] = sum00;
+      out0[i + 1] = sum10;
+      out0[i + 2] = sum20;
+      out0[i + 3] = sum30;
+      out1[i + 0] = sum01;
+      out1[i + 1] = sum11;
+      out1[i + 2] = sum21;
+      out1[i + 3] = sum31;
+    }
+    if (rows4 < rows) {
+      const float* w_tail = w + static_cast<size_t>(rows4) * cols;
+      GemvAVX2(out0 + rows4, x0, w_tail, rows - rows4, cols);
+      GemvAVX2(out1 + rows4, x1, w_tail, rows - rows4, cols);
+    }
+  }
+  for (; t < n; ++t) {
+    GemvAVX2(out + static_cast<size_t>(t) * out_stride,
+             in + static_cast<size_t>(t) * cols, w, rows, cols);
+  }
+}
+
+// The output is built 32 columns at a time in registers while streaming
+// down the rows, so each column block is written once.
+__attribute__((target("avx2,fma"))) static void
+GemvTAVX2(float* out, const float* in, const float* w, int rows, int cols) {
+  int j = 0;
+  for (; j + 32 <= cols; j += 32) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+    for (int i = 0; i < rows; ++i) {
+      const float* w_row = w + static_cast<size_t>(i) * cols + j;
+      __m256 x = _mm256_set1_ps(in[i]);
+      acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(w_row), x, acc0);
+      acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(w_row + 8), x, acc1);
+      acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(w_row + 16), x, acc2);
+      acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(w_row + 24), x, acc3);
+    }
+    _mm256_storeu_ps(out + j, acc0);
+    _mm256_storeu_ps(out + j + 8, acc1);
+    _mm256_storeu_ps(out + j + 16, acc2);
+    _mm256_storeu_ps(out + j + 24, acc3);
+  }
+  for (; j + 8 <= cols; j += 8) {
+    __m256 acc = _mm256_setzero_ps();
+    for (int i = 0; i < rows; ++i) {
+      const float* w_row = w + static_cast<size_t>(i) * cols + j;
+      acc = _mm256_fmadd_ps(_mm256_loadu_ps(w_row), _mm256_set1_ps(in[i]),
+                            acc);
+    }
+    _mm256_storeu_ps(out + j, acc);
+  }
+  for (; j < cols; ++j) {
+    float sum = 0;
+    for (int i = 0; i < rows; ++i) {
+      sum += in[i] * w[static_cast<size_t>(i) * cols + j];
+    }
+    out[j] = sum;
+  }
+}
+
+// Widen eight int8 values to fp32.
+__attribute__((target("avx2,fma"))) static inline __m256
+LoadS8AVX2(const int8_t* p) {
+  __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+  return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(bytes));
+}
+
+__attribute__((target("avx2,fma"))) static void
+GemvS8AVX2(float* out, const float* in, const int8_t* w, int rows, int cols) {
+  for (int i = 0; i < rows; ++i) {
+    const int8_t* w_row = w + static_cast<size_t>(i) * cols;
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int j = 0;
+    for (; j + 16 <= cols; j += 16) {
+      acc0 = _mm256_fmadd_ps(LoadS8AVX2(w_row + j), _mm256_loadu_ps(in + j),
+                             acc0);
+      acc1 = _mm256_fmadd_ps(LoadS8AVX2(w_row + j + 8),
+                             _mm256_loadu_ps(in + j + 8), acc1);
+    }
+    for (; j + 8 <= cols; j += 8) {
+      acc0 = _mm256_fmadd_ps(LoadS8AVX2(w_row + j), _mm256_loadu_ps(in + j),
+                             acc0);
+    }
+    float sum = HorizontalSumAVX2(_mm256_add_ps(acc0, acc1));
+    for (; j < cols; ++j) {
+      sum += w_row[j] * in[j];
+    }
+    out[i] = sum;
+  }
+}
+
+// Same blocking as GemvTAVX2.
+__attribute__((target("avx2,fma"))) static void
+GemvTS8AVX2(float* out, const float* in, const int8_t* w, int rows,
+            int cols) {
+  int j = 0;
+  for (; j + 32 <= cols; j += 32) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+    for (int i = 0; i < rows; ++i) {
+      const int8_t* w_row = w + static_cast<size_t>(i) * cols + j;
+      __m256 x = _mm256_set1_ps(in[i]);
+      acc0 = _mm256_fmadd_ps(LoadS8AVX2(w_row), x, acc0);
+      acc1 = _mm256_fmadd_ps(LoadS8AVX2(w_row + 8), x, acc1);
+      acc2 = _mm256_fmadd_ps(LoadS8AVX2(w_row + 16), x, acc2);
+      acc3 = _mm256_fmadd_ps(LoadS8AVX2(w_row + 24), x, acc3);
+    }
+    _mm256_storeu_ps(out + j, acc0);
+    _mm256_storeu_ps(out + j + 8, acc1);
+    _mm256_storeu_ps(out + j + 16, acc2);
+    _mm256_storeu_ps(out + j + 24, acc3);
+  }
+  for (; j + 8 <= cols; j += 8) {
+    __m256 acc = _mm256_setzero_ps();
+    for (int i = 0; i < rows; ++i) {
+      const int8_t* w_row = w + static_cast<size_t>(i) * cols + j;
+      acc = _mm256_fmadd_ps(LoadS8AVX2(w_row), _mm256_set1_ps(in[i]), acc);
+    }
+    _mm256_storeu_ps(out + j, acc);
+  }
+  for (; j < cols; ++j) {
+    float sum = 0;
+    for (int i = 0; i < rows; ++i) {
+      sum += in[i] * w[static_cast<size_t>(i) * cols + j];
+    }
+    out[j] = sum;
+  }
+}
+
+// Signed int8 dot product of 32 lanes as eight int32 partial sums.
+// maddubs takes one unsigned operand, so the sign of x is moved onto w;
+// the quantizers never emit -128, so the int16 pair sums cannot saturate.
+__attribute__((target("avx2,fma"))) static inline __m256i
+DotQ8AVX2(__m256i x_abs, __m256i x, __m256i w) {
+  __m256i pairs = _mm256_maddubs_epi16(x_abs, _mm256_sign_epi8(w, x));
+  return _mm256_madd_epi16(pairs, _mm256_set1_epi16(1));
+}
+
+// Four rows at a time share the load and absolute value of each input
+// group; every group adds its int32 sums, scaled, into a float accumulator.
+__attribute__((target("avx2,fma"))) static void
+GemvQ8AVX2(float* out, const int8_t* x, const float* x_scales,
+           const int8_t* w, const float* w_scales, int rows, int groups) {
+  const size_t stride = static_cast<size_t>(groups) * kQuantGroup;
+  for (int i = 0; i < rows; i += 4) {
+    const int n = std::min(4, rows - i);
+    __m256 acc[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(),
+                     _mm256_setzero_ps(), _mm256_setzero_ps()};
+    for (int g = 0; g < groups; ++g) {
+      const int j = g * kQuantGroup;
+      __m256i xv = _mm256_loadu_si256((const __m256i*)(x + j));
+      __m256i xa = _mm256_sign_epi8(xv, xv);
+      __m256 xs = _mm256_set1_ps(x_scales[g]);
+      for (int r = 0; r < n; ++r) {
+        const int8_t* w_row = w + (i + r) * stride;
+        const float* s_row = w_scales + static_cast<size_t>(i + r) * groups;
+        __m256i wv = _mm256_loadu_si256((const __m256i*)(w_row + j));
+        __m256 scale = _mm256_mul_ps(_mm256_set1_ps(s_row[g]), xs);
+        acc[r] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(DotQ8AVX2(xa, xv, wv)),
+                                 scale, acc[r]);
+      }
+    }
+    for (int r = 0; r < n; ++r) {
+      out[i + r] = HorizontalSumAVX2(acc[r]);
+    }
+  }
+}
+
+// Expand one packed group into 32 int8 weights in column order, looking
+// each 4-bit code up in kQ4Values with a byte shuffle.
+__attribute__((target("avx2,fma"))) static inline __m256i
+UnpackQ4AVX2(const uint8_t* packed) {
+  const __m256i lut = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(kQ4Values)));
+  __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(packed));
+  __m256i codes = _mm256_set_m128i(_mm_srli_epi16(bytes, 4), bytes);
+  codes = _mm256_and_si256(codes, _mm256_set1_epi8(0x0f));
+  return _mm256_shuffle_epi8(lut, codes);
+}
+
+// Same blocking as GemvQ8AVX2; each group is dequantized to int8 in
+// registers and multiplied with the int8 input.
+__attribute__((target("avx2,fma,f16c"))) static void
+GemvQ4AVX2(float* out, const int8_t* x, const float* x_scales,
+           const uint8_t* w, const uint16_t* w_scales, int rows, int groups) {
+  const size_t stride = static_cast<size_t>(groups) * kQ4GroupBytes;
+  for (int i = 0; i < rows; i += 4) {
+    const int n = std::min(4, rows - i);
+    __m256 acc[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(),
+                     _mm256_setzero_ps(), _mm256_setzero_ps()};
+    for (int g = 0; g < groups; ++g) {
+      __m256i xv = _mm256_loadu_si256((const __m256i*)(x + g * kQuantGroup));
+      __m256i xa = _mm256_sign_epi8(xv, xv);
+      __m256 xs = _mm256_set1_ps(x_scales[g]);
+      for (int r = 0; r < n; ++r) {
+        const uint8_t* w_row = w + (i + r) * stride;
+        const uint16_t* s_row = w_scales + static_cast<size_t>(i + r) * groups;
+        __m256i wv = UnpackQ4AVX2(w_row + g * kQ4GroupBytes);
+        __m256 scale = _mm256_mul_ps(_mm256_set1_ps(_cvtsh_ss(s_row[g])), xs);
+        acc[r] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(DotQ8AVX2(xa, xv, wv)),
+                                 scale, acc[r]);
+      }
+    }
+    for (int r = 0; r < n; ++r) {
+      out[i + r] = HorizontalSumAVX2(acc[r]);
+    }
+  }
+}
+
+// Widen eight fp16 or bf16 weights to fp32.
+template <bool kBF16>
+__attribute__((target("avx2,fma,f16c"))) static inline __m256
+LoadHalfAVX2(const uint16_t* p) {
+  __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  if (kBF16) {
+    return _mm256_castsi256_ps(
+        _mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16));
+  }
+  return _mm256_cvtph_ps(h);
+}
+
+// Four rows at a time like GemvAVX2. The weights are widened right after
+// the load, so only half the bytes cross the memory bus.
+template <bool kBF16>
+__attribute__((target("avx2,fma,f16c"))) static void
+GemvHalfAVX2(float* out, const float* in, const uint16_t* w, int rows,
+             int cols) {
+  float (*to_float)(uint16_t) = kBF16 ? BF16ToFloat : HalfToFloat;
+  for (int i = 0; i < rows; i += 4) {
+    const int n = std::min(4, rows - i);
+    __m256 acc[4][2] = {};
+    int j = 0;
+    for (; j + 16 <= cols; j += 16) {
+      __m256 x0 = _mm256_loadu_ps(in + j);
+      __m256 x1 = _mm256_loadu_ps(in + j + 8);
+      for (int r = 0; r < n; ++r) {
+        const uint16_t* w_row = w + static_cast<size_t>(i + r) * cols;
+        acc[r][0] = _mm256_fmadd_ps(LoadHalfAVX2<kBF16>(w_row + j), x0,
+                                    acc[r][0]);
+        acc[r][1] = _mm256_fmadd_ps(LoadHalfAVX2<kBF16>(w_row + j + 8), x1,
+                                    acc[r][1]);
+      }
+    }
+    for (; j + 8 <= cols; j += 8) {
+      __m256 x0 = _mm256_loadu_ps(in + j);
+      for (int r = 0; r < n; ++r) {
+        const uint16_t* w_row = w + static_cast<size_t>(i + r) * cols;
+        acc[r][0] = _mm256_fmadd_ps(LoadHalfAVX2<kBF16>(w_row + j), x0,
+                                    acc[r][0]);
+      }
+    }
+    for (int r = 0; r < n; ++r) {
+      const uint16_t* w_row = w + static_cast<size_t>(i + r) * cols;
+      float sum = HorizontalSumAVX2(_mm256_add_ps(acc[r][0], acc[r][1]));
+      for (int k = j; k < cols; ++k) {
+        sum += to_float(w_row[k]) * in[k];
+      }
+      out[i + r] = sum;
+    }
+  }
+}
+
+/* ---------------------------------  /
+             AVX-512 Kernels
+/  --------------------------------- */
+
+// GCC 12 reports the undefined upper lanes its own AVX-512 intrinsics
+// start from (_mm512_reduce_add_ps, ...) as maybe uninitialized once they
+// are inlined here.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// The avx512 kernel set also uses the AVX2 int8 kernel.
+static bool SupportsAVX512() {
+  return __builtin_cpu_supports("avx512f") && SupportsAVX2();
+}
+
+// Mask selecting the first n (< 16) lanes.
+static inline __mmask16 TailMask(int n) {
+  return static_cast<__mmask16>((1u << n) - 1);
+}
+
+// Same blocking as the AVX2 kernel with 16-wide lanes; the column tail is
+// handled with masked loads instead of a scalar loop.
+__attribute__((target("avx512f"))) static void
+GemvAVX512(float* out, const float* in, const float* w, int rows, int cols) {
+  const int cols16 = cols & ~15;
+  const __mmask16 tail = TailMask(cols - cols16);
+  int i = 0;
+  for (; i + 4 <= rows; i += 4) {
+    const float* w0 = w + static_cast<size_t>(i) * cols;
+    const float* w1 = w0 + cols;
+    const float* w2 = w1 + cols;
+    const float* w3 = w2 + cols;
+    __m512 acc00 = _mm512_setzero_ps(), acc01 = _mm512_setzero_ps();
+    __m512 acc10 = _mm512_setzero_ps(), acc11 = _mm512_setzero_ps();
+    __m512 acc20 = _mm512_setzero_ps(), acc21 = _mm512_setzero_ps();
+    __m512 acc30 = _mm512_setzero_ps(), acc31 = _mm512_setzero_ps();
+    int j = 0;
+    for (; j + 32 <= cols; j += 32) {
+      __m512 x0 = _mm512_loadu_ps(in + j);
+      __m512 x1 = _mm512_loadu_ps(in + j + 16);
+      acc00 = _mm512_fmadd_ps(_mm512_loadu_ps(w0 + j), x0, acc00);
+      acc01 = _mm512_fmadd_ps(_mm512_loadu_ps(w0 + j + 16), x1, acc01);
+      acc10 = _mm512_fmadd_ps(_mm512_loadu_ps(w1 + j), x0, acc10);
+      acc11 = _mm512_fmadd_ps(_mm512_loadu_ps(w1 + j + 16), x1, acc11);
+      acc20 = _mm512_fmadd_ps(_mm512_loadu_ps(w2 + j), x0, acc20);
+      acc21 = _mm512_fmadd_ps(_mm512_loadu_ps(w2 + j + 16), x1, acc21);
+      acc30 = _mm512_fmadd_ps(_mm512_loadu_ps(w3 + j), x0, acc30);
+      acc31 = _mm512_fmadd_ps(_mm512_loadu_ps(w3 + j + 16), x1, acc31);
+    }
+    for (; j < cols16; j += 16) {
+      __m512 x0 = _mm512_loadu_ps(in + j);
+      acc00 = _mm512_fmadd_ps(_mm512_loadu_ps(w0 + j), x0, acc00);
+      acc10 = _mm512_fmadd_ps(_mm512_loadu_ps(w1 + j), x0, acc10);
+      acc20 = _mm512_fmadd_ps(_mm512_loadu_ps(w2 + j), x0, acc20);
+      acc30 = _mm512_fmadd_ps(_mm512_loadu_ps(w3 + j), x0, acc30);
+    }
+    if (tail) {
+      __m512 x0 = _mm512_maskz_loadu_ps(tail, in + j);
+      acc01 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, w0 + j), x0, acc01);
+      acc11 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, w1 + j), x0, acc11);
+      acc21 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, w2 + j), x0, acc21);
+      acc31 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, w3 + j), x0, acc31);
+    }
+    out[i + 0] = _mm512_reduce_add_ps(_mm512_add_ps(acc00, acc01));
+    out[i + 1] = _mm512_reduce_add_ps(_mm512_add_ps(acc10, acc11));
+    out[i + 2] = _mm512_reduce_add_ps(_mm512_add_ps(acc20, acc21));
+    out[i + 3] = _mm512_reduce_add_ps(_mm512_add_ps(acc30, acc31));
+  }
+  for (; i < rows; ++i) {
+    const float* w0 = w + static_cast<size_t>(i) * cols;
+    __m512 acc = _mm512_setzero_ps();
+    int j = 0;
+    for (; j < cols16; j += 16) {
+      acc = _mm512_fmadd_ps(_mm512_loadu_ps(w0 + j), _mm512_loadu_ps(in + j),
+                            acc);
+    }
+    if (tail) {
+      acc = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, w0 + j),
+                            _mm512_maskz_loadu_ps(tail, in + j), acc);
+    }
+    out[i] = _mm512_reduce_add_ps(acc);
+  }
+}
+
+// Four rows against four inputs in sixteen accumulators, so every load
+// feeds four FMAs. The column tail is masked as in GemvAVX512; leftover
+// rows and inputs go through it as well.
+__attribute__((target("avx512f"))) static void
+GemmAVX512(float* out, int out_stride, const float* in, int n, const float* w,
+           int rows, int cols) {
+  const int cols16 = cols & ~15;
+  const __mmask16 tail = TailMask(cols - cols16);
+  const int rows4 = rows & ~3;
+  int t = 0;
+  for (; t + 4 <= n; t += 4) {
+    const float* x0 = in + static_cast<size_t>(t) * cols;
+    const float* x1 = x0 + cols;
+    const float* x2 = x1 + cols;
+    const float* x3 = x2 + cols;
+    float* out0 = out + static_cast<size_t>(t) * out_stride;
+    float* out1 = out0 + out_stride;
+    float* out2 = out1 + out_stride;
+    float* out3 = out2 + out_stride;
+    for (int i = 0; i < rows4; i += 4) {
+      const float* w0 = w + static_cast<size_t>(i) * cols;
+      const float* w1 = w0 + cols;
+      const float* w2 = w1 + cols;
+      const float* w3 = w2 + cols;
+      __m512 acc00 = _mm512_setzero_ps(), acc01 = _mm512_setzero_ps();
+      __m512 acc02 = _mm512_setzero_ps(), acc03 = _mm512_setzero_ps();
+      __m512 acc10 = _mm512_setzero_ps(), acc11 = _mm512_setzero_ps();
+      __m512 acc12 = _mm512_setzero_ps(), acc13 = _mm512_setzero_ps();
+      __m512 acc20 = _mm512_setzero_ps(), acc21 = _mm512_setzero_ps();
+      __m512 acc22 = _mm512_setzero_ps(), acc23 = _mm512_setzero_ps();
+      __m512 acc30 = _mm512_setzero_ps(), acc31 = _mm512_setzero_ps();
+      __m512 acc32 = _mm512_setzero_ps(), acc33 = _mm512_setzero_ps();
+      for (int j = 0; j < cols; j += 16) {
+        const __mmask16 m = j < cols16 ? static_cast<__mmask16>(0xFFFF) : tail;
+        __m512 a0 = _mm512_maskz_loadu_ps(m, x0 + j);
+        __m512 a1 = _mm512_maskz_loadu_ps(m, x1 + j);
+        __m512 a2 = _mm512_maskz_loadu_ps(m, x2 + j);
+        __m512 a3 = _mm512_maskz_loadu_ps(m, x3 + j);
+        __m512 b = _mm512_maskz_loadu_ps(m, w0 + j);
+        acc00 = _mm512_fmadd_ps(b, a0, acc00);
+        acc01 = _mm512_fmadd_ps(b, a1, acc01);
+        acc02 = _mm512_fmadd_ps(b, a2, acc02);
+        acc03 = _mm512_fmadd_ps(b, a3, acc03);
+        b = _mm512_maskz_loadu_ps(m, w1 + j);
+        acc10 = _mm512_fmadd_ps(b, a0, acc10);
+        acc11 = _mm512_fmadd_ps(b, a1, acc11);
+        acc12 = _mm512_fmadd_ps(b, a2, acc12);
+        acc13 = _mm512_fmadd_ps(b, a3, acc13);
+        b = _mm512_maskz_loadu_ps(m, w2 + j);
+        acc20 = _mm512_fmadd_ps(b, a0, acc20);
+        acc21 = _mm512_fmadd_ps(b, a1, acc21);
+        acc22 = _mm512_fmadd_ps(b, a2, acc22);
+        acc23 = _mm512_fmadd_ps(b, a3, acc23);
+        b = _mm512_maskz_loadu_ps(m, w3 + j);
+        acc30 = _mm512_fmadd_ps(b, a0, acc30);
+        acc31 = _mm512_fmadd_ps(b, a1, acc31);
+        acc32 = _mm512_fmadd_ps(b, a2, acc32);
+        acc33 = _mm512_fmadd_ps(b, a3, acc33);
+      }
+      out0[i + 0] = _mm512_reduce_add_ps(acc00);
+      out0[i + 1] = _mm512_reduce_add_ps(acc10);
+      out0[i + 2] = _mm512_reduce_add_ps(acc20);
+      out0[i + 3] = _mm512_reduce_add_ps(acc30);
+      out1[i + 0] = _mm512_reduce_add_ps(acc01);
+      out1[i + 1] = _mm512_reduce_add_ps(acc11);
+      out1[i + 2] = _mm512_reduce_add_ps(acc21);
+      out1[i + 3] = _mm512_reduce_add_ps(acc31);
+      out2[i + 0] = _mm512_reduce_add_ps(acc02);
+      out2[i + 1] = _mm512_reduce_add_ps(acc12);
+      out2[i + 2] = _mm512_reduce_add_ps(acc22);
+      out2[i + 3] = _mm512_reduce_add_ps(acc32);
+      out3[i + 0] = _mm512_reduce_add_ps(acc03);
+      out3[i + 1] = _mm512_reduce_add_ps(acc13);
+      out3[i + 2] = _mm512_reduce_add_ps(acc23);
+      out3[i + 3] = _mm512_reduce_add_ps(acc33);
+    }
+    if (rows4 < rows) {
+      const float* w_tail = w + static_cast<size_t>(rows4) * cols;
+      GemvAVX512(out0 + rows4, x0, w_tail, rows - rows4, cols);
+      GemvAVX512(out1 + rows4, x1, w_tail, rows - rows4, cols);
+      GemvAVX512(out2 + rows4, x2, w_tail, rows - rows4, cols);
+      GemvAVX512(out3 + rows4, x3, w_tail, rows - rows4, cols);
+    }
+  }
+  for (; t < n; ++t) {
+    GemvAVX512(out + static_cast<size_t>(t) * out_stride,
+               in + static_cast<size_t>(t) * cols, w, rows, cols);
+  }
+}
+
+// Widen sixteen fp16 or bf16 weights to fp32.
+template <bool kBF16>
+__attribute__((target("avx512f"))) static inline __m512
+LoadHalfAVX512(const uint16_t* p) {
+  __m256i h = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+  if (kBF16) {
+    return _mm512_castsi512_ps(
+        _mm512_slli_epi32(_mm512_cvtepu16_epi32(h), 16));
+  }
+  return _mm512_cvtph_ps(h);
+}
+
+// Same as GemvHalfAVX2 with 16-wide lanes.
+template <bool kBF16>
+__attribute__((target("avx512f"))) static void
+GemvHalfAVX512(float* out, const float* in, const uint16_t* w, int rows,
+               int cols) {
+  float (*to_float)(uint16_t) = kBF16 ? BF16ToFloat : HalfToFloat;
+  for (int i = 0; i < rows; i += 4) {
+    const int n = std::min(4, rows - i);
+    __m512 acc[4][2] = {};
+    int j = 0;
+    for (; j + 32 <= cols; j += 32) {
+      __m512 x0 = _mm512_loadu_ps(in + j);
+      __m512 x1 = _mm512_loadu_ps(in + j + 16);
+      for (int r = 0; r < n; ++r) {
+        const uint16_t* w_row = w + static_cast<size_t>(i + r) * cols;
+        acc[r][0] = _mm512_fmadd_ps(LoadHalfAVX512<kBF16>(w_row + j), x0,
+                                    acc[r][0]);
+        acc[r][1] = _mm512_fmadd_ps(LoadHalfAVX512<kBF16>(w_row + j + 16),
+                                    x1, acc[r][1]);
+      }
+    }
+    for (; j + 16 <= cols; j += 16) {
+      __m512 x0 = _mm512_loadu_ps(in + j);
+      for (int r = 0; r < n; ++r) {
+        const uint16_t* w_row = w + static_cast<size_t>(i + r) * cols;
+        acc[r][0] = _mm512_fmadd_ps(LoadHalfAVX512<kBF16>(w_row + j), x0,
+                                    acc[r][0]);
+      }
+    }
+    for (int r = 0; r < n; ++r) {
+      const uint16_t* w_row = w + static_cast<size_t>(i + r) * cols;
+      float sum = _mm512_reduce_add_ps(_mm512_add_ps(acc[r][0], acc[r][1]));
+      for (int k = j; k < cols; ++k) {
+        sum += to_float(w_row[k]) * in[k];
+      }
+      out[i + r] = sum;
+    }
+  }
+}
+
+// Same as GemvTAVX2 with 16-wide lanes and a masked column tail.
+__attribute__((target("avx512f"))) static void
+GemvTAVX512(float* out, const float* in, const float* w, int rows, int cols) {
+  int j = 0;
+  for (; j + 64 <= cols; j += 64) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    __m512 acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+    for (int i = 0; i < rows; ++i) {
+      const float* w_row = w + static_cast<size_t>(i) * cols + j;
+      __m512 x = _mm512_set1_ps(in[i]);
+      acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(w_row), x, acc0);
+      acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(w_row + 16), x, acc1);
+      acc2 = _mm512_fmadd_ps(_mm512_loadu_ps(w_row + 32), x, acc2);
+      acc3 = _mm512_fmadd_ps(_mm512_loadu_ps(w_row + 48), x, acc3);
+    }
+    _mm512_storeu_ps(out + j, acc0);
+    _mm512_storeu_ps(out + j + 16, acc1);
+    _mm512_storeu_ps(out + j + 32, acc2);
+    _mm512_storeu_ps(out + j + 48, acc3);
+  }
+  for (; j < cols; j += 16) {
+    const __mmask16 mask = cols - j < 16 ? TailMask(cols - j) : 0xffff;
+    __m512 acc = _mm512_setzero_ps();
+    for (int i = 0; i < rows; ++i) {
+      const float* w_row = w + static_cast<size_t>(i) * cols + j;
+      acc = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, w_row),
+                            _mm512_set1_ps(in[i]), acc);
+    }
+    _mm512_mask_storeu_ps(out + j, mask, acc);
+  }
+}
+
+// Widen sixteen int8 values to fp32.
+__attribute__((target("avx512f"))) static inline __m512
+LoadS8AVX512(const int8_t* p) {
+  __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  return _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(bytes));
+}
+
+__attribute__((target("avx512f"))) static void
+GemvS8AVX512(float* out, const float* in, const int8_t* w, int rows,
+             int cols) {
+  for (int i = 0; i < rows; ++i) {
+    const int8_t* w_row = w + static_cast<size_t>(i) * cols;
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int j = 0;
+    for (; j + 32 <= cols; j += 32) {
+      acc0 = _mm512_fmadd_ps(LoadS8AVX512(w_row + j), _mm512_loadu_ps(in + j),
+                             acc0);
+      acc1 = _mm512_fmadd_ps(LoadS8AVX512(w_row + j + 16),
+                             _mm512_loadu_ps(in + j + 16), acc1);
+    }
+    for (; j + 16 <= cols; j += 16) {
+      acc0 = _mm512_fmadd_ps(LoadS8AVX512(w_row + j), _mm512_loadu_ps(in + j),
+                             acc0);
+    }
+    float sum = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+    for (; j < cols; ++j) {
+      sum += w_row[j] * in[j];
+    }
+    out[i] = sum;
+  }
+}
+
+// Same blocking as GemvTAVX512 with a scalar column tail.
+__attribute__((target("avx512f"))) static void
+GemvTS8AVX512(float* out, const float* in, const int8_t* w, int rows,
+              int cols) {
+  int j = 0;
+  for (; j + 64 <= cols; j += 64) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    __m512 acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+    for (int i = 0; i < rows; ++i) {
+      const int8_t* w_row = w + static_cast<size_t>(i) * cols + j;
+      __m512 x = _mm512_set1_ps(in[i]);
+      acc0 = _mm512_fmadd_ps(LoadS8AVX512(w_row), x, acc0);
+      acc1 = _mm512_fmadd_ps(LoadS8AVX512(w_row + 16), x, acc1);
+      acc2 = _mm512_fmadd_ps(LoadS8AVX512(w_row + 32), x, acc2);
+      acc3 = _mm512_fmadd_ps(LoadS8AVX512(w_row + 48), x, acc3);
+    }
+    _mm512_storeu_ps(out + j, acc0);
+    _mm512_storeu_ps(out + j + 16, acc1);
+    _mm512_storeu_ps(out + j + 32, acc2);
+    _mm512_storeu_ps(out + j + 48, acc3);
+  }
+  for (; j + 16 <= cols; j += 16) {
+    __m512 acc = _mm512_setzero_ps();
+    for (int i = 0; i < rows; ++i) {
+      const int8_t* w_row = w + static_cast<size_t>(i) * cols + j;
+      acc = _mm512_fmadd_ps(LoadS8AVX512(w_row), _mm512_set1_ps(in[i]), acc);
+    }
+    _mm512_storeu_ps(out + j, acc);
+  }
+  for (; j < cols; ++j) {
+    float sum = 0;
+    for (int i = 0; i < rows; ++i) {
+      sum += in[i] * w[static_cast<size_t>(i) * cols + j];
+    }
+    out[j] = sum;
+  }
+}
+
+static bool SupportsAVX512VNNI() {
+  return SupportsAVX512() && __builtin_cpu_supports("avx512bw") &&
+         __builtin_cpu_supports("avx512vl") &&
+         __builtin_cpu_supports("avx512vnni");
+}
+
+#define SWAN_TARGET_VNNI \
+  __attribute__((target("avx2,fma,avx512f,avx512bw,avx512vl,avx512vnni")))
+
+// Signed int8 dot product of 64 lanes (two groups) as sixteen int32 sums.
+// vpdpbusd takes one unsigned operand; the sign of x is moved onto w.
+SWAN_TARGET_VNNI static inline __m512i DotQ8VNNI(__m512i x_abs, __m512i x,
+                                                 __m512i w) {
+  __m512i zero = _mm512_setzero_si512();
+  __m512i w_signed = _mm512_mask_sub_epi8(w, _mm512_movepi8_mask(x), zero, w);
+  return _mm512_dpbusd_epi32(zero, x_abs, w_signed);
+}
+
+// Lanes 0-7 hold lo, lanes 8-15 hold hi.
+SWAN_TARGET_VNNI static inline __m512 PairScale(float lo, float hi) {
+  return _mm512_mask_blend_ps(0xff00, _mm512_set1_ps(lo), _mm512_set1_ps(hi));
+}
+
+// Two groups per 512-bit step, four rows at a time. An odd last group is
+// handled with the 256-bit form of vpdpbusd.
+SWAN_TARGET_VNNI static void
+GemvQ8AVX512VNNI(float* out, const int8_t* x, const float* x_scales,
+                 const int8_t* w, const float* w_scales, int rows,
+                 int groups) {
+  const size_t stride = static_cast<size_t>(groups) * kQuantGroup;
+  for (int i = 0; i < rows; i += 4) {
+    const int n = std::min(4, rows - i);
+    __m512 acc[4] = {_mm512_setzero_ps(), _mm512_setzero_ps(),
+                     _mm512_setzero_ps(), _mm512_setzero_ps()};
+    for (int g = 0; g + 2 <= groups; g += 2) {
+      const int j = g * kQuantGroup;
+      __m512i xv = _mm512_loadu_si512(x + j);
+      __m512i xa = _mm512_abs_epi8(xv);
+      __m512 xs = PairScale(x_scales[g], x_scales[g + 1]);
+      for (int r = 0; r < n; ++r) {
+        const int8_t* w_row = w + (i + r) * stride;
+        const float* s_row = w_scales + static_cast<size_t>(i + r) * groups;
+        __m512i dot = DotQ8VNNI(xa, xv, _mm512_loadu_si512(w_row + j));
+        __m512 scale = _mm512_mul_ps(PairScale(s_row[g], s_row[g + 1]), xs);
+        acc[r] = _mm512_fmadd_ps(_mm512_cvtepi32_ps(dot), scale, acc[r]);
+      }
+    }
+    for (int r = 0; r < n; ++r) {
+      float sum = _mm512_reduce_add_ps(acc[r]);
+      if (groups % 2 == 1) {
+        const int g = groups - 1;
+        const int j = g * kQuantGroup;
+        const float* s_row = w_scales + static_cast<size_t>(i + r) * groups;
+        __m256i xv = _mm256_loadu_si256((const __m256i*)(x + j));
+        __m256i wv =
+            _mm256_loadu_si256((const __m256i*)(w + (i + r) * stride + j));
+        __m256i dot = _mm256_dpbusd_epi32(_mm256_setzero_si256(),
+                                          _mm256_sign_epi8(xv, xv),
+                                          _mm256_sign_epi8(wv, xv));
+        sum += HorizontalSumAVX2(_mm256_cvtepi32_ps(dot)) *
+               (s_row[g] * x_scales[g]);
+      }
+      out[i + r] = sum;
+    }
+  }
+}
+
+#undef SWAN_TARGET_VNNI
+
+#pragma GCC diagnostic pop
+
+#endif // SWAN_CPU_X86
+
+#ifdef SWAN_CPU_NEON
+
+/* ---------------------------------  /
+              NEON Kernels
+/  --------------------------------- */
+
+// Advanced SIMD is mandatory on AArch64.
+static bool SupportsNEON() {
+  return true;
+}
+
+// Same blocking as the AVX2 kernel with 4-wide lanes.
+static void GemvNEON(float* out, const float* in, const float* w, int rows,
+                     int cols) {
+  int i = 0;
+  for (; i + 4 <= rows; i += 4) {
+    const float* w0 = w + static_cast<size_t>(i) * cols;
+    const float* w1 = w0 + cols;
+    const float* w2 = w1 + cols;
+    const float* w3 = w2 + cols;
+    float32x4_t acc00 = vdupq_n_f32(0), acc01 = vdupq_n_f32(0);
+    float32x4_t acc10 = vdupq_n_f32(0), acc11 = vdupq_n_f32(0);
+    float32x4_t acc20 = vdupq_n_f32(0), acc21 = vdupq_n_f32(0);
+    float32x4_t acc30 = vdupq_n_f32(0), acc31 = vdupq_n_f32(0);
+    int j = 0;
+    for (; j + 8 <= cols; j += 8) {
+      float32x4_t x0 = vld1q_f32(in + j);
+      float32x4_t x1 = vld1q_f32(in + j + 4);
+      acc00 = vfmaq_f32(acc00, vld1q_f32(w0 + j), x0);
+      acc01 = vfmaq_f32(acc01, vld1q_f32(w0 + j + 4), x1);
+      acc10 = vfmaq_f32(acc10, vld1q_f32(w1 + j), x0);
+      acc11 = vfmaq_f32(acc11, vld1q_f32(w1 + j + 4), x1);
+      acc20 = vfmaq_f32(acc20, vld1q_f32(w2 + j), x0);
+      acc21 = vfmaq_f32(acc21, vld1q_f32(w2 + j + 4), x1);
+      acc30 = vfmaq_f32(acc30, vld1q_f32(w3 + j), x0);
+      acc31 = vfmaq_f32(acc31, vld1q_f32(w3 + j + 4), x1);
+    }
+    float sum0 = vaddvq_f32(vaddq_f32(acc00, acc01));
+    float sum1 = vaddvq_f32(vaddq_f32(acc10, acc11));
+    float sum2 = vaddvq_f32(vaddq_f32(acc20, acc21));
+    float sum3 = vaddvq_f32(vaddq_f32(acc30, acc31));
+    for (; j < cols; ++j) {
+      sum0 += w0[j] * in[j];
+      sum1 += w1[j] * in[j];
+      sum2 += w2[j] * in[j];
+      sum3 += w3[j] * in[j];
+    }
+    out[i + 0] = sum0;
+    out[i + 1] = sum1;
+    out[i + 2] = sum2;
+    out[i + 3] = sum3;
+  }
+  for (; i < rows; ++i) {
+    const float* w0 = w + static_cast<size_t>(i) * cols;
+    float32x4_t acc0 = vdupq_n_f32(0), acc1 = vdupq_n_f32(0);
+    int j = 0;
+    for (; j + 8 <= cols; j += 8) {
+      acc0 = vfmaq_f32(acc0, vld1q_f32(w0 + j), vld1q_f32(in + j));
+      acc1 = vfmaq_f32(acc1, vld1q_f32(w0 + j + 4), vld1q_f32(in + j + 4));
+    }
+    float sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+    for (; j < cols; ++j) {
+      sum += w0[j] * in[j];
+    }
+    out[i] = sum;
+  }
+}
+
+// One input at a time; the blocking in Gemm keeps the rows in cache.
+static void GemmNEON(float* out, int out_stride, const float* in, int n,
+                     const float* w, int rows, int cols) {
+  for (int t = 0; t < n; ++t) {
+    GemvNEON(out + static_cast<size_t>(t) * out_stride,
+             in + static_cast<size_t>(t) * cols, w, rows, cols);
+  }
+}
+
+// Same as GemvTAVX2 with 4-wide lanes.
+static void GemvTNEON(float* out, const float* in, const float* w, int rows,
+                      int cols) {
+  int j = 0;
+  for (; j + 16 <= cols; j += 16) {
+    float32x4_t acc0 = vdupq_n_f32(0), acc1 = vdupq_n_f32(0);
+    float32x4_t acc2 = vdupq_n_f32(0), acc3 = vdupq_n_f32(0);
+    for (int i = 0; i < rows; ++i) {
+      const float* w_row = w + static_cast<size_t>(i) * cols + j;
+      acc0 = vfmaq_n_f32(acc0, vld1q_f32(w_row), in[i]);
+      acc1 = vfmaq_n_f32(acc1, vld1q_f32(w_row + 4), in[i]);
+      acc2 = vfmaq_n_f32(acc2, vld1q_f32(w_row + 8), in[i]);
+      acc3 = vfmaq_n_f32(acc3, vld1q_f32(w_row + 12), in[i]);
+    }
+    vst1q_f32(out + j, acc0);
+    vst1q_f32(out + j + 4, acc1);
+    vst1q_f32(out + j + 8, acc2);
+    vst1q_f32(out + j + 12, acc3);
+  }
+  for (; j + 4 <= cols; j += 4) {
+    float32x4_t acc = vdupq_n_f32(0);
+    for (int i = 0; i < rows; ++i) {
+      acc = vfmaq_n_f32(acc, vld1q_f32(w + static_cast<size_t>(i) * cols + j),
+                        in[i]);
+    }
+    vst1q_f32(out + j, acc);
+  }
+  for (; j < cols; ++j) {
+    float sum = 0;
+    for (int i = 0; i < rows; ++i) {
+      sum += in[i] * w[static_cast<size_t>(i) * cols + j];
+    }
+    out[j] = sum;
+  }
+}
+
+// Widen eight int8 values to fp32, low and high halves.
+static inline float32x4x2_t LoadS8NEON(const int8_t* p) {
+  int16x8_t wide = vmovl_s8(vld1_s8(p));
+  float32x4x2_t out;
+  out.val[0] = vcvtq_f32_s32(vmovl_s16(vget_low_s16(wide)));
+  out.val[1] = vcvtq_f32_s32(vmovl_s16(vget_high_s16(wide)));
+  return out;
+}
+
+static void GemvS8NEON(float* out, const float* in, const int8_t* w, int rows,
+                       int cols) {
+  for (int i = 0; i < rows; ++i) {
+    const int8_t* w_row = w + static_cast<size_t>(i) * cols;
+    float32x4_t acc0 = vdupq_n_f32(0), acc1 = vdupq_n_f32(0);
+    int j = 0;
+    for (; j + 8 <= cols; j += 8) {
+      float32x4x2_t wv = LoadS8NEON(w_row + j);
+      acc0 = vfmaq_f32(acc0, wv.val[0], vld1q_f32(in + j));
+      acc1 = vfmaq_f32(acc1, wv.val[1], vld1q_f32(in + j + 4));
+    }
+    float sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+    for (; j < cols; ++j) {
+      sum += w_row[j] * in[j];
+    }
+    out[i] = sum;
+  }
+}
+
+// Same as GemvTNEON over int8 rows.
+static void GemvTS8NEON(float* out, const float* in, const int8_t* w,
+                        int rows, int cols) {
+  int j = 0;
+  for (; j + 16 <= cols; j += 16) {
+    float32x4_t acc0 = vdupq_n_f32(0), acc1 = vdupq_n_f32(0);
+    float32x4_t acc2 = vdupq_n_f32(0), acc3 = vdupq_n_f32(0);
+    for (int i = 0; i < rows; ++i) {
+      const int8_t* w_row = w + static_cast<size_t>(i) * cols + j;
+      float32x4x2_t lo = LoadS8NEON(w_row);
+      float32x4x2_t hi = LoadS8NEON(w_row + 8);
+      acc0 = vfmaq_n_f32(acc0, lo.val[0], in[i]);
+      acc1 = vfmaq_n_f32(acc1, lo.val[1], in[i]);
+      acc2 = vfmaq_n_f32(acc2, hi.val[0], in[i]);
+      acc3 = vfmaq_n_f32(acc3, hi.val[1], in[i]);
+    }
+    vst1q_f32(out + j, acc0);
+    vst1q_f32(out + j + 4, acc1);
+    vst1q_f32(out + j + 8, acc2);
+    vst1q_f32(out + j + 12, acc3);
+  }
+  for (; j < cols; ++j) {
+    float sum = 0;
+    for (int i = 0; i < rows; ++i) {
+      sum += in[i] * w[static_cast<size_t>(i) * cols + j];
+    }
+    out[j] = sum;
+  }
+}
+
+// Signed int8 dot product of 16 lanes accumulated into four int32 sums.
+static inline int32x4_t DotQ8NEON(int32x4_t acc, int8x16_t x, int8x16_t w) {
+#ifdef __ARM_FEATURE_DOTPROD
+  return vdotq_s32(acc, x, w);
+#else
+  acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(x), vget_low_s8(w)));
+  return vpadalq_s16(acc, vmull_high_s8(x, w));
+#endif
+}
+
+// One row at a time; sdot is used when the target has the dot product
+// extension (-march=armv8.2-a+dotprod or later).
+static void GemvQ8NEON(float* out, const int8_t* x, const float* x_scales,
+                       const int8_t* w, const float* w_scales, int rows,
+                       int groups) {
+  const size_t stride = static_cast<size_t>(groups) * kQuantGroup;
+  for (int i = 0; i < rows; ++i) {
+    const int8_t* w_row = w + i * stride;
+    const float* s_row = w_scales + static_cast<size_t>(i) * groups;
+    float32x4_t acc = vdupq_n_f32(0);
+    for (int g = 0; g < groups; ++g) {
+      const int j = g * kQuantGroup;
+      int32x4_t dot = vdupq_n_s32(0);
+      dot = DotQ8NEON(dot, vld1q_s8(x + j), vld1q_s8(w_row + j));
+      dot = DotQ8NEON(dot, vld1q_s8(x + j + 16), vld1q_s8(w_row + j + 16));
+      acc = vfmaq_n_f32(acc, vcvtq_f32_s32(dot), s_row[g] * x_scales[g]);
+    }
+    out[i] = vaddvq_f32(acc);
+  }
+}
+
+// Same as GemvQ8NEON with each group expanded to int8 by a table lookup.
+static void GemvQ4NEON(float* out, const int8_t* x, const float* x_scales,
+                       const uint8_t* w, const uint16_t* w_scales, int rows,
+                       int groups) {
+  const size_t stride = static_cast<size_t>(groups) * kQ4GroupBytes;
+  const int8x16_t lut = vld1q_s8(kQ4Values);
+  for (int i = 0; i < rows; ++i) {
+    const uint8_t* w_row = w + i * stride;
+    const __fp16* s_row = reinterpret_cast<const __fp16*>(w_scales) +
+                          static_cast<size_t>(i) * groups;
+    float32x4_t acc = vdupq_n_f32(0);
+    for (int g = 0; g < groups; ++g) {
+      const int j = g * kQuantGroup;
+      uint8x16_t bytes = vld1q_u8(w_row + g * kQ4GroupBytes);
+      int8x16_t lo = vqtbl1q_s8(lut, vandq_u8(bytes, vdupq_n_u8(0x0f)));
+      int8x16_t hi = vqtbl1q_s8(lut, vshrq_n_u8(bytes, 4));
+      int32x4_t dot = vdupq_n_s32(0);
+      dot = DotQ8NEON(dot, vld1q_s8(x + j), lo);
+      dot = DotQ8NEON(dot, vld1q_s8(x + j + 16), hi);
+      acc = vfmaq_n_f32(acc, vcvtq_f32_s32(dot),
+                        static_cast<float>(s_row[g]) * x_scales[g]);
+    }
+    out[i] = vaddvq_f32(acc);
+  }
+}
+
+// Widen four fp16 or bf16 weights to fp32.
+template <bool kBF16>
+static inline float32x4_t LoadHalfNEON(const uint16_t* p) {
+  if (kBF16) {
+    return vreinterpretq_f32_u32(vshll_n_u16(vld1_u16(p), 16));
+  }
+  return vcvt_f32_f16(vld1_f16(reinterpret_cast<const __fp16*>(p)));
+}
+
+// Same as GemvHalfAVX2 with 4-wide lanes.
+template <bool kBF16>
+static void GemvHalfNEON(float* out, const float* in, const uint16_t* w,
+                         int rows, int cols) {
+  float (*to_float)(uint16_t) = kBF16 ? BF16ToFloat : HalfToFloat;
+  for (int i = 0; i < rows; i += 4) {
+    const int n = std::min(4, rows - i);
+    float32x4_t acc[4][2];
+    for (int r = 0; r < 4; ++r) {
+      acc[r][0] = acc[r][1] = vdupq_n_f32(0);
+    }
+    int j = 0;
+    for (; j + 8 <= cols; j += 8) {
+      float32x4_t x0 = vld1q_f32(in + j);
+      float32x4_t x1 = vld1q_f32(in + j + 4);
+      for (int r = 0; r < n; ++r) {
+        const uint16_t* w_row = w + static_cast<size_t>(i + r) * cols;
+        acc[r][0] = vfmaq_f32(acc[r][0], LoadHalfNEON<kBF16>(w_row + j), x0);
+        acc[r][1] =
+            vfmaq_f32(acc[r][1], LoadHalfNEON<kBF16>(w_row + j + 4), x1);
+      }
+    }
+    for (int r = 0; r < n; ++r) {
+      const uint16_t* w_row = w + static_cast<size_t>(i + r) * cols;
+      float sum = vaddvq_f32(vaddq_f32(acc[r][0], acc[r][1]));
+      for (int k = j; k < cols; ++k) {
+        sum += to_float(w_row[k]) * in[k];
+      }
+      out[i + r] = sum;
+    }
+  }
+}
+
+#endif // SWAN_CPU_NEON
+
+/* ---------------------------------  /
+             Kernel Dispatch
+/  --------------------------------- */
+
+// Candidate kernel sets, widest first.
+static const CPUKernels kCPUKernels[] = {
+#ifdef SWAN_CPU_X86
+    {"avx512vnni", SupportsAVX512VNNI, GemvAVX512, GemvTAVX512, GemvS8AVX512,
+     GemvTS8AVX512, GemvQ8AVX512VNNI, GemvQ4AVX2, GemvHalfAVX512<false>,
+     GemvHalfAVX512<true>, GemmAVX512},
+    {"avx512", SupportsAVX512, GemvAVX512, GemvTAVX512, GemvS8AVX512,
+     GemvTS8AVX512, GemvQ8AVX2, GemvQ4AVX2, GemvHalfAVX512<false>,
+     GemvHalfAVX512<true>, GemmAVX512},
+    {"avx2", SupportsAVX2, GemvAVX2, GemvTAVX2, GemvS8AVX2, GemvTS8AVX2,
+     GemvQ8AVX2, GemvQ4AVX2, GemvHalfAVX2<false>, GemvHalfAVX2<true>,
+     GemmAVX2},
+#endif
+#ifdef SWAN_CPU_NEON
+    {"neon", SupportsNEON, GemvNEON, GemvTNEON, GemvS8NEON, GemvTS8NEON,
+     GemvQ8NEON, GemvQ4NEON, GemvHalfNEON<false>, GemvHalfNEON<true>,
+     GemmNEON},
+#endif
+    {"scalar", SupportsScalar, GemvScalar, GemvTScalar, GemvS8Scalar,
+     GemvTS8Scalar, GemvQ8Scalar, GemvQ4Scalar, GemvHalfScalar<HalfToFloat>,
+     GemvHalfScalar<BF16ToFloat>, GemmScalar},
+};
+
+// The scalar kernels until SelectCPUKernels is called.
+static const CPUKernels* cpu_kernels = std::end(kCPUKernels) - 1;
+
+bool SelectCPUKernels(const std::string& name) {
+  for (const CPUKernels& kernels : kCPUKernels) {
+    if ((name == "auto" || name == kernels.name) && kernels.supported()) {
+      cpu_kernels = &kernels;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char* CPUKernelName() {
+  return cpu_kernels->name;
+}
+
+/* ---------------------------------  /
+             Weight Formats
+/  --------------------------------- */
+
+bool ParseWeightFormat(const std::string& name, WeightFormat& format) {
+  if (name == "f32") {
+    format = WeightFormat::kF32;
+  } else if (name == "f16") {
+    format = WeightFormat::kF16;
+  } else if (name == "bf16") {
+    format = WeightFormat::kBF16;
+  } else if (name == "q8") {
+    format = WeightFormat::kQ8;
+  } else if (name == "q4") {
+    format = WeightFormat::kQ4;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* WeightFormatName(WeightFormat format) {
+  switch (format) {
+  case WeightFormat::kF32:
+    return "f32";
+  case WeightFormat::kF16:
+    return "f16";
+  case WeightFormat::kBF16:
+    return "bf16";
+  case WeightFormat::kQ8:
+    return "q8";
+  case WeightFormat::kQ4:
+    return "q4";
+  }
+  return "unknown";
+}
+
+bool ParseKVFormat(const std::string& name, KVFormat& format) {
+  if (name == "f32") {
+    format = KVFormat::kF32;
+  } else if (name == "q8") {
+    format = KVFormat::kQ8;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* KVFormatName(KVFormat format) {
+  switch (format) {
+  case KVFormat::kF32:
+    return "f32";
+  case KVFormat::kQ8:
+    return "q8";
+  }
+  return "unknown";
+}
+
+static int Groups(int cols) {
+  return (cols + kQuantGroup - 1) / kQuantGroup;
+}
+
+// Quantize n <= kQuantGroup values to int8 with one symmetric scale and zero
+// fill the rest of the group. Returns the scale.
+static float QuantizeGroupQ8(int8_t* q, const float* x, int n) {
+  float amax = 0;
+  for (int j = 0; j < n; ++j) {
+    amax = std::max(amax, std::fabs(x[j]));
+  }
+  float scale = amax / 127;
+  float inv_scale = scale != 0 ? 1 / scale : 0;
+  for (int j = 0; j < kQuantGroup; ++j) {
+    q[j] = j < n ? static_cast<int8_t>(std::lrint(x[j] * inv_scale)) : 0;
+  }
+  return scale;
+}
+
+// Quantize n <= kQuantGroup values to 4 bits with one symmetric fp16 scale
+// and pack them as described at kQ4GroupBytes. Returns the scale.
+static uint16_t QuantizeGroupQ4(uint8_t* packed, const float* x, int n) {
+  float amax = 0;
+  for (int j = 0; j < n; ++j) {
+    amax = std::max(amax, std::fabs(x[j]));
+  }
+  // Round with the scale the kernels will actually see.
+  uint16_t scale = FloatToHalf(amax / 7);
+  float inv_scale = amax != 0 ? 1 / HalfToFloat(scale) : 0;
+  int8_t q[kQuantGroup] = {};
+  for (int j = 0; j < n; ++j) {
+    q[j] = std::clamp<long>(std::lrint(x[j] * inv_scale), -8, 7);
+  }
+  for (int j = 0; j < kQ4GroupBytes; ++j) {
+    packed[j] = (q[j] + 8) | ((q[j + kQ4GroupBytes] + 8) << 4);
+  }
+  return scale;
+}
+
+Matrix F32Matrix(const float* w, int rows, int cols) {
+  Matrix m;
+  m.format = WeightFormat::kF32;
+  m.rows = rows;
+  m.cols = cols;
+  m.data = w;
+  return m;
+}
+
+Matrix AllocMatrix(MatrixBuffer& buffer, WeightFormat format, int rows,
+                   int cols) {
+  const size_t groups = static_cast<size_t>(rows) * Groups(cols);
+  switch (format) {
+  case WeightFormat::kF32:
+    buffer.data.assign(static_cast<size_t>(rows) * cols * sizeof(float), 0);
+    buffer.scales.clear();
+    break;
+  case WeightFormat::kF16:
+  case WeightFormat::kBF16:
+    buffer.data.assign(static_cast<size_t>(rows) * cols * sizeof(uint16_t),
+                       0);
+    buffer.scales.clear();
+    break;
+  case WeightFormat::kQ8:
+    buffer.data.assign(groups * kQuantGroup, 0);
+    buffer.scales.assign(groups * sizeof(float), 0);
+    break;
+  case WeightFormat::kQ4:
+    buffer.data.assign(groups * kQ4GroupBytes, 0);
+    buffer.scales.assign(groups * sizeof(uint16_t), 0);
+    break;
+  }
+  Matrix m;
+  m.format = format;
+  m.rows = rows;
+  m.cols = cols;
+  m.data = buffer.data.data();
+  m.scales = buffer.scales.empty() ? nullptr : buffer.scales.data();
+  return m;
+}
+
+void SetMatrixRow(MatrixBuffer& buffer, const Matrix& m, int row,
+                  const float* src) {
+  const int groups = Groups(m.cols);
+  switch (m.format) {
+  case WeightFormat::kF32: {
+    float* dst = reinterpret_cast<float*>(buffer.data.data());
+    std::copy(src, src + m.cols, dst + static_cast<size_t>(row) * m.cols);
+    break;
+  }
+  case WeightFormat::kF16:
+  case WeightFormat::kBF16: {
+    uint16_t* dst = reinterpret_cast<uint16_t*>(buffer.data.data()) +
+                    static_cast<size_t>(row) * m.cols;
+    auto convert = m.format == WeightFormat::kF16 ? FloatToHalf : FloatToBF16;
+    for (int j = 0; j < m.cols; ++j) {
+      dst[j] = convert(src[j]);
+    }
+    break;
+  }
+  case WeightFormat::kQ8: {
+    int8_t* dst = reinterpret_cast<int8_t*>(buffer.data.data()) +
+                  static_cast<size_t>(row) * groups * kQuantGroup;
+    float* scales = reinterpret_cast<float*>(buffer.scales.data()) +
+                    static_cast<size_t>(row) * groups;
+    for (int g = 0; g < groups; ++g) {
+      int n = std::min(kQuantGroup, m.cols - g * kQuantGroup);
+      scales[g] = QuantizeGroupQ8(dst + g * kQuantGroup,
+                                  src + g * kQuantGroup, n);
+    }
+    break;
+  }
+  case WeightFormat::kQ4: {
+    uint8_t* dst =
+        buffer.data.data() + static_cast<size_t>(row) * groups * kQ4GroupBytes;
+    uint16_t* scales = reinterpret_cast<uint16_t*>(buffer.scales.data()) +
+                       static_cast<size_t>(row) * groups;
+    for (int g = 0; g < groups; ++g) {
+      int n = std::min(kQuantGroup, m.cols - g * kQuantGroup);
+      scales[g] = QuantizeGroupQ4(dst + g * kQ4GroupBytes,
+                                  src + g * kQuantGroup, n);
+    }
+    break;
+  }
+  }
+}
+
+void GetMatrixRow(const Matrix& m, int row, float* dst) {
+  const int groups = Groups(m.cols);
+  switch (m.format) {
+  case WeightFormat::kF32: {
+    const float* src =
+        static_cast<const float*>(m.data) + static_cast<size_t>(row) * m.cols;
+    std::copy(src, src + m.cols, dst);
+    break;
+  }
+  case WeightFormat::kF16:
+  case WeightFormat::kBF16: {
+    const uint16_t* src = static_cast<const uint16_t*>(m.data) +
+                          static_cast<size_t>(row) * m.cols;
+    auto convert = m.format == WeightFormat::kF16 ? HalfToFloat : BF16ToFloat;
+    for (int j = 0; j < m.cols; ++j) {
+      dst[j] = convert(src[j]);
+    }
+    break;
+  }
+  case WeightFormat::kQ8: {
+    const int8_t* src = static_cast<const int8_t*>(m.data) +
+                        static_cast<size_t>(row) * groups * kQuantGroup;
+    const float* scales =
+        static_cast<const float*>(m.scales) + static_cast<size_t>(row) * groups;
+    for (int j = 0; j < m.cols; ++j) {
+      dst[j] = src[j] * scales[j / kQuantGroup];
+    }
+    break;
+  }
+  case WeightFormat::kQ4: {
+    const uint8_t* src = static_cast<const uint8_t*>(m.data) +
+                         static_cast<size_t>(row) * groups * kQ4GroupBytes;
+    const uint16_t* scales = static_cast<const uint16_t*>(m.scales) +
+                             static_cast<size_t>(row) * groups;
+    for (int j = 0; j < m.cols; ++j) {
+      const int g = j / kQuantGroup;
+      const int k = j % kQuantGroup;
+      const uint8_t byte = src[g * kQ4GroupBytes + k % kQ4GroupBytes];
+      const int code = k < kQ4GroupBytes ? byte & 0xf : byte >> 4;
+      dst[j] = kQ4Values[code] * HalfToFloat(scales[g]);
+    }
+    break;
+  }
+  }
+}
+
+// Bytes of one row of m in data and in scales.
+static void RowBytes(const Matrix& m, size_t& data, size_t& scales) {
+  const size_t groups = Groups(m.cols);
+  switch (m.format) {
+  case WeightFormat::kF32:
+    data = m.cols * sizeof(float);
+    scales = 0;
+    break;
+  case WeightFormat::kF16:
+  case WeightFormat::kBF16:
+    data = m.cols * sizeof(uint16_t);
+    scales = 0;
+    break;
+  case WeightFormat::kQ8:
+    data = groups * kQuantGroup;
+    scales = groups * sizeof(float);
+    break;
+  case WeightFormat::kQ4:
+    data = groups * kQ4GroupBytes;
+    scales = groups * sizeof(uint16_t);
+    break;
+  }
+}
+
+Matrix GatherRows(MatrixBuffer& buffer, const Matrix& m, const int* rows,
+                  int n) {
+  Matrix out = AllocMatrix(buffer, m.format, n, m.cols);
+  size_t data_bytes = 0;
+  size_t scale_bytes = 0;
+  RowBytes(m, data_bytes, scale_bytes);
+  const uint8_t* data = static_cast<const uint8_t*>(m.data);
+  const uint8_t* scales = static_cast<const uint8_t*>(m.scales);
+  for (int i = 0; i < n; ++i) {
+    std::copy_n(data + rows[i] * data_bytes, data_bytes,
+                buffer.data.data() + i * data_bytes);
+    std::copy_n(scales + rows[i] * scale_bytes, scale_bytes,
+                buffer.scales.data() + i * scale_bytes);
+  }
+  return out;
+}
+
+/* ---------------------------------  /
+              GEMV Dispatch
+/  --------------------------------- */
+
+// Input vector in the representation the kernels of one matrix expect.
+struct Activation {
+  const float* f32;
+  const int8_t* q8;
+  const float* q8_scales;
+};
+
+static bool IsQuantized(const Matrix& w) {
+  return w.format == WeightFormat::kQ8 || w.format == WeightFormat::kQ4;
+}
+
+// Quantize cols inputs to int8 in groups of kQuantGroup.
+static void QuantizeActivation(int8_t* q8, float* q8_scales, const float* in,
+                               int cols) {
+  for (int g = 0; g < Groups(cols); ++g) {
+    int n = std::min(kQuantGroup, cols - g * kQuantGroup);
+    q8_scales[g] = QuantizeGroupQ8(q8 + g * kQuantGroup, in + g * kQuantGroup,
+                                   n);
+  }
+}
+
+// Quantize the input once per product, on the calling thread, for the
+// integer kernels. The buffers are reused across calls.
+static Activation PrepareActivation(const float* in, const Matrix& w) {
+  static thread_local std::vector<int8_t> q8;
+  static thread_local std::vector<float> q8_scales;
+  Activation x{in, nullptr, nullptr};
+  if (IsQuantized(w)) {
+    const int groups = Groups(w.cols);
+    q8.resize(static_cast<size_t>(groups) * kQuantGroup);
+    q8_scales.resize(groups);
+    QuantizeActivation(q8.data(), q8_scales.data(), in, w.cols);
+    x.q8 = q8.data();
+    x.q8_scales = q8_scales.data();
+  }
+  return x;
+}
+
+// Compute rows row..row+n of w . x into out[0..n) with the selected kernels.
+static void GemvRows(float* out, const Activation& x, const Matrix& w,
+                     int row, int n) {
+  switch (w.format) {
+  case WeightFormat::kF32:
+    cpu_kernels->gemv(out, x.f32,
+                      static_cast<const float*>(w.data) +
+                          static_cast<size_t>(row) * w.cols,
+                      n, w.cols);
+    break;
+  case WeightFormat::kF16:
+  case WeightFormat::kBF16: {
+    const uint16_t* w_rows = static_cast<const uint16_t*>(w.data) +
+                             static_cast<size_t>(row) * w.cols;
+    if (w.format == WeightFormat::kF16) {
+      cpu_kernels->gemv_f16(out, x.f32, w_rows, n, w.cols);
+    } else {
+      cpu_kernels->gemv_bf16(out, x.f32, w_rows, n, w.cols);
+    }
+    break;
+  }
+  case WeightFormat::kQ8: {
+    const int groups = Groups(w.cols);
+    cpu_kernels->gemv_q8(out, x.q8, x.q8_scales,
+                         static_cast<const int8_t*>(w.data) +
+                             static_cast<size_t>(row) * groups * kQuantGroup,
+                         static_cast<const float*>(w.scales) +
+                             static_cast<size_t>(row) * groups,
+                         n, groups);
+    break;
+  }
+  case WeightFormat::kQ4: {
+    const int groups = Groups(w.cols);
+    cpu_kernels->gemv_q4(out, x.q8, x.q8_scales,
+                         static_cast<const uint8_t*>(w.data) +
+                             static_cast<size_t>(row) * groups * kQ4GroupBytes,
+                         static_cast<const uint16_t*>(w.scales) +
+                             static_cast<size_t>(row) * groups,
+                         n, groups);
+    break;
+  }
+  }
+}
+
+// Smallest amount of work handed to one thread, in multiply-adds. Below
+// this the wake-up costs more than the rows save.
+static constexpr int kGemvGrainMACs = 1 << 14;
+
+// Rows are split in multiples of 16 so no two threads write to the same
+// cache line of out, and every chunk keeps the four-row blocking.
+static int GemvGrain(int cols) {
+  return std::max(16, (kGemvGrainMACs / cols + 15) & ~15);
+}
+
+void Gemv(float* out, const float* in, const Matrix& w) {
+  const Activation x = PrepareActivation(in, w);
+  ParallelFor(w.rows, GemvGrain(w.cols), [&](int begin, int end) {
+    GemvRows(out + begin, x, w, begin, end - begin);
+  });
+}
+
+/* ---------------------------------  /
+            Attention Kernels
+/  --------------------------------- */
+
+// The per-head kernels run on the calling thread; Attention spreads the
+// heads and chunks of the sequence over the pool.
+
+void AttentionScores(float* out, const float* q, const float* k, int n,
+                     int head_dim) {
+  cpu_kernels->gemv(out, q, k, n, head_dim);
+}
+
+void AttentionValues(float* out, const float* p, const float* v, int n,
+                     int head_dim) {
+  cpu_kernels->gemv_t(out, p, v, n, head_dim);
+}
+
+void AttentionValuesT(float* out, const float* p, const float* vt, int n,
+                      int head_dim, int stride) {
+  for (int i = 0; i < head_dim; ++i) {
+    cpu_kernels->gemv(out + i, p, vt + static_cast<size_t>(i) * stride, 1, n);
+  }
+}
+
+// Positions scored per step of the online softmax. Small enough for the
+// scores to stay in L1, large enough to amortize the rescale of out.
+static constexpr int kAttentionBlock = 64;
+
+// Offset of the block of KV head kv_head in the page of position t, and
+// of the scale of position t.
+static size_t KVRow(const KVView& kv, int kv_head, int t) {
+  return kv.pages[t / kv.page_len] * kv.page_stride +
+         kv_head * kv.head_stride;
+}
+
+static size_t KVScale(const KVView& kv, int kv_head, int t) {
+  return kv.pages[t / kv.page_len] * kv.scale_page_stride +
+         kv_head * kv.scale_stride + t % kv.page_len;
+}
+
+// Positions from t to the end of its page, at most m.
+static int KVPiece(const KVView& kv, int t, int m) {
+  return std::min(m, kv.page_len - t % kv.page_len);
+}
+
+// out[j] = k[t+j] . q for the m positions from t of one KV head.
+static void KeyProduct(float* out, const float* q, const KVView& k,
+                       int kv_head, int t, int m, int head_dim) {
+  for (int j = 0; j < m;) {
+    const int n = KVPiece(k, t + j, m - j);
+    const size_t rows = KVRow(k, kv_head, t + j) +
+                        static_cast<size_t>((t + j) % k.page_len) * head_dim;
+    if (k.format == KVFormat::kQ8) {
+      cpu_kernels->gemv_s8(out + j, q,
+                           static_cast<const int8_t*>(k.data) + rows, n,
+                           head_dim);
+      const float* scales = k.scales + KVScale(k, kv_head, t + j);
+      for (int i = 0; i < n; ++i) {
+        out[j + i] *= scales[i];
+      }
+    } else {
+      cpu_kernels->gemv(out + j, q, static_cast<const float*>(k.data) + rows,
+                        n, head_dim);
+    }
+    j += n;
+  }
+}
+
+// out = p[j] . v[t+j] for the n positions from t of one KV head, all within
+// one page. p is overwritten when the values carry scales.
+static void ValuePiece(float* out, float* p, const KVView& v, int kv_head,
+                       int t, int n, int head_dim) {
+  const bool q8 = v.format == KVFormat::kQ8;
+  if (q8) {
+    const float* scales = v.scales + KVScale(v, kv_head, t);
+    for (int j = 0; j < n; ++j) {
+      p[j] *= scales[j];
+    }
+  }
+  const size_t block = KVRow(v, kv_head, t);
+  if (v.transposed) {
+    for (int i = 0; i < head_dim; ++i) {
+      const size_t row =
+          block + static_cast<size_t>(i) * v.page_len + t % v.page_len;
+      if (q8) {
+        cpu_kernels->gemv_s8(out + i, p,
+                             static_cast<const int8_t*>(v.data) + row, 1, n);
+      } else {
+        cpu_kernels->gemv(out + i, p, static_cast<const float*>(v.data) + row,
+                          1, n);
+      }
+    }
+  } else {
+    const size_t rows =
+        block + static_cast<size_t>(t % v.page_len) * head_dim;
+    if (q8) {
+      cpu_kernels->gemv_t_s8(out, p, static_cast<const int8_t*>(v.data) + rows,
+                             n, head_dim);
+    } else {
+      cpu_kernels->gemv_t(out, p, static_cast<const float*>(v.data) + rows, n,
+                          head_dim);
+    }
+  }
+}
+
+// out = p[j] . v[t+j] for the m positions from t of one KV head, one page
+// at a time; sum holds head_dim floats of scratch. p is overwritten when
+// the values carry scales.
+static void ValueProduct(float* out, float* sum, float* p, const KVView& v,
+                         int kv_head, int t, int m, int head_dim) {
+  int n = KVPiece(v, t, m);
+  ValuePiece(out, p, v, kv_head, t, n, head_dim);
+  for (int j = n; j < m; j += n) {
+    n = KVPiece(v, t + j, m - j);
+    ValuePiece(sum, p + j, v, kv_head, t + j, n, head_dim);
+    for (int i = 0; i < head_dim; ++i) {
+      out[i] += sum[i];
+    }
+  }
+}
+
+// Attention output of one query head over positions begin..end of one KV
+// head, normalized over that range alone. Scores, softmax and the weighted
+// sum of v are fused into one pass with a running max and sum, so neither
+// the scores nor the probabilities are written out. Returns the
+// log-sum-exp of the scaled scores, which weighs this range against the
+// others when their outputs are merged.
+static float AttentionRange(float* out, const float* q, const KVView& k,
+                            const KVView& v, int kv_head, int begin, int end,
+                            int head_dim, float scale) {
+  static thread_local std::vector<float> buffer;
+  buffer.resize(kAttentionBlock + 3 * head_dim);
+  float* scores = buffer.data();
+  float* q_scaled = scores + kAttentionBlock;
+  float* partial = q_scaled + head_dim;
+  float* piece = partial + head_dim;
+
+  // Scale q once instead of every score.
+  for (int i = 0; i < head_dim; ++i) {
+    q_scaled[i] = q[i] * scale;
+  }
+  std::fill(out, out + head_dim, 0.0f);
+
+  // Running maximum and sum of exp(score - max) over the positions so far.
+  float max = -INFINITY;
+  float sum = 0;
+  for (int t = begin; t < end; t += kAttentionBlock) {
+    const int m = std::min(kAttentionBlock, end - t);
+    KeyProduct(scores, q_scaled, k, kv_head, t, m, head_dim);
+
+    const float new_max = std::max(max, *std::max_element(scores, scores + m));
+    const float correction = std::exp(max - new_max); // 0 for the first block
+    float block_sum = 0;
+    for (int j = 0; j < m; ++j) {
+      scores[j] = std::exp(scores[j] - new_max);
+      block_sum += scores[j];
+    }
+    sum = sum * correction + block_sum;
+    max = new_max;
+
+    ValueProduct(partial, piece, scores, v, kv_head, t, m, head_dim);
+    for (int i = 0; i < head_dim; ++i) {
+      out[i] = out[i] * correction + partial[i];
+    }
+  }
+
+  const float inv_sum = 1 / sum;
+  for (int i = 0; i < head_dim; ++i) {
+    out[i] *= inv_sum;
+  }
+  return max + std::log(sum);
+}
+
+// Shortest range of positions worth splitting off a head. Shorter ranges
+// cost more in the merge than they save.
+static constexpr int kAttentionMinSplit = 128;
+
+void Attention(float* out, const float* q, const KVView& k, const KVView& v,
+               int n, int num_heads, int num_kv_heads, int head_dim,
+               float scale) {
+  const int kv_group = num_heads / num_kv_heads;
+  // Split each head into enough chunks of the sequence to occupy the pool
+  // once there are fewer heads than threads.
+  const int threads = ThreadPoolSize();
+  const int splits = std::max(
+      1, std::min((threads + num_heads - 1) / num_heads,
+                  n / kAttentionMinSplit));
+  const int split_len = (n + splits - 1) / splits;
+  const int items = num_heads * splits;
+
+  // Normalized outputs and log-sum-exp of every (head, chunk) item.
+  static thread_local std::vector<float> partial_out;
+  static thread_local std::vector<float> partial_lse;
+  float* item_out = out;
+  if (splits > 1) {
+    partial_out.resize(static_cast<size_t>(items) * head_dim);
+    partial_lse.resize(items);
+    item_out = partial_out.data();
+  }
+  float* item_lse = partial_lse.data();
+
+  // Hand each thread at least kGemvGrainMACs of work.
+  const int item_macs = 2 * split_len * head_dim;
+  const int grain = std::max(1, kGemvGrainMACs / std::max(1, item_macs));
+  ParallelFor(items, grain, [&](int begin, int end) {
+    for (int item = begin; item < end; ++item) {
+      const int head = item / splits;
+      const int t_begin = item % splits * split_len;
+      const int t_end = std::min(n, t_begin + split_len);
+      float lse = AttentionRange(item_out + item * head_dim,
+                                 q + head * head_dim, k, v, head / kv_group,
+                                 t_begin, t_end, head_dim, scale);
+      if (splits > 1) {
+        item_lse[item] = lse;
+      }
+    }
+  });
+  if (splits == 1) {
+    return;
+  }
+
+  // Merge the chunks of each head, weighting each by its share of the
+  // softmax denominator.
+  for (int head = 0; head < num_heads; ++head) {
+    float* weight = item_lse + head * splits; // overwrites the lse
+    const float max_lse = *std::max_element(weight, weight + splits);
+    float total = 0;
+    for (int s = 0; s < splits; ++s) {
+      weight[s] = std::exp(weight[s] - max_lse);
+      total += weight[s];
+    }
+    float* head_out = out + head * head_dim;
+    for (int i = 0; i < head_dim; ++i) {
+      float sum = 0;
+      for (int s = 0; s < splits; ++s) {
+        sum += weight[s] * item_out[(head * splits + s) * head_dim + i];
+      }
+      head_out[i] = sum / total;
+    }
+  }
+}
+
+void AttentionProbs(float* qk, float* sm, const float* q, const KVView& k,
+                    int kv_head, int n, int head_dim, float scale) {
+  static thread_local std::vector<float> q_scaled;
+  q_scaled.resize(head_dim);
+  for (int i = 0; i < head_dim; ++i) {
+    q_scaled[i] = q[i] * scale;
+  }
+  KeyProduct(qk, q_scaled.data(), k, kv_head, 0, n, head_dim);
+
+  const float max = *std::max_element(qk, qk + n);
+  float sum = 0;
+  for (int t = 0; t < n; ++t) {
+    sm[t] = std::exp(qk[t] - max);
+    sum += sm[t];
+  }
+  for (int t = 0; t < n; ++t) {
+    sm[t] /= sum;
+  }
+}
+
+/* ---------------------------------  /
+              Fused QKV GEMV
+/  --------------------------------- */
+
+// Rotate the pairs (x[i], x[i+1]) for i = begin..end; begin is even.
+static void RotatePairs(float* x, int begin, int end, const float* cos_vec,
+                        const float* sin_vec, int head_dim) {
+  for (int i = begin; i < end; i += 2) {
+    int p = (i % head_dim) / 2;
+    float x0 = x[i];
+    float x1 = x[i + 1];
+    x[i] = x0 * cos_vec[p] - x1 * sin_vec[p];
+    x[i + 1] = x0 * sin_vec[p] + x1 * cos_vec[p];
+  }
+}
+
+void GemvQKVStrided(float* q, float* k, size_t k_stride, float* v,
+                    size_t v_stride, const float* in, const Matrix& w,
+                    int kv_dim, const float* cos_vec, const float* sin_vec,
+                    int head_dim) {
+  const int dim = w.cols;
+  float* const outs[3] = {q, k, v};
+  const size_t strides[3] = {static_cast<size_t>(head_dim), k_stride,
+                             v_stride};
+  const int bounds[4] = {0, dim, dim + kv_dim, dim + 2 * kv_dim};
+  const Activation x = PrepareActivation(in, w);
+
+  ParallelFor(bounds[3], GemvGrain(dim), [&](int begin, int end) {
+    // A chunk may straddle the q/k/v boundaries; split it there, and at
+    // every head when the heads are not contiguous.
+    for (int s = 0; s < 3; ++s) {
+      const int b = std::max(begin, bounds[s]);
+      const int e = std::min(end, bounds[s + 1]);
+      const bool contiguous = strides[s] == static_cast<size_t>(head_dim);
+      for (int r = b; r < e;) {
+        const int head = (r - bounds[s]) / head_dim;
+        const int head_end =
+            contiguous ? e : std::min(e, bounds[s] + (head + 1) * head_dim);
+        // Rows of this head are relative to its first one.
+        float* out = outs[s] + head * strides[s];
+        const int first = bounds[s] + head * head_dim;
+        GemvRows(out + (r - first), x, w, r, head_end - r);
+        if (s < 2) {
+          RotatePairs(out, r - first, head_end - first, cos_vec, sin_vec,
+                      head_dim);
+        }
+        r = head_end;
+      }
+    }
+  });
+}
+
+/* ---------------------------------  /
+             Fused SwiGLU GEMV
+/  --------------------------------- */
+
+// Outputs per kernel call; the 2x rows of projections fit in L1.
+static constexpr int kSwiGLUBlock = 32;
+
+void GemvSwiGLU(float* out, const float* in, const Matrix& w) {
+  const Activation x = PrepareActivation(in, w);
+  ParallelFor(w.rows / 2, GemvGrain(w.cols), [&](int begin, int end) {
+    float block[2 * kSwiGLUBlock];
+    for (int i = begin; i < end; i += kSwiGLUBlock) {
+      int n = std::min(kSwiGLUBlock, end - i);
+      GemvRows(block, x, w, 2 * i, 2 * n);
+      for (int r = 0; r < n; ++r) {
+        out[i + r] = SiLU(block[2 * r]) * block[2 * r + 1];
+      }
+    }
+  });
+}
+
+/* ---------------------------------  /
+              Batched GEMM
+/  --------------------------------- */
+
+// Weight rows and tokens per block of a matrix-matrix product. Each block
+// of rows is used by every token of the batch while it is still in cache,
+// so the weights are streamed from memory once per batch instead of once
+// per token.
+static constexpr int kGemmBlockRows = 16;
+static constexpr int kGemmBlockTokens = 8;
+
+// Inputs of n tokens [n, cols] in the representation the kernels of one
+// matrix expect, quantized on the calling thread.
+static const Activation* PrepareActivations(const float* in, int n,
+                                            const Matrix& w) {
+  static thread_local std::vector<Activation> xs;
+  static thread_local std::vector<int8_t> q8;
+  static thread_local std::vector<float> q8_scales;
+  const size_t groups = Groups(w.cols);
+  xs.resize(n);
+  if (IsQuantized(w)) {
+    q8.resize(n * groups * kQuantGroup);
+    q8_scales.resize(n * groups);
+  }
+  for (int t = 0; t < n; ++t) {
+    const float* in_t = in + static_cast<size_t>(t) * w.cols;
+    xs[t] = Activation{in_t, nullptr, nullptr};
+    if (IsQuantized(w)) {
+      xs[t].q8 = &q8[t * groups * kQuantGroup];
+      xs[t].q8_scales = &q8_scales[t * groups];
+      QuantizeActivation(&q8[t * groups * kQuantGroup], &q8_scales[t * groups],
+                         in_t, w.cols);
+    }
+  }
+  return xs.data();
+}
+
+// Compute rows row..row+n of w . x[t] for the tokens t = 0..num_tokens
+// into out[t * out_stride + 0..n). fp32 weights use the register-blocked
+// kernel; the other formats run the GEMV kernels token by token.
+static void GemmRows(float* out, int out_stride, const Activation* x,
+                     int num_tokens, const Matrix& w, int row, int n) {
+  if (w.format == WeightFormat::kF32) {
+    cpu_kernels->gemm(out, out_stride, x[0].f32, num_tokens,
+                      static_cast<const float*>(w.data) +
+                          static_cast<size_t>(row) * w.cols,
+                      n, w.cols);
+    return;
+  }
+  for (int t = 0; t < num_tokens; ++t) {
+    GemvRows(out + static_cast<size_t>(t) * out_stride, x[t], w, row, n);
+  }
+}
+
+// Grain of GemvGrain scaled down by the n tokens sharing each row.
+static int GemmGrain(int cols, int n) {
+  return std::max(16, (kGemvGrainMACs / (cols * n) + 15) & ~15);
+}
+
+// Call f(t, nt, b, e) for every block [b, e) of rows begin..end and every
+// block of nt tokens from t, tokens innermost.
+template <class F>
+static void ForEachBlock(int begin, int end, int n, F f) {
+  for (int b = begin; b < end; b += kGemmBlockRows) {
+    const int e = std::min(end, b + kGemmBlockRows);
+    for (int t = 0; t < n; t += kGemmBlockTokens) {
+      f(t, std::min(kGemmBlockTokens, n - t), b, e);
+    }
+  }
+}
+
+void Gemm(float* out, const float* in, int n, const Matrix& w) {
+  const Activation* x = PrepareActivations(in, n, w);
+  ParallelFor(w.rows, GemmGrain(w.cols, n), [&](int begin, int end) {
+    ForEachBlock(begin, end, n, [&](int t, int nt, int b, int e) {
+      GemmRows(out + static_cast<size_t>(t) * w.rows + b, w.rows, x + t, nt,
+               w, b, e - b);
+    });
+  });
+}
+
+void GemmQKV(float* q, float* k, float* v, const float* in, int n,
+             const Matrix& w, int kv_dim, const float* cos_table,
+             const float* sin_table, const int* pos, int head_dim) {
+  const int dim = w.cols;
+  float* const outs[3] = {q, k, v};
+  const int strides[3] = {dim, kv_dim, kv_dim};
+  const int bounds[4] = {0, dim, dim + kv_dim, dim + 2 * kv_dim};
+  const Activation* x = PrepareActivations(in, n, w);
+
+  ParallelFor(bounds[3], GemmGrain(dim, n), [&](int begin, int end) {
+    for (int s = 0; s < 3; ++s) {
+      int b = std::max(begin, bounds[s]);
+      int e = std::min(end, bounds[s + 1]);
+      if (b >= e) {
+        continue;
+      }
+      ForEachBlock(b, e, n, [&](int t, int nt, int bb, int be) {
+        float* out = outs[s] + static_cast<size_t>(t) * strides[s];
+        GemmRows(out + (bb - bounds[s]), strides[s], x + t, nt, w, bb,
+                 be - bb);
+        if (s == 2) {
+          return;
+        }
+        for (int u = t; u < t + nt; ++u, out += strides[s]) {
+          const size_t row = static_cast<size_t>(pos[u]) * (head_dim / 2);
+          RotatePairs(out, bb - bounds[s], be - bounds[s], cos_table + row,
+                      sin_table + row, head_dim);
+        }
+      });
+    }
+  });
+}
+
+void GemmSwiGLU(float* out, const float* in, int n, const Matrix& w) {
+  const int ffn_dim = w.rows / 2;
+  const Activation* x = PrepareActivations(in, n, w);
+  ParallelFor(ffn_dim, GemmGrain(w.cols, n), [&](int begin, int end) {
+    float block[kGemmBlockTokens][2 * kGemmBlockRows];
+    ForEachBlock(begin, end, n, [&](int t, int nt, int b, int e) {
+      GemmRows(block[0], 2 * kGemmBlockRows, x + t, nt, w, 2 * b, 2 * (e - b));
+      for (int u = 0; u < nt; ++u) {
+        float* out_u = out + static_cast<size_t>(t + u) * ffn_dim;
+        for (int r = 0; r < e - b; ++r) {
+          out_u[b + r] = SiLU(block[u][2 * r]) * block[u][2 * r + 1];
+        }
+      }
+    });
+  });
+}
+
+/* ---------------------------------  /
+               Top-K GEMV
+/  --------------------------------- */
+
+// Rows computed per kernel call before their outputs are folded into the
+// running top-k; small enough for the outputs to stay in L1.
+static constexpr int kTopKBlockRows = 64;
+
+// Order of the top-k list: larger value first, then lower row.
+static inline bool Better(const Logit& lhs, const Logit& rhs) {
+  return lhs.value > rhs.value || (lhs.value == rhs.value && lhs.id < rhs.id);
+}
+
+// Running top-k kept as a heap whose front is the worst entry.
+struct TopKHeap {
+  Logit* data;
+  int k;
+  int size = 0;
+
+  void Push(const Logit& logit) {
+    if (size < k) {
+      data[size++] = logit;
+      std::push_heap(data, data + size, Better);
+    } else if (Better(logit, data[0])) {
+      std::pop_heap(data, data + size, Better);
+      data[size - 1] = logit;
+      std::push_heap(data, data + size, Better);
+    }
+  }
+};
+
+// Fold the products of rows begin..end into the running top-k.
+static void TopKRows(TopKHeap& heap, const Activation& x, const Matrix& w,
+                     int begin, int end) {
+  float block[kTopKBlockRows];
+  for (int i = begin; i < end; i += kTopKBlockRows) {
+    int n = std::min(kTopKBlockRows, end - i);
+    GemvRows(block, x, w, i, n);
+    for (int r = 0; r < n; ++r) {
+      // Rejecting against the current worst entry first keeps the common
+      // case to a single compare.
+      if (heap.size == heap.k && block[r] < heap.data[0].value) {
+        continue;
+      }
+      heap.Push({i + r, block[r]});
+    }
+  }
+}
+
+int GemvTopK(Logit* top, int k, const float* in, const Matrix& w) {
+  const int begin = 0;
+  const int end = w.rows;
+  return GemvTopKRanges(top, k, in, w, &begin, &end, 1);
+}
+
+int GemvTopKRanges(Logit* top, int k, const float* in, const Matrix& w,
+                   const int* begins, const int* ends, int num_ranges) {
+  int rows = 0;
+  for (int r = 0; r < num_ranges; ++r) {
+    rows += ends[r] - begins[r];
+  }
+  k = std::min({k, kMaxTopK, rows});
+  TopKHeap result{top, k};
+  if (k <= 0) {
+    return 0;
+  }
+  std::mutex result_mutex;
+  const Activation x = PrepareActivation(in, w);
+
+  // Split the concatenated ranges like the rows of a single matrix.
+  ParallelFor(rows, GemvGrain(w.cols), [&](int begin, int end) {
+    Logit local_data[kMaxTopK];
+    TopKHeap local{local_data, k};
+    int offset = 0;
+    for (int r = 0; r < num_ranges && offset < end; ++r) {
+      const int size = ends[r] - begins[r];
+      const int b = std::max(begin, offset);
+      const int e = std::min(end, offset + size);
+      if (b < e) {
+        TopKRows(local, x, w, begins[r] + b - offset, begins[r] + e - offset);
+      }
+      offset += size;
+    }
+    std::lock_guard<std::mutex> lock(result_mutex);
+    for (int r = 0; r < local.size; ++r) {
+      result.Push(local.data[r]);
+    }
+  });
+
+  std::sort_heap(top, top + result.size, Better);
+  return result.size;
+}
+
+int TopK(Logit* top, int k, const float* values, int n) {
+  TopKHeap result{top, std::min(k, n)};
+  if (result.k <= 0) {
+    return 0;
+  }
+  for (int i = 0; i < n; ++i) {
+    if (result.size == result.k && values[i] < top[0].value) {
+      continue;
+    }
+    result.Push({i, values[i]});
+  }
+  std::sort_heap(top, top + result.size, Better);
+  return result.size;
+}
+
+} // namespace swan
@@ -0,0 +1,245 @@
+#ifndef TENSOR_CPU_HPP_
+#define TENSOR_CPU_HPP_
+
+#include <cassert>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "tensor.hpp"
+
+namespace swan {
+
+// Select the CPU kernel set: "auto" picks the widest instruction set the
+// host supports, otherwise one of "scalar", "avx2", "avx512", "avx512vnni"
+// or "neon".
+// Returns false if the name is unknown or the host does not support it.
+bool SelectCPUKernels(const std::string& name);
+const char* CPUKernelName();
+
+// Storage format of a weight matrix used by the CPU kernels.
+enum class WeightFormat {
+  kF32,  // fp32
+  kF16,  // IEEE half
+  kBF16, // bfloat16, the upper half of an fp32
+  kQ8,   // int8, symmetric, one fp32 scale per kQuantGroup columns of a row
+  kQ4,   // 4-bit, symmetric, packed two per byte, one fp16 scale per group
+};
+
+// Columns sharing one scale in the quantized formats.
+constexpr int kQuantGroup = 32;
+
+// Parse "f32", "f16", "bf16", "q8" or "q4".
+// Returns false if the name is unknown.
+bool ParseWeightFormat(const std::string& name, WeightFormat& format);
+const char* WeightFormatName(WeightFormat format);
+
+// Storage format of the KV cache.
+enum class KVFormat {
+  kF32, // fp32
+  kQ8,  // int8, symmetric, one fp32 scale per KV head and position
+};
+
+// Parse "f32" or "q8". Returns false if the name is unknown.
+bool ParseKVFormat(const std::string& name, KVFormat& format);
+const char* KVFormatName(KVFormat format);
+
+// Cached keys or values of one layer as read by Attention.
+// Positions are stored in pages of page_len, listed in order by pages.
+// Within a page the positions of each KV head form one block, stored
+// either as [page_len, head_dim] or, for values only, transposed as
+// [head_dim, page_len].
+struct KVView {
+  KVFormat format = KVFormat::kF32;
+  const void* data = nullptr;    // layer of page p at p * page_stride
+  const float* scales = nullptr; // kQ8 only, [page][kv_head, page_len]
+  const int* pages = nullptr;    // page of positions i * page_len..
+  int page_len = 0;
+  size_t page_stride = 0;
+  size_t scale_page_stride = 0;
+  size_t head_stride = 0; // block of KV head h at h * head_stride
+  size_t scale_stride = 0;
+  bool transposed = false;
+};
+
+// Read-only view of a row-major weight matrix.
+// Quantized rows are zero padded to a whole number of groups.
+struct Matrix {
+  WeightFormat format = WeightFormat::kF32;
+  int rows = 0;
+  int cols = 0;
+  const void* data = nullptr;   // [rows, stride]
+  const void* scales = nullptr; // [rows, groups], quantized formats only
+};
+
+// Storage of a matrix converted at load time.
+struct MatrixBuffer {
+  std::vector<uint8_t> data;
+  std::vector<uint8_t> scales;
+};
+
+// View an fp32 matrix in place.
+Matrix F32Matrix(const float* w, int rows, int cols);
+
+// Allocate buffer for a rows x cols matrix in format and return its view.
+// The rows are filled with SetMatrixRow.
+Matrix AllocMatrix(MatrixBuffer& buffer, WeightFormat format, int rows,
+                   int cols);
+
+// Convert cols fp32 values into the given row of a matrix from AllocMatrix.
+void SetMatrixRow(MatrixBuffer& buffer, const Matrix& m, int row,
+                  const float* src);
+
+// Decode the given row of any matrix back to cols fp32 values.
+void GetMatrixRow(const Matrix& m, int row, float* dst);
+
+// Copy the given n rows of m, in that order, into a new matrix of the same
+// format backed by buffer. The rows are copied as stored, so nothing is
+// requantized.
+Matrix GatherRows(MatrixBuffer& buffer, const Matrix& m, const int* rows,
+                  int n);
+
+// Compute a row-major matrix-vector product with the selected kernel set.
+// Rows are split across the thread pool. For quantized matrices the input
+// is quantized to int8 in groups of kQuantGroup first, and the products are
+// accumulated in integers.
+// out[i] = w[i,j] . in[j]
+// i = 0..rows
+// j = 0..cols
+void Gemv(float* out, const float* in, const Matrix& w);
+
+// Compute q, k and v of one token with a single pass over the stacked
+// [dim + 2 * kv_dim, dim] projection, and apply the rotary position
+// encoding to q and k while each chunk of rows is still in cache.
+// cos_vec and sin_vec hold head_dim / 2 entries for the current position.
+// KV head h of k and v is written at k + h * k_stride and v + h * v_stride,
+// e.g. straight into the slots of one position in a head-major KV cache;
+// strides of head_dim keep them contiguous.
+void GemvQKVStrided(float* q, float* k, size_t k_stride, float* v,
+                    size_t v_stride, const float* in, const Matrix& w,
+                    int kv_dim, const float* cos_vec, const float* sin_vec,
+                    int head_dim);
+
+// Compute the SwiGLU gated activation of the FFN in one pass.
+// out[i] = SiLU(w1[i] . in) * (w3[i] . in)
+// w holds the rows of w1 and w3 interleaved as [2 * ffn_dim, dim]; the two
+// projections are consumed from a small per-thread block, so neither is
+// written out in full.
+void GemvSwiGLU(float* out, const float* in, const Matrix& w);
+
+// Row index and value of one matrix-vector product output.
+struct Logit {
+  int id;
+  float value;
+};
+
+// Largest k supported by GemvTopK.
+constexpr int kMaxTopK = 256;
+
+// Compute the same product as Gemv but keep only the k largest outputs,
+// sorted by descending value with ties going to the lower row. The rows are
+// reduced block by block on each thread, so the full output vector is never
+// written. Returns min(k, rows).
+int GemvTopK(Logit* top, int k, const float* in, const Matrix& w);
+
+// Same as GemvTopK over the rows begins[r]..ends[r] of w only, for
+// r = 0..num_ranges. The ranges are split across the thread pool as one.
+int GemvTopKRanges(Logit* top, int k, const float* in, const Matrix& w,
+                   const int* begins, const int* ends, int num_ranges);
+
+// Select the k largest of n values already written out, in the order of
+// GemvTopK. k is not limited to kMaxTopK. Returns min(k, n).
+int TopK(Logit* top, int k, const float* values, int n);
+
+// Compute the products of Gemv for a batch of n tokens.
+// in is [n, cols] and out is [n, rows]. The rows are split across the
+// thread pool and walked in small blocks, each used by every token before
+// the next is loaded, so the weights are read from memory once per batch.
+void Gemm(float* out, const float* in, int n, const Matrix& w);
+
+// GemvQKVStrided with contiguous heads for a batch of n tokens, token t at
+// position pos[t].
+// q is [n, dim], k and v are [n, kv_dim]. cos_table and sin_table hold
+// head_dim / 2 entries per position, from position 0.
+void GemmQKV(float* q, float* k, float* v, const float* in, int n,
+             const Matrix& w, int kv_dim, const float* cos_table,
+             const float* sin_table, const int* pos, int head_dim);
+
+// GemvSwiGLU for a batch of n tokens. out is [n, ffn_dim].
+void GemmSwiGLU(float* out, const float* in, int n, const Matrix& w);
+
+// Compute the attention scores of one head against n cached keys stored
+// contiguously as [n, head_dim].
+// out[t] = k[t,j] . q[j]
+void AttentionScores(float* out, const float* q, const float* k, int n,
+                     int head_dim);
+
+// Compute the attention output of one head from n cached values stored
+// contiguously as [n, head_dim].
+// out[j] = p[t] . v[t,j]
+void AttentionValues(float* out, const float* p, const float* v, int n,
+                     int head_dim);
+
+// Same as AttentionValues with the values stored transposed as
+// [head_dim, stride]; only the first n columns of each row are read.
+void AttentionValuesT(float* out, const float* p, const float* vt, int n,
+                      int head_dim, int stride);
+
+// Compute Softmax(k . q * scale) . v for every head of one layer over
+// n > 0 cached positions, on the thread pool.
+// q and out are [num_heads, head_dim]; query head h reads KV head
+// h / (num_heads / num_kv_heads). Each head makes one pass over the pages of
+// its KV head with an online softmax. Once there are fewer heads than threads,
+// long sequences are also split into chunks whose outputs are merged by
+// their log-sum-exp.
+void Attention(float* out, const float* q, const KVView& k, const KVView& v,
+               int n, int num_heads, int num_kv_heads, int head_dim,
+               float scale);
+
+// Scaled scores qk = k . q * scale and their softmax sm of one head over
+// n cached positions of KV head kv_head, as Attention computes them but
+// never writes out; for tracing.
+void AttentionProbs(float* qk, float* sm, const float* q, const KVView& k,
+                    int kv_head, int n, int head_dim, float scale);
+
+// Compute the matrix multiplication of two input tensors.
+// Same as Matmul but vectorized with the selected kernel set.
+template <size_t Rows, size_t Cols>
+void MatmulCPU(float (&out)[Rows], const float (&in)[Cols], const Matrix& w) {
+  assert(w.rows == static_cast<int>(Rows) &&
+         w.cols == static_cast<int>(Cols));
+  Gemv(out, in, w);
+}
+
+// Compute the matrix multiplication of two input tensors.
+// Same as MutmulVocab but vectorized with the selected kernel set.
+template <size_t VocabSize, size_t Dim>
+void MutmulVocabCPU(float (&out)[VocabSize], const float (&in)[Dim],
+                    const Matrix& w) {
+  assert(w.rows == static_cast<int>(VocabSize) &&
+         w.cols == static_cast<int>(Dim));
+  Gemv(out, in, w);
+}
+
+// Compute SiLU(w1 . x) * (w3 . x) over the interleaved w1/w3 rows.
+// Same as two Matmul calls, SiLU and Mul.
+template <size_t FFNDim, size_t Dim>
+void MatmulSwiGLUCPU(float (&out)[FFNDim], const float (&in)[Dim],
+                     const Matrix& w) {
+  assert(w.rows == static_cast<int>(2 * FFNDim) &&
+         w.cols == static_cast<int>(Dim));
+  GemvSwiGLU(out, in, w);
+}
+
+// Compute the k most likely tokens without materializing the logits.
+// Fused version of MutmulVocabCPU followed by a top-k selection.
+template <size_t Dim>
+int MutmulVocabTopKCPU(Logit* top, int k, const float (&in)[Dim],
+                       const Matrix& w) {
+  assert(w.cols == static_cast<int>(Dim));
+  return GemvTopK(top, k, in, w);
+}
+
+} // namespace swan
+
+#endif // TENSOR_CPU_HPP_
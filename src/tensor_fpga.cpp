@@ -176,6 +176,49 @@ void MatmulFPGA(Tensor1d& out, const Tensor1dFFNB& in, const Tensor2dFFNB& w,
   }
 }
 
+// Compute the fused q/k/v projection and apply RoPE to q and k.
+// Tensor1d [dim] . Tensor2dQKV [3 * dim, dim] = q, k, v [dim]
+// The three projections share one kernel launch; the rotation is applied
+// on the host while the result is copied out, so kernel_rope is not needed.
+void MatmulQKVFPGA(Tensor1d& q_out, Tensor1d& k_out, Tensor1d& v_out,
+                   const Tensor1d& in, const Tensor2dQKV& w,
+                   const Tensor1dSinCos& cos_vec, const Tensor1dSinCos& sin_vec,
+                   cl::CommandQueue q, cl::Kernel kernel_matmul, float* ptr_a,
+                   float* ptr_b, float* ptr_result, cl::Buffer buffer_a,
+                   cl::Buffer buffer_b, cl::Buffer buffer_result) {
+  for (int i = 0; i < kDim; i++) {
+    ptr_a[i] = in[i];
+  }
+  for (int i = 0; i < kQKVDim; i++) {
+    for (int j = 0; j < kDim; j++) {
+      ptr_b[i * kDim + j] = w[i][j];
+    }
+  }
+  q.enqueueMigrateMemObjects({buffer_a, buffer_b}, 0);
+  kernel_matmul.setArg(3, kDim);
+  kernel_matmul.setArg(4, kQKVDim);
+  q.enqueueTask(kernel_matmul);
+  q.enqueueMigrateMemObjects({buffer_result}, CL_MIGRATE_MEM_OBJECT_HOST);
+  q.finish();
+  for (int i = 0; i < kDim; i += 2) {
+    float cos = cos_vec[(i % kHeadDim) / 2];
+    float sin = sin_vec[(i % kHeadDim) / 2];
+
+    float q0 = ptr_result[i];
+    float q1 = ptr_result[i + 1];
+    q_out[i] = q0 * cos - q1 * sin;
+    q_out[i + 1] = q0 * sin + q1 * cos;
+
+    float k0 = ptr_result[kDim + i];
+    float k1 = ptr_result[kDim + i + 1];
+    k_out[i] = k0 * cos - k1 * sin;
+    k_out[i + 1] = k0 * sin + k1 * cos;
+  }
+  for (int i = 0; i < kDim; i++) {
+    v_out[i] = ptr_result[2 * kDim + i];
+  }
+}
+
 /* ---------------------------------  /
       Normalization Operations
 /  --------------------------------- */
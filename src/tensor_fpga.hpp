@@ -14,6 +14,24 @@
 
 namespace swan {
 
+// The FPGA kernels are synthesized for the stories15M shape.
+using FPGAShape = Stories15M;
+
+constexpr int kDim = FPGAShape::kDim;
+constexpr int kFFNDim = FPGAShape::kFFNDim;
+constexpr int kSeqLen = FPGAShape::kSeqLen;
+constexpr int kHeadDim = FPGAShape::kHeadDim;
+constexpr int kQKVDim = FPGAShape::kQKVDim;
+
+using Tensor1d = FPGAShape::Tensor1d;
+using Tensor2dAttn = FPGAShape::Tensor2dAttn;
+using Tensor2dQKV = FPGAShape::Tensor2dQKV;
+using Tensor1dSinCos = FPGAShape::Tensor1dSinCos;
+using Tensor2dFFNA = FPGAShape::Tensor2dFFNA;
+using Tensor1dFFNB = FPGAShape::Tensor1dFFNB;
+using Tensor2dFFNB = FPGAShape::Tensor2dFFNB;
+using Tensor1dQKSM = FPGAShape::Tensor1dQKSM;
+
 void AddFPGA(Tensor1d& out, const Tensor1d& in, float a, cl::CommandQueue q,
              cl::Kernel kernel_add, float* ptr_a, float* ptr_b,
              float* ptr_result, cl::Buffer buffer_a, cl::Buffer buffer_b,
@@ -44,6 +62,12 @@ void MatmulFPGA(Tensor1d& out, const Tensor1dFFNB& in, const Tensor2dFFNB& w,
                 cl::CommandQueue q, cl::Kernel kernel_matmul, float* ptr_a,
                 float* ptr_b, float* ptr_result, cl::Buffer buffer_a,
                 cl::Buffer buffer_b, cl::Buffer buffer_result);
+void MatmulQKVFPGA(Tensor1d& q_out, Tensor1d& k_out, Tensor1d& v_out,
+                   const Tensor1d& in, const Tensor2dQKV& w,
+                   const Tensor1dSinCos& cos_vec, const Tensor1dSinCos& sin_vec,
+                   cl::CommandQueue q, cl::Kernel kernel_matmul, float* ptr_a,
+                   float* ptr_b, float* ptr_result, cl::Buffer buffer_a,
+                   cl::Buffer buffer_b, cl::Buffer buffer_result);
 
 void RMSNormFPGA(Tensor1d& out, const Tensor1d& in, const Tensor1d& w,
                  cl::CommandQueue q, cl::Kernel kernel_rmsnorm, float* ptr_a,
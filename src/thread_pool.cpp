@@ -0,0 +1,202 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace swan {
+
+// Polls of the job counter before an idle worker parks on the condition
+// variable. Decode issues its matmuls a few microseconds apart, so a short
+// spin catches the next one without a wake-up, while an idle pool still
+// sleeps.
+static constexpr int kSpinCount = 1 << 14;
+
+// Shared state of the pool. A job is published by bumping generation; each
+// worker runs its chunk and decrements pending.
+struct ThreadPool {
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::atomic<uint64_t> generation{0};
+  std::atomic<int> sleepers{0};
+  std::atomic<int> pending{0};
+  std::atomic<bool> busy{false};
+  bool stop = false;
+
+  // Current job, written by the caller before generation is bumped.
+  ParallelTask task = nullptr;
+  const void* arg = nullptr;
+  int n = 0;
+  int chunk = 0;
+
+  ~ThreadPool() { ShutdownThreadPool(); }
+};
+
+static ThreadPool pool;
+
+static inline void CPURelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// CPUs this process may run on, in ascending order.
+static std::vector<int> AllowedCPUs() {
+  std::vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+#endif
+  if (cpus.empty()) {
+    int n = std::max(1u, std::thread::hardware_concurrency());
+    for (int cpu = 0; cpu < n; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+static void PinThread(pthread_t thread, int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(thread, sizeof(set), &set);
+#else
+  (void)thread;
+  (void)cpu;
+#endif
+}
+
+static void RunChunk(int index) {
+  int begin = index * pool.chunk;
+  if (begin < pool.n) {
+    pool.task(pool.arg, begin, std::min(pool.n, begin + pool.chunk));
+  }
+}
+
+// Spin on the job counter for a while, then park until it moves past seen.
+static uint64_t WaitForJob(uint64_t seen) {
+  for (int spin = 0; spin < kSpinCount; ++spin) {
+    uint64_t generation = pool.generation.load(std::memory_order_acquire);
+    if (generation != seen) {
+      return generation;
+    }
+    // Give the core away now and then in case the pool is oversubscribed.
+    (spin & 255) == 255 ? std::this_thread::yield() : CPURelax();
+  }
+  std::unique_lock<std::mutex> lock(pool.mutex);
+  pool.sleepers.fetch_add(1);
+  pool.wake.wait(lock, [&] { return pool.generation.load() != seen; });
+  pool.sleepers.fetch_sub(1);
+  return pool.generation.load(std::memory_order_acquire);
+}
+
+static void WorkerLoop(int index, uint64_t seen) {
+  for (;;) {
+    seen = WaitForJob(seen);
+    if (pool.stop) {
+      return;
+    }
+    RunChunk(index);
+    pool.pending.fetch_sub(1, std::memory_order_acq_rel);
+  }
+}
+
+// Publish the current job to every worker. sleepers is checked after the
+// bump so a worker about to park either sees the new generation or is woken.
+static void NotifyWorkers() {
+  pool.generation.fetch_add(1);
+  if (pool.sleepers.load() > 0) {
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.wake.notify_all();
+  }
+}
+
+int InitThreadPool(int num_threads, bool pin) {
+  ShutdownThreadPool();
+
+  std::vector<int> cpus = AllowedCPUs();
+  if (num_threads <= 0) {
+    num_threads = cpus.size();
+  }
+
+  if (pin) {
+    PinThread(pthread_self(), cpus[0]);
+  }
+  for (int i = 1; i < num_threads; ++i) {
+    pool.workers.emplace_back(WorkerLoop, i, pool.generation.load());
+    if (pin) {
+      PinThread(pool.workers.back().native_handle(), cpus[i % cpus.size()]);
+    }
+  }
+  return num_threads;
+}
+
+void ShutdownThreadPool() {
+  if (pool.workers.empty()) {
+    return;
+  }
+  pool.stop = true;
+  NotifyWorkers();
+  for (std::thread& worker : pool.workers) {
+    worker.join();
+  }
+  pool.workers.clear();
+  pool.stop = false;
+}
+
+int ThreadPoolSize() {
+  return pool.workers.size() + 1;
+}
+
+void ParallelRun(int n, int grain, ParallelTask task, const void* arg) {
+  const int num_threads = ThreadPoolSize();
+  if (num_threads == 1 || n <= grain ||
+      pool.busy.exchange(true, std::memory_order_acquire)) {
+    task(arg, 0, n);
+    return;
+  }
+
+  // Spread the grains evenly over the participants.
+  const int grains = (n + grain - 1) / grain;
+  const int chunks = std::min(num_threads, grains);
+  pool.task = task;
+  pool.arg = arg;
+  pool.n = n;
+  pool.chunk = (grains + chunks - 1) / chunks * grain;
+  pool.pending.store(pool.workers.size(), std::memory_order_relaxed);
+  NotifyWorkers();
+
+  RunChunk(0);
+  for (int spin = 1; pool.pending.load(std::memory_order_acquire) > 0;
+       ++spin) {
+    (spin & 255) == 0 ? std::this_thread::yield() : CPURelax();
+  }
+  pool.busy.store(false, std::memory_order_release);
+}
+
+} // namespace swan
@@ -0,0 +1,37 @@
+#ifndef THREAD_POOL_HPP_
+#define THREAD_POOL_HPP_
+
+namespace swan {
+
+// Task run by each participant of ParallelFor on the range [begin, end).
+using ParallelTask = void (*)(const void* arg, int begin, int end);
+
+// Start the persistent worker pool. num_threads counts the calling thread,
+// so 1 runs everything inline and 0 uses every CPU the process may run on.
+// With pin each participant is bound to its own CPU. Returns the number of
+// participants.
+int InitThreadPool(int num_threads, bool pin);
+void ShutdownThreadPool();
+int ThreadPoolSize();
+
+// Split [0, n) into at most ThreadPoolSize() contiguous chunks whose
+// boundaries are multiples of grain and run them on the pool; the caller
+// runs the first chunk and returns once every chunk is done. Participant i
+// always receives chunk i, so repeated calls over the same range touch the
+// same rows from the same core. Runs inline when the pool is already busy.
+void ParallelRun(int n, int grain, ParallelTask task, const void* arg);
+
+// Same as ParallelRun but takes any callable f(begin, end).
+template <class F>
+void ParallelFor(int n, int grain, const F& f) {
+  ParallelRun(
+      n, grain,
+      [](const void* arg, int begin, int end) {
+        (*static_cast<const F*>(arg))(begin, end);
+      },
+      &f);
+}
+
+} // namespace swan
+
+#endif // THREAD_POOL_HPP_
@@ -4,6 +4,9 @@
 
 namespace swan {
 
+// Id of the first byte fallback token <0x00>, after <unk>, <s> and </s>.
+static constexpr int kByteTokenBase = 3;
+
 // ResizeVocab resizes the vocab to the given size.
 void ResizeVocab(Vocab& vocab, int vocab_size) {
   vocab.dict.resize(vocab_size);
@@ -11,6 +14,7 @@ void ResizeVocab(Vocab& vocab, int vocab_size) {
 
 // LoadVocab loads the vocab from the given file.
 void LoadVocab(Vocab& vocab, std::ifstream& fs) {
+  vocab.ids.clear();
   for (size_t i = 0; i < vocab.dict.size(); i++) {
     int len;
     vocab.dict.at(i) = "";
@@ -20,8 +24,65 @@ void LoadVocab(Vocab& vocab, std::ifstream& fs) {
       fs.read((char*)&c, sizeof(char));
       vocab.dict.at(i).push_back(c);
     }
+    vocab.ids.emplace(vocab.dict.at(i), i);
     vocab.dict.at(i).push_back('\0');
   }
 }
 
+// Encode splits the text into UTF-8 characters and then merges adjacent
+// tokens, byte-pair style, for as long as their concatenation is a piece
+// of the vocab. The tokenizer file carries no merge scores, so the pair
+// whose merged piece has the lowest id goes first; SentencePiece vocabs
+// are sorted by score, which makes this their merge order. Characters
+// that are not in the vocab fall back to one byte token per byte.
+std::vector<int> Encode(const Vocab& vocab, const std::string& text) {
+  std::vector<int> tokens;
+  if (text.empty()) {
+    return tokens;
+  }
+
+  // SentencePiece prepends a space so the first word gets its word-initial
+  // piece.
+  const std::string input = " " + text;
+  for (size_t i = 0; i < input.size();) {
+    size_t len = 1;
+    while (i + len < input.size() && (input[i + len] & 0xC0) == 0x80 &&
+           len < 4) {
+      ++len;
+    }
+    auto it = vocab.ids.find(input.substr(i, len));
+    if (it != vocab.ids.end()) {
+      tokens.push_back(it->second);
+    } else {
+      for (size_t j = i; j < i + len; ++j) {
+        int id = kByteTokenBase + static_cast<unsigned char>(input[j]);
+        tokens.push_back(id < static_cast<int>(vocab.dict.size()) ? id : 0);
+      }
+    }
+    i += len;
+  }
+
+  for (;;) {
+    int best_id = -1;
+    size_t best_idx = 0;
+    for (size_t i = 0; i + 1 < tokens.size(); ++i) {
+      const std::string& lhs = vocab.dict.at(tokens[i]);
+      const std::string& rhs = vocab.dict.at(tokens[i + 1]);
+      // Drop the terminating '\0' kept for printing.
+      auto it = vocab.ids.find(lhs.substr(0, lhs.size() - 1) +
+                               rhs.substr(0, rhs.size() - 1));
+      if (it != vocab.ids.end() && (best_id < 0 || it->second < best_id)) {
+        best_id = it->second;
+        best_idx = i;
+      }
+    }
+    if (best_id < 0) {
+      break;
+    }
+    tokens[best_idx] = best_id;
+    tokens.erase(tokens.begin() + best_idx + 1);
+  }
+  return tokens;
+}
+
 } // namespace swan
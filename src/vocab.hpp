@@ -3,17 +3,22 @@
 
 #include <fstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace swan {
 
 struct Vocab {
   std::vector<std::string> dict;
+  std::unordered_map<std::string, int> ids; // piece -> lowest id
 };
 
 void ResizeVocab(Vocab& vocab, int vocab_size);
 void LoadVocab(Vocab& vocab, std::ifstream& fs);
 
+// Encode text into token ids, without BOS.
+std::vector<int> Encode(const Vocab& vocab, const std::string& text);
+
 } // namespace swan
 
 #endif // VOCAB_HPP_
@@ -1,5 +1,12 @@
 #include "weight.hpp"
 
+#include <cmath>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace swan {
 
 // Implement for initializing the tensor from the file.
@@ -27,14 +34,20 @@ void InitTensor(T (&tensor)[Outer][Middle][Inner], std::ifstream& fs) {
   }
 }
 
+// Read the model hyper parameters from the checkpoint header.
+void ReadConfig(Config& config, std::ifstream& fs) {
+  fs.read(reinterpret_cast<char*>(&config), sizeof(config));
+}
+
 // Implement for initializing the tensor from the file.
-void LoadWeights(Weights& w, Tensor2dTok& tok_emb_table, std::ifstream& fs) {
-  fs.read(w.dummy, sizeof(w.dummy)); // Dummy variable for alignment
-  InitTensor(tok_emb_table, fs);     // [kVocabSize, kDim]
+template <class S>
+void LoadWeights(Weights<S>& w, std::ifstream& fs) {
+  ReadConfig(w.config, fs);          // Model hyper parameters
+  InitTensor(w.tok_emb_table, fs);   // [kVocabSize, kDim]
   InitTensor(w.rms_att_w, fs);       // [kNumLayers, kDim]
   InitTensor(w.attn_wq, fs);         // [kNumLayers, kDim, kDim]
-  InitTensor(w.attn_wk, fs);         // [kNumLayers, kDim, kDim]
-  InitTensor(w.attn_wv, fs);         // [kNumLayers, kDim, kDim]
+  InitTensor(w.attn_wk, fs);         // [kNumLayers, kKVDim, kDim]
+  InitTensor(w.attn_wv, fs);         // [kNumLayers, kKVDim, kDim]
   InitTensor(w.attn_wo, fs);         // [kNumLayers, kDim, kDim]
   InitTensor(w.rms_ffn_w, fs);       // [kNumLayers, kDim]
   InitTensor(w.ffn_w1, fs);          // [kNumLayers, kFFNDim, kDim]
@@ -45,4 +58,174 @@ void LoadWeights(Weights& w, Tensor2dTok& tok_emb_table, std::ifstream& fs) {
   InitTensor(w.sin_table, fs);       // [kSeqLen, kSinCosTable]
 }
 
+#define SWAN_INSTANTIATE_LOAD_WEIGHTS(S) \
+  template decltype(LoadWeights<S>) LoadWeights<S>;
+SWAN_MODEL_SHAPES(SWAN_INSTANTIATE_LOAD_WEIGHTS)
+#undef SWAN_INSTANTIATE_LOAD_WEIGHTS
+
+// Squared norms accumulated while converting matrices.
+struct ConvertError {
+  double diff = 0; // |converted - fp32|^2
+  double norm = 0; // |fp32|^2
+};
+
+// Convert rows x cols fp32 rows into a new matrix of the given format.
+// row(i) returns the source of row i. Each row is decoded again to measure
+// the conversion error.
+template <class RowFn>
+Matrix ConvertMatrix(std::vector<MatrixBuffer>& buffers, ConvertError& error,
+                     WeightFormat format, int rows, int cols, RowFn row) {
+  MatrixBuffer& buffer = buffers.emplace_back();
+  Matrix m = AllocMatrix(buffer, format, rows, cols);
+  std::vector<float> decoded(cols);
+  for (int i = 0; i < rows; ++i) {
+    const float* src = row(i);
+    SetMatrixRow(buffer, m, i, src);
+    GetMatrixRow(m, i, decoded.data());
+    for (int j = 0; j < cols; ++j) {
+      double d = decoded[j] - src[j];
+      error.diff += d * d;
+      error.norm += static_cast<double>(src[j]) * src[j];
+    }
+  }
+  return m;
+}
+
+// Use an fp32 matrix in place, or convert it to the given format.
+template <size_t Rows, size_t Cols>
+Matrix ConvertMatrix(std::vector<MatrixBuffer>& buffers, ConvertError& error,
+                     WeightFormat format, const float (&w)[Rows][Cols]) {
+  if (format == WeightFormat::kF32) {
+    return F32Matrix(&w[0][0], Rows, Cols);
+  }
+  return ConvertMatrix(buffers, error, format, Rows, Cols,
+                       [&](int i) { return w[i]; });
+}
+
+// Scale row src [cols] by gain[j] per column and by scale overall into
+// dst, for an RMSNorm gain folded into the projection it feeds:
+// (x * norm * gain) . row = (x * norm) . (row * gain).
+// Returns src itself if gain is nullptr and scale is 1.
+static const float* FoldRow(std::vector<float>& dst, const float* src,
+                            const float* gain, float scale) {
+  if (!gain && scale == 1) {
+    return src;
+  }
+  for (size_t j = 0; j < dst.size(); ++j) {
+    dst[j] = src[j] * (gain ? gain[j] : 1) * scale;
+  }
+  return dst.data();
+}
+
+// Build the derived weights of the model from the checkpoint.
+template <class S>
+void PackModel(Model<S>& model, const Weights<S>& w, WeightFormat format,
+               bool fold_norm) {
+  model.w = &w;
+  model.buffers.clear();
+  // The matrices keep pointers into the buffers, so never reallocate.
+  model.buffers.reserve(4 * S::kNumLayers + 1);
+  ConvertError error;
+
+  for (int layer = 0; layer < S::kNumLayers; ++layer) {
+#ifndef USE_CPU_ONLY
+    auto& wqkv = model.attn_wqkv[layer];
+    for (int i = 0; i < S::kDim; ++i) {
+      CopyTensor1d(wqkv[i], w.attn_wq[layer][i]);
+    }
+    for (int i = 0; i < S::kKVDim; ++i) {
+      CopyTensor1d(wqkv[S::kDim + i], w.attn_wk[layer][i]);
+      CopyTensor1d(wqkv[S::kDim + S::kKVDim + i], w.attn_wv[layer][i]);
+    }
+#else
+    const float* att_gain = fold_norm ? w.rms_att_w[layer] : nullptr;
+    const float* ffn_gain = fold_norm ? w.rms_ffn_w[layer] : nullptr;
+    const float q_scale = fold_norm ? 1 / std::sqrt(S::kHeadDim) : 1;
+    std::vector<float> row(S::kDim);
+    model.wqkv[layer] = ConvertMatrix(
+        model.buffers, error, format, S::kQKVDim, S::kDim, [&](int i) {
+          if (i < S::kDim) {
+            return FoldRow(row, w.attn_wq[layer][i], att_gain, q_scale);
+          }
+          i -= S::kDim;
+          return FoldRow(row,
+                         i < S::kKVDim ? w.attn_wk[layer][i]
+                                       : w.attn_wv[layer][i - S::kKVDim],
+                         att_gain, 1);
+        });
+    model.wo[layer] =
+        ConvertMatrix(model.buffers, error, format, w.attn_wo[layer]);
+    model.w13[layer] = ConvertMatrix(
+        model.buffers, error, format, 2 * S::kFFNDim, S::kDim, [&](int i) {
+          return FoldRow(row,
+                         i % 2 == 0 ? w.ffn_w1[layer][i / 2]
+                                    : w.ffn_w3[layer][i / 2],
+                         ffn_gain, 1);
+        });
+    model.w2[layer] =
+        ConvertMatrix(model.buffers, error, format, w.ffn_w2[layer]);
+#endif
+  }
+#ifdef USE_CPU_ONLY
+  model.fold_norm = fold_norm;
+#else
+  (void)fold_norm;
+#endif
+  model.classifier =
+      ConvertMatrix(model.buffers, error, format, w.tok_emb_table);
+  model.weight_error = error.norm > 0 ? std::sqrt(error.diff / error.norm) : 0;
+}
+
+#define SWAN_INSTANTIATE_PACK_MODEL(S) \
+  template decltype(PackModel<S>) PackModel<S>;
+SWAN_MODEL_SHAPES(SWAN_INSTANTIATE_PACK_MODEL)
+#undef SWAN_INSTANTIATE_PACK_MODEL
+
+// Map the checkpoint file read-only.
+// The pages are shared with every other process mapping the same file.
+// populate prefaults the whole file, lock additionally pins it in RAM.
+// Returns false with errno set on failure.
+bool MapWeightFile(WeightMap& map, const std::string& path, bool populate,
+                   bool lock) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+
+  int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+  if (populate || lock) {
+    flags |= MAP_POPULATE;
+  }
+#endif
+  void* addr = mmap(nullptr, st.st_size, PROT_READ, flags, fd, 0);
+  close(fd); // the mapping keeps its own reference to the file
+  if (addr == MAP_FAILED) {
+    return false;
+  }
+
+  map.addr = addr;
+  map.size = st.st_size;
+  map.locked = lock && mlock(addr, map.size) == 0;
+  return true;
+}
+
+// Release the mapping created by MapWeights.
+void UnmapWeights(WeightMap& map) {
+  if (map.addr == nullptr) {
+    return;
+  }
+  if (map.locked) {
+    munlock(map.addr, map.size);
+  }
+  munmap(map.addr, map.size);
+  map = WeightMap();
+}
+
 } // namespace swan
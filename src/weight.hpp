@@ -1,39 +1,122 @@
 #ifndef WEIGHT_HPP_
 #define WEIGHT_HPP_
 
+#include <cerrno>
+#include <cstddef>
 #include <fstream>
 #include <string>
+#include <vector>
 
 #include "tensor.hpp"
+#include "tensor_cpu.hpp"
 
 namespace swan {
 
+// The members follow the llama2.c checkpoint layout byte for byte, so the
+// structure can be read in one pass or overlaid on a memory mapped file.
+template <class S>
 struct Weights {
-  // Dummy variable for alignment
-  char dummy[28];
+  // Model hyper parameters
+  Config config;
+
+  // Token embedding (shared with the classifier)
+  typename S::Tensor2dTok tok_emb_table; // [vocab_size, dim]
 
   // Attention
-  Tensor2dRMS rms_att_w; // [n_layers, dim]
-  Tensor3dAttn attn_wq;  // [n_layers, dim, dim]
-  Tensor3dAttn attn_wk;  // [n_layers, dim, dim]
-  Tensor3dAttn attn_wv;  // [n_layers, dim, dim]
-  Tensor3dAttn attn_wo;  // [n_layers, dim, dim]
+  typename S::Tensor2dRMS rms_att_w;  // [n_layers, dim]
+  typename S::Tensor3dAttn attn_wq;   // [n_layers, dim, dim]
+  typename S::Tensor3dAttnKV attn_wk; // [n_layers, kv_dim, dim]
+  typename S::Tensor3dAttnKV attn_wv; // [n_layers, kv_dim, dim]
+  typename S::Tensor3dAttn attn_wo;   // [n_layers, dim, dim]
 
   // FFN
-  Tensor2dRMS rms_ffn_w; // [n_layers, dim]
-  Tensor3dFFNA ffn_w1;   // [n_layers, ffn_dim, dim]
-  Tensor3dFFNB ffn_w2;   // [n_layers, dim, ffn_dim]
-  Tensor3dFFNA ffn_w3;   // [n_layers, ffn_dim, dim]
+  typename S::Tensor2dRMS rms_ffn_w; // [n_layers, dim]
+  typename S::Tensor3dFFNA ffn_w1;   // [n_layers, ffn_dim, dim]
+  typename S::Tensor3dFFNB ffn_w2;   // [n_layers, dim, ffn_dim]
+  typename S::Tensor3dFFNA ffn_w3;   // [n_layers, ffn_dim, dim]
 
   // Final rmsnorm
-  Tensor1d rms_final; // [dim]
+  typename S::Tensor1d rms_final; // [dim]
 
   // freq_cis for RoPE relatively positional embeddings
-  Tensor2dSinCos cos_table; // [seq_len, (dim/n_heads)/2]
-  Tensor2dSinCos sin_table; // [seq_len, (dim/n_heads)/2]
+  typename S::Tensor2dSinCos cos_table; // [seq_len, (dim/n_heads)/2]
+  typename S::Tensor2dSinCos sin_table; // [seq_len, (dim/n_heads)/2]
 };
 
-void LoadWeights(Weights& w, Tensor2dTok& tok, std::ifstream& fs);
+static_assert(sizeof(Config) == 28, "Config must match the checkpoint header");
+
+// Weights rearranged at load time for the decode kernels.
+// The checkpoint image itself is left untouched so it can stay mapped.
+template <class S>
+struct Model {
+  const Weights<S>* w = nullptr;
+
+#ifndef USE_CPU_ONLY
+  // attn_wq, attn_wk and attn_wv stacked row-wise, so one pass over the
+  // normalized input yields q, k and v.
+  typename S::Tensor3dQKV attn_wqkv; // [n_layers, dim + 2 * kv_dim, dim]
+#else
+  // Projections used by the CPU kernels, in the format chosen at load time.
+  // fp32 matrices that already have the right layout view the checkpoint.
+  Matrix wqkv[S::kNumLayers]; // [dim + 2 * kv_dim, dim], wq/wk/wv stacked
+  Matrix wo[S::kNumLayers];   // [dim, dim]
+  Matrix w13[S::kNumLayers];  // [2 * ffn_dim, dim], w1/w3 rows interleaved
+  Matrix w2[S::kNumLayers];   // [dim, ffn_dim]
+
+  // rms_att_w and rms_ffn_w are folded into the columns of wqkv and w13,
+  // and the 1/√head_dim attention scale into the wq rows, so Decode only
+  // normalizes.
+  bool fold_norm = false;
+#endif
+
+  // Classifier over the shared token embedding.
+  Matrix classifier; // [vocab_size, dim]
+
+  // Storage of the converted matrices.
+  std::vector<MatrixBuffer> buffers;
+
+  // Relative RMS error of the converted matrices against the fp32
+  // checkpoint, |converted - fp32| / |fp32|. Zero for fp32.
+  double weight_error = 0;
+};
+
+// Read-only mapping of a checkpoint file.
+struct WeightMap {
+  void* addr = nullptr;
+  size_t size = 0;
+  bool locked = false;
+};
+
+void ReadConfig(Config& config, std::ifstream& fs);
+
+template <class S>
+void LoadWeights(Weights<S>& w, std::ifstream& fs);
+
+// With fold_norm (CPU only), fold the RMSNorm gains and the attention
+// scale into the projections, see Model::fold_norm.
+template <class S>
+void PackModel(Model<S>& model, const Weights<S>& w, WeightFormat format,
+               bool fold_norm);
+
+bool MapWeightFile(WeightMap& map, const std::string& path, bool populate,
+                   bool lock);
+void UnmapWeights(WeightMap& map);
+
+// Map the checkpoint and overlay Weights<S> on it.
+// Returns nullptr with errno set on failure.
+template <class S>
+const Weights<S>* MapWeights(WeightMap& map, const std::string& path,
+                             bool populate, bool lock) {
+  if (!MapWeightFile(map, path, populate, lock)) {
+    return nullptr;
+  }
+  if (map.size < sizeof(Weights<S>)) {
+    UnmapWeights(map);
+    errno = EINVAL;
+    return nullptr;
+  }
+  return reinterpret_cast<const Weights<S>*>(map.addr);
+}
 
 } // namespace swan
 
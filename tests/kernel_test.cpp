@@ -0,0 +1,186 @@
+// Compare Gemv and Gemm of every kernel set the host supports against
+// references built from GetMatrixRow, for each weight format and for
+// shapes that are not a multiple of the row blocks or of kQuantGroup.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "tensor_cpu.hpp"
+#include "thread_pool.hpp"
+
+namespace {
+
+const char* const kKernelSets[] = {"scalar", "avx2", "avx512", "avx512vnni",
+                                   "neon"};
+
+const swan::WeightFormat kFormats[] = {
+    swan::WeightFormat::kF32, swan::WeightFormat::kF16,
+    swan::WeightFormat::kBF16, swan::WeightFormat::kQ8,
+    swan::WeightFormat::kQ4};
+
+const int kRows[] = {1, 3, 5, 13, 67, 130};
+const int kCols[] = {5, 32, 33, 70, 288};
+const int kTokens[] = {1, 3, 6};
+
+struct Case {
+  swan::MatrixBuffer buffer;
+  swan::Matrix w;
+  std::vector<float> in;  // [tokens, cols]
+  std::vector<float> ref; // [tokens, rows]
+  std::vector<float> tol; // [tokens, rows]
+  int tokens = 0;
+};
+
+bool IsQuantized(swan::WeightFormat format) {
+  return format == swan::WeightFormat::kQ8 ||
+         format == swan::WeightFormat::kQ4;
+}
+
+// The reference is the exact product of the decoded rows with in. The
+// tolerance covers fp32 summation and, for the quantized formats, rounding
+// the input to int8 per group of kQuantGroup columns.
+void InitCase(Case& c, swan::WeightFormat format, int rows, int cols,
+              int tokens, std::mt19937& rng) {
+  std::uniform_real_distribution<float> uniform(-1, 1);
+  c.w = swan::AllocMatrix(c.buffer, format, rows, cols);
+  std::vector<float> row(cols);
+  for (int i = 0; i < rows; ++i) {
+    for (int j = 0; j < cols; ++j) {
+      row[j] = uniform(rng);
+    }
+    swan::SetMatrixRow(c.buffer, c.w, i, row.data());
+  }
+  c.tokens = tokens;
+  c.in.resize(static_cast<size_t>(tokens) * cols);
+  for (float& x : c.in) {
+    x = uniform(rng);
+  }
+
+  c.ref.assign(static_cast<size_t>(tokens) * rows, 0);
+  c.tol.assign(static_cast<size_t>(tokens) * rows, 0);
+  for (int i = 0; i < rows; ++i) {
+    swan::GetMatrixRow(c.w, i, row.data());
+    for (int t = 0; t < tokens; ++t) {
+      const float* x = c.in.data() + static_cast<size_t>(t) * cols;
+      double sum = 0;
+      double magnitude = 0;
+      double rounding = 0;
+      for (int j = 0; j < cols; ++j) {
+        sum += static_cast<double>(row[j]) * x[j];
+        magnitude += std::abs(row[j] * x[j]);
+        if (IsQuantized(format)) {
+          const int group = j / swan::kQuantGroup * swan::kQuantGroup;
+          const int end = std::min(group + swan::kQuantGroup, cols);
+          float amax = 0;
+          for (int g = group; g < end; ++g) {
+            amax = std::max(amax, std::abs(x[g]));
+          }
+          rounding += std::abs(row[j]) * amax / 127;
+        }
+      }
+      c.ref[static_cast<size_t>(t) * rows + i] = sum;
+      c.tol[static_cast<size_t>(t) * rows + i] =
+          1e-5 * magnitude + rounding + 1e-6;
+    }
+  }
+}
+
+// Returns the number of outputs outside their tolerance, printing the first.
+int Check(const char* what, const char* kernels, const Case& c,
+          const std::vector<float>& out, const std::vector<float>& ref,
+          const std::vector<float>& tol) {
+  int failures = 0;
+  for (size_t i = 0; i < out.size(); ++i) {
+    if (std::isfinite(out[i]) && std::abs(out[i] - ref[i]) <= tol[i]) {
+      continue;
+    }
+    if (failures++ == 0) {
+      std::cout << "FAIL " << what << " " << kernels << " "
+                << swan::WeightFormatName(c.w.format) << " " << c.w.rows
+                << "x" << c.w.cols << " tokens " << c.tokens << " output "
+                << i << ": " << out[i] << " vs " << ref[i] << std::endl;
+    }
+  }
+  return failures;
+}
+
+} // namespace
+
+int main() {
+  // Enough threads to split the larger matrices unevenly.
+  swan::InitThreadPool(3, false);
+
+  std::vector<Case> cases;
+  std::mt19937 rng(1234);
+  for (swan::WeightFormat format : kFormats) {
+    for (int rows : kRows) {
+      for (int cols : kCols) {
+        for (int tokens : kTokens) {
+          cases.emplace_back();
+          InitCase(cases.back(), format, rows, cols, tokens, rng);
+        }
+      }
+    }
+  }
+
+  // Outputs of the scalar kernels, which every other set must reproduce up
+  // to summation order.
+  std::vector<std::vector<float>> scalar_gemv(cases.size());
+  std::vector<std::vector<float>> scalar_gemm(cases.size());
+
+  int failures = 0;
+  int tested = 0;
+  for (const char* kernels : kKernelSets) {
+    if (!swan::SelectCPUKernels(kernels)) {
+      std::cout << kernels << ": not supported, skipped" << std::endl;
+      continue;
+    }
+    int set_failures = 0;
+    for (size_t i = 0; i < cases.size(); ++i) {
+      const Case& c = cases[i];
+      const int rows = c.w.rows;
+      const int cols = c.w.cols;
+
+      // Gemv, one token at a time.
+      std::vector<float> gemv(static_cast<size_t>(c.tokens) * rows);
+      for (int t = 0; t < c.tokens; ++t) {
+        swan::Gemv(gemv.data() + static_cast<size_t>(t) * rows,
+                   c.in.data() + static_cast<size_t>(t) * cols, c.w);
+      }
+      std::vector<float> gemm(gemv.size());
+      swan::Gemm(gemm.data(), c.in.data(), c.tokens, c.w);
+
+      set_failures += Check("gemv", kernels, c, gemv, c.ref, c.tol);
+      set_failures += Check("gemm", kernels, c, gemm, c.ref, c.tol);
+
+      if (scalar_gemv[i].empty()) {
+        scalar_gemv[i] = gemv;
+        scalar_gemm[i] = gemm;
+        continue;
+      }
+      // Both sides round the input to int8 the same way, so the quantized
+      // formats only differ by summation order here.
+      std::vector<float> tol(gemv.size());
+      for (size_t j = 0; j < tol.size(); ++j) {
+        tol[j] = 1e-4 * (std::abs(scalar_gemv[i][j]) + 1) + 1e-5 * cols;
+      }
+      set_failures +=
+          Check("gemv vs scalar", kernels, c, gemv, scalar_gemv[i], tol);
+      set_failures +=
+          Check("gemm vs scalar", kernels, c, gemm, scalar_gemm[i], tol);
+    }
+    std::cout << kernels << ": " << cases.size() << " cases, "
+              << set_failures << " mismatches" << std::endl;
+    failures += set_failures;
+    ++tested;
+  }
+
+  if (tested == 0 || failures > 0) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,108 @@
+// Check that SampleDistribution is a proper distribution and that the
+// rejection rule of speculative decoding reproduces it, including low
+// temperatures over a full vocabulary, where (max - min) / temperature is
+// far beyond the range of exp.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "sampler.hpp"
+
+namespace {
+
+struct Config {
+  int n;           // vocabulary
+  float spread;    // standard deviation of the target logits
+  float temperature;
+  int top_k;
+  float top_p;
+  int draws;
+  float tolerance; // on any token's frequency
+};
+
+const Config kConfigs[] = {
+    {50, 1.5, 1, 0, 1, 400000, 0.005},
+    {50, 1.5, 0.7, 10, 1, 400000, 0.005},
+    {50, 1.5, 1.2, 0, 0.8, 400000, 0.005},
+    {50, 1.5, 1, 20, 0.9, 400000, 0.005},
+    {32000, 3, 0.1, 0, 1, 20000, 0.02},
+    {32000, 3, 0.1, 0, 0.9, 20000, 0.02},
+};
+
+// Returns false and prints why if the case fails.
+bool Run(const Config& c) {
+  const int n = c.n;
+  std::mt19937 rng(3);
+  std::normal_distribution<float> normal(0, c.spread);
+  // The draft sees the target logits with a little noise.
+  std::vector<float> target(n), draft(n);
+  for (int i = 0; i < n; ++i) {
+    target[i] = normal(rng);
+    draft[i] = target[i] + normal(rng) * 0.05f;
+  }
+
+  swan::Sampler sampler;
+  swan::InitSampler(sampler, c.temperature, c.top_k, c.top_p, 42);
+  std::vector<float> p(n), q(n);
+  swan::SampleDistribution(sampler, target.data(), n, p.data());
+  swan::SampleDistribution(sampler, draft.data(), n, q.data());
+
+  double p_sum = 0;
+  double q_sum = 0;
+  for (int i = 0; i < n; ++i) {
+    if (!std::isfinite(p[i]) || !std::isfinite(q[i]) || p[i] < 0 ||
+        q[i] < 0) {
+      std::cout << "token " << i << " has probability " << p[i] << " / "
+                << q[i] << std::endl;
+      return false;
+    }
+    p_sum += p[i];
+    q_sum += q[i];
+  }
+  if (std::abs(p_sum - 1) > 1e-4 || std::abs(q_sum - 1) > 1e-4) {
+    std::cout << "probabilities sum to " << p_sum << " / " << q_sum
+              << std::endl;
+    return false;
+  }
+
+  // Draw from the draft, keep or redraw as speculative decoding does, and
+  // compare the frequencies with the target distribution.
+  std::vector<int> count(n, 0);
+  for (int i = 0; i < c.draws; ++i) {
+    const int token = swan::SampleFrom(sampler, q.data(), n);
+    const int kept =
+        swan::AcceptDraft(sampler, p[token], q[token])
+            ? token
+            : swan::SampleResidual(sampler, p.data(), q.data(), n);
+    ++count[kept];
+  }
+  double deviation = 0;
+  for (int i = 0; i < n; ++i) {
+    deviation = std::max(
+        deviation, std::abs(static_cast<double>(count[i]) / c.draws - p[i]));
+  }
+  if (deviation > c.tolerance) {
+    std::cout << "speculative frequencies deviate by " << deviation
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+
+int main() {
+  int failures = 0;
+  for (const Config& c : kConfigs) {
+    const bool ok = Run(c);
+    std::cout << (ok ? "ok  " : "FAIL") << " n " << c.n << " temperature "
+              << c.temperature << " top_k " << c.top_k << " top_p "
+              << c.top_p << std::endl;
+    failures += !ok;
+  }
+  return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}